@@ -23,6 +23,7 @@
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
 #include "hw/hw.h"
 #include "hw/pci/msi.h"
@@ -65,9 +66,13 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* Address spaces with their own memory slots, e.g. SMRAM on x86 */
+#define KVM_MAX_ADDRESS_SPACES  2
+
 struct KVMParkedVcpu {
     unsigned long vcpu_id;
     int kvm_fd;
+    uint32_t dirty_ring_index;
     QLIST_ENTRY(KVMParkedVcpu) node;
 };
 
@@ -105,8 +110,14 @@ struct KVMState
     QTAILQ_HEAD(, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    KVMMemoryListener *as_listeners[KVM_MAX_ADDRESS_SPACES];
     QLIST_HEAD(, KVMParkedVcpu) kvm_parked_vcpus;
 
+    /* entries of each vCPU dirty ring, 0 when the dirty bitmap is used */
+    uint32_t dirty_ring_size;
+    uint64_t dirty_ring_bytes;
+    QemuThread dirty_ring_reaper;
+
     /* memory encryption */
     void *memcrypt_handle;
     int (*memcrypt_encrypt_data)(void *handle, uint8_t *ptr, uint64_t len);
@@ -283,6 +294,8 @@ static int kvm_set_user_memory_region(KVMMemoryListener *kml, KVMSlot *slot, boo
     return ret;
 }
 
+static uint64_t kvm_dirty_ring_reap(KVMState *s);
+
 int kvm_destroy_vcpu(CPUState *cpu)
 {
     KVMState *s = kvm_state;
@@ -304,16 +317,28 @@ int kvm_destroy_vcpu(CPUState *cpu)
         goto err;
     }
 
+    if (cpu->kvm_dirty_gfns) {
+        /* the ring stays with the vCPU fd, collect it before parking it */
+        kvm_dirty_ring_reap(s);
+        ret = munmap(cpu->kvm_dirty_gfns, s->dirty_ring_bytes);
+        if (ret < 0) {
+            goto err;
+        }
+        cpu->kvm_dirty_gfns = NULL;
+    }
+
     vcpu = g_malloc0(sizeof(*vcpu));
     vcpu->vcpu_id = kvm_arch_vcpu_id(cpu);
     vcpu->kvm_fd = cpu->kvm_fd;
+    vcpu->dirty_ring_index = cpu->kvm_fetch_index;
     QLIST_INSERT_HEAD(&kvm_state->kvm_parked_vcpus, vcpu, node);
 err:
     return ret;
 }
 
-static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
+static int kvm_get_vcpu(KVMState *s, CPUState *vcpu)
 {
+    unsigned long vcpu_id = kvm_arch_vcpu_id(vcpu);
     struct KVMParkedVcpu *cpu;
 
     QLIST_FOREACH(cpu, &s->kvm_parked_vcpus, node) {
@@ -322,11 +347,13 @@ static int kvm_get_vcpu(KVMState *s, unsigned long vcpu_id)
 
             QLIST_REMOVE(cpu, node);
             kvm_fd = cpu->kvm_fd;
+            vcpu->kvm_fetch_index = cpu->dirty_ring_index;
             g_free(cpu);
             return kvm_fd;
         }
     }
 
+    vcpu->kvm_fetch_index = 0;
     return kvm_vm_ioctl(s, KVM_CREATE_VCPU, (void *)vcpu_id);
 }
 
@@ -338,7 +365,7 @@ int kvm_init_vcpu(CPUState *cpu)
 
     DPRINTF("kvm_init_vcpu\n");
 
-    ret = kvm_get_vcpu(s, kvm_arch_vcpu_id(cpu));
+    ret = kvm_get_vcpu(s, cpu);
     if (ret < 0) {
         DPRINTF("kvm_create_vcpu failed\n");
         goto err;
@@ -368,6 +395,19 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL, s->dirty_ring_bytes,
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -527,6 +567,179 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     return 0;
 }
 
+/*
+ * Dirty ring
+ *
+ * With a dirty ring, KVM pushes the frame number of each page written by a
+ * vCPU to a ring shared with QEMU instead of setting a bit in the dirty
+ * bitmap of the slot.  Collecting the dirty pages then costs in proportion
+ * to the number of pages that were written, not to the size of the guest.
+ *
+ * All rings are harvested with the BQL held: periodically by the reaper
+ * thread, by a vCPU whose ring is full, and on every dirty log sync.
+ */
+
+#define KVM_DIRTY_RING_REAPER_PERIOD_MS 1000
+
+static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
+                                     uint32_t slot_id, uint64_t offset)
+{
+    KVMMemoryListener *kml;
+    KVMSlot *mem;
+
+    if (as_id >= ARRAY_SIZE(s->as_listeners) || !s->as_listeners[as_id] ||
+        slot_id >= s->nr_slots) {
+        trace_kvm_dirty_ring_invalid(as_id, slot_id, offset);
+        return;
+    }
+
+    kml = s->as_listeners[as_id];
+    mem = &kml->slots[slot_id];
+    if (offset >= mem->memory_size / getpagesize()) {
+        /* the slot went away after the page was pushed */
+        trace_kvm_dirty_ring_invalid(as_id, slot_id, offset);
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(mem->ram_start_offset +
+                                        offset * getpagesize(),
+                                        getpagesize(),
+                                        tcg_enabled() ? DIRTY_CLIENTS_ALL :
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *gfn;
+    uint32_t count = 0;
+
+    for (;;) {
+        gfn = &cpu->kvm_dirty_gfns[cpu->kvm_fetch_index &
+                                   (s->dirty_ring_size - 1)];
+        if (!(atomic_load_acquire(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        kvm_dirty_ring_mark_page(s, gfn->slot >> 16, gfn->slot & 0xffff,
+                                 gfn->offset);
+        /* hand the entry back, KVM recycles it on KVM_RESET_DIRTY_RINGS */
+        atomic_store_release(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+    cpu->dirty_pages += count;
+
+    return count;
+}
+
+/* Called with the BQL held */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    int64_t start = get_clock();
+    uint64_t total = 0;
+    CPUState *cpu;
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->kvm_dirty_gfns) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            error_report("KVM_RESET_DIRTY_RINGS failed: %s", strerror(-ret));
+            abort();
+        }
+    }
+
+    trace_kvm_dirty_ring_reap(total, (get_clock() - start) / SCALE_US);
+    return total;
+}
+
+static void do_kvm_dirty_ring_kick(CPUState *cpu, run_on_cpu_data arg)
+{
+    /* Nothing to do, leaving KVM_RUN flushed the pages the vCPU wrote */
+}
+
+/*
+ * Harvest every page written so far.  Some pages only reach the ring when
+ * the vCPU leaves the guest (e.g. with Intel PML), so kick them all first.
+ */
+static void kvm_dirty_ring_flush(KVMState *s)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        run_on_cpu(cpu, do_kvm_dirty_ring_kick, RUN_ON_CPU_NULL);
+    }
+    kvm_dirty_ring_reap(s);
+}
+
+bool kvm_dirty_ring_enabled(void)
+{
+    return kvm_state && kvm_state->dirty_ring_size;
+}
+
+/* Called with the BQL held */
+void kvm_dirty_ring_flush_all(void)
+{
+    if (kvm_dirty_ring_enabled()) {
+        kvm_dirty_ring_flush(kvm_state);
+    }
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        g_usleep(KVM_DIRTY_RING_REAPER_PERIOD_MS * 1000);
+
+        qemu_mutex_lock_iothread();
+        kvm_dirty_ring_reap(s);
+        qemu_mutex_unlock_iothread();
+    }
+
+    return NULL;
+}
+
+static int kvm_dirty_ring_init(KVMState *s, uint32_t size)
+{
+    uint64_t bytes = (uint64_t)size * sizeof(struct kvm_dirty_gfn);
+    int max, ret;
+
+    if (!size) {
+        return 0;
+    }
+
+    max = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max <= 0) {
+        warn_report("KVM dirty ring not supported by the host, "
+                    "using the dirty bitmap");
+        return 0;
+    }
+    if (bytes > max) {
+        error_report("kvm-dirty-ring-size %u is larger than the maximum "
+                     "of %zu entries", size,
+                     max / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, bytes);
+    if (ret) {
+        error_report("Enabling the KVM dirty ring failed: %s",
+                     strerror(-ret));
+        return ret;
+    }
+
+    s->dirty_ring_size = size;
+    s->dirty_ring_bytes = bytes;
+    return 0;
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -792,7 +1005,15 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             return;
         }
         if (mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_physical_sync_dirty_bitmap(kml, section);
+            if (kvm_state->dirty_ring_size) {
+                /*
+                 * Best effort: pages still in the PML buffers of running
+                 * vCPUs are dropped with the slot.
+                 */
+                kvm_dirty_ring_reap(kvm_state);
+            } else {
+                kvm_physical_sync_dirty_bitmap(kml, section);
+            }
         }
 
         /* unregister the slot */
@@ -812,6 +1033,9 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     mem->memory_size = size;
     mem->start_addr = start_addr;
     mem->ram = ram;
+    mem->ram_start_offset = memory_region_get_ram_addr(mr) +
+                            section->offset_within_region +
+                            (start_addr - section->offset_within_address_space);
     mem->flags = kvm_mem_flags(mr);
 
     err = kvm_set_user_memory_region(kml, mem, true);
@@ -852,6 +1076,11 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_flush(kvm_state);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -929,6 +1158,9 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
 
+    assert(as_id < ARRAY_SIZE(s->as_listeners));
+    s->as_listeners[as_id] = kml;
+
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
     }
@@ -937,7 +1169,17 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (s->dirty_ring_size) {
+        /*
+         * The rings hold the pages of every address space, so reap them
+         * from one listener only, not once per address space.
+         */
+        if (as_id == 0) {
+            kml->listener.log_sync_global = kvm_log_sync_global;
+        }
+    } else {
+        kml->listener.log_sync = kvm_log_sync;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -1626,6 +1868,12 @@ static int kvm_init(MachineState *ms)
 
     s->vmfd = ret;
 
+    /* must be enabled before any vCPU is created */
+    ret = kvm_dirty_ring_init(s, machine_kvm_dirty_ring_size(ms));
+    if (ret < 0) {
+        goto err;
+    }
+
     /* check the vcpu limits */
     soft_vcpus_limit = kvm_recommended_vcpus(s);
     hard_vcpus_limit = kvm_max_vcpus(s);
@@ -1748,6 +1996,12 @@ static int kvm_init(MachineState *ms)
         qemu_balloon_inhibit(true);
     }
 
+    if (s->dirty_ring_size) {
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     return 0;
 
 err:
@@ -2055,6 +2309,14 @@ int kvm_cpu_exec(CPUState *cpu)
         case KVM_EXIT_INTERNAL_ERROR:
             ret = kvm_handle_internal_error(cpu, run);
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            /* Do not wait for the reaper, the vCPU cannot run until then */
+            trace_kvm_dirty_ring_full(cpu->cpu_index);
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_SYSTEM_EVENT:
             switch (run->system_event.type) {
             case KVM_SYSTEM_EVENT_SHUTDOWN:
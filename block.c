@@ -376,6 +376,11 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    for (i = 0; i < BDRV_TRACKED_SHARDS; i++) {
+        qemu_co_mutex_init(&bs->tracked_requests[i].lock);
+        QLIST_INIT(&bs->tracked_requests[i].requests);
+        qemu_co_queue_init(&bs->tracked_requests[i].wait_queue);
+    }
     qemu_co_mutex_init(&bs->reqs_lock);
     qemu_mutex_init(&bs->dirty_bitmap_mutex);
     bs->refcnt = 1;
@@ -4128,6 +4133,25 @@ bool bdrv_is_sg(BlockDriverState *bs)
     return bs->sg;
 }
 
+/**
+ * Return whether requests for @bs may be submitted from several AioContexts
+ * concurrently.  This needs every node below @bs to support it as well.
+ */
+bool bdrv_supports_multiqueue(BlockDriverState *bs)
+{
+    BdrvChild *child;
+
+    if (!bs->drv || !bs->drv->supports_multiqueue) {
+        return false;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (!bdrv_supports_multiqueue(child->bs)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 bool bdrv_is_encrypted(BlockDriverState *bs)
 {
     if (bs->backing && bs->backing->bs->encrypted) {
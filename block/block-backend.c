@@ -73,6 +73,13 @@ struct BlockBackend {
 
     bool allow_write_beyond_eof;
 
+    /*
+     * Set while a device submits requests from several IOThreads.  AIO
+     * requests then run and complete in the submitting thread's AioContext
+     * rather than in the BlockBackend's.
+     */
+    bool multiqueue;
+
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
     QLIST_HEAD(, BlockBackendAioNotifier) aio_notifiers;
 
@@ -1084,6 +1091,25 @@ void blk_set_allow_write_beyond_eof(BlockBackend *blk, bool allow)
     blk->allow_write_beyond_eof = allow;
 }
 
+/*
+ * Let AIO requests run in the AioContext of the thread that submits them.
+ * The caller must make sure that every node below @blk supports this, see
+ * bdrv_supports_multiqueue().
+ */
+void blk_set_multiqueue(BlockBackend *blk, bool multiqueue)
+{
+    blk->multiqueue = multiqueue;
+}
+
+/* Return the AioContext in which an AIO request submitted now runs */
+static AioContext *blk_request_aio_context(BlockBackend *blk)
+{
+    if (blk->multiqueue) {
+        return qemu_get_current_aio_context();
+    }
+    return blk_get_aio_context(blk);
+}
+
 static int blk_check_byte_request(BlockBackend *blk, int64_t offset,
                                   size_t size)
 {
@@ -1262,6 +1288,10 @@ void blk_dec_in_flight(BlockBackend *blk)
 {
     atomic_dec(&blk->in_flight);
     aio_wait_kick();
+    if (blk->multiqueue) {
+        /* A drain may be polling the home AioContext from its IOThread */
+        aio_notify(blk_get_aio_context(blk));
+    }
 }
 
 static void error_callback_bh(void *opaque)
@@ -1284,7 +1314,8 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    aio_bh_schedule_oneshot(blk_get_aio_context(blk), error_callback_bh, acb);
+    aio_bh_schedule_oneshot(blk_request_aio_context(blk), error_callback_bh,
+                            acb);
     return &acb->common;
 }
 
@@ -1320,6 +1351,7 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
                                 BdrvRequestFlags flags,
                                 BlockCompletionFunc *cb, void *opaque)
 {
+    AioContext *ctx = blk_request_aio_context(blk);
     BlkAioEmAIOCB *acb;
     Coroutine *co;
 
@@ -1335,13 +1367,16 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     acb->bytes = bytes;
     acb->has_returned = false;
 
+    /*
+     * @ctx is the current AioContext for multi-queue BlockBackends, so the
+     * coroutine is entered right here and can only complete in this thread
+     */
     co = qemu_coroutine_create(co_entry, acb);
-    bdrv_coroutine_enter(blk_bs(blk), co);
+    aio_co_enter(ctx, co);
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        aio_bh_schedule_oneshot(blk_get_aio_context(blk),
-                                blk_aio_complete_bh, acb);
+        aio_bh_schedule_oneshot(ctx, blk_aio_complete_bh, acb);
     }
 
     return &acb->common;
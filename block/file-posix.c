@@ -151,6 +151,7 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool use_linux_aio:1;
+    bool use_linux_io_uring:1;
     bool page_cache_inconsistent:1;
     bool has_fallocate;
     bool needs_alignment;
@@ -410,7 +411,7 @@ static QemuOptsList raw_runtime_opts = {
         {
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },
         {
             .name = "locking",
@@ -460,9 +461,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
 
-    aio_default = (bdrv_flags & BDRV_O_NATIVE_AIO)
-                  ? BLOCKDEV_AIO_OPTIONS_NATIVE
-                  : BLOCKDEV_AIO_OPTIONS_THREADS;
+    if (bdrv_flags & BDRV_O_NATIVE_AIO) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_NATIVE;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (bdrv_flags & BDRV_O_IO_URING) {
+        aio_default = BLOCKDEV_AIO_OPTIONS_IO_URING;
+#endif
+    } else {
+        aio_default = BLOCKDEV_AIO_OPTIONS_THREADS;
+    }
     aio = qapi_enum_parse(&BlockdevAioOptions_lookup,
                           qemu_opt_get(opts, "aio"),
                           aio_default, &local_err);
@@ -472,6 +479,12 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         goto fail;
     }
     s->use_linux_aio = (aio == BLOCKDEV_AIO_OPTIONS_NATIVE);
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = (aio == BLOCKDEV_AIO_OPTIONS_IO_URING);
+#else
+    /* Only reachable with -drive aio=io_uring, which is refused below */
+    s->use_linux_io_uring = !!(bdrv_flags & BDRV_O_IO_URING);
+#endif
 
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
@@ -568,6 +581,22 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+            error_prepend(errp, "Unable to use io_uring: ");
+            goto fail;
+        }
+    }
+#else
+    if (s->use_linux_io_uring) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     if ((bs->open_flags & BDRV_O_NOCACHE) != 0) {
@@ -641,6 +670,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    /*
+     * Only register the file once nothing can fail anymore: the ring keeps
+     * its own reference, so a stale entry would outlive the file descriptor.
+     */
+    if (s->use_linux_io_uring) {
+        luring_register_fd(aio_get_linux_io_uring(bdrv_get_aio_context(bs)),
+                           s->fd);
+    }
+#endif
+
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
     ret = 0;
 fail:
@@ -956,6 +996,15 @@ static void raw_reopen_commit(BDRVReopenState *state)
         /* shouldn't fail in a sane host, but report it just in case. */
         error_report_err(local_err);
     }
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio =
+            aio_get_linux_io_uring(bdrv_get_aio_context(state->bs));
+        luring_unregister_fd(aio, s->fd);
+        luring_register_fd(aio, rs->fd);
+    }
+#endif
+
     qemu_close(s->fd);
     s->fd = rs->fd;
 
@@ -1779,11 +1828,32 @@ out:
     return result;
 }
 
+/*
+ * Requests run in the AioContext of the thread that submits them.  This is
+ * the node's own AioContext, unless the node serves a multi-queue device
+ * that submits from several IOThreads at once.  The Linux AIO and io_uring
+ * state of the node's AioContext is set up when the node is opened or
+ * moved; other AioContexts get theirs on the first raw_aio_plug(), and go
+ * through the thread pool until then.
+ */
+#ifdef CONFIG_LINUX_AIO
+static LinuxAioState *raw_get_linux_aio(void)
+{
+    return qemu_get_current_aio_context()->linux_aio;
+}
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+static LuringState *raw_get_linux_io_uring(void)
+{
+    return qemu_get_current_aio_context()->linux_io_uring;
+}
+#endif
+
 static int coroutine_fn raw_thread_pool_submit(BlockDriverState *bs,
                                                ThreadPoolFunc func, void *arg)
 {
-    /* @bs can be NULL, bdrv_get_aio_context() returns the main context then */
-    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    ThreadPool *pool = aio_get_thread_pool(qemu_get_current_aio_context());
     return thread_pool_submit_co(pool, func, arg);
 }
 
@@ -1802,16 +1872,20 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
      * If this is the case tell the low-level driver that it needs
      * to copy the buffer.
      */
-    if (s->needs_alignment) {
-        if (!bdrv_qiov_is_aligned(bs, qiov)) {
-            type |= QEMU_AIO_MISALIGNED;
+    if (s->needs_alignment && !bdrv_qiov_is_aligned(bs, qiov)) {
+        type |= QEMU_AIO_MISALIGNED;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (s->use_linux_io_uring && raw_get_linux_io_uring()) {
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, raw_get_linux_io_uring(), s->fd, offset,
+                                qiov, type);
+#endif
 #ifdef CONFIG_LINUX_AIO
-        } else if (s->use_linux_aio) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-            assert(qiov->size == bytes);
-            return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
+    } else if (s->use_linux_aio && raw_get_linux_aio()) {
+        assert(qiov->size == bytes);
+        return laio_co_submit(bs, raw_get_linux_aio(), s->fd, offset, qiov,
+                              type);
 #endif
-        }
     }
 
     acb = (RawPosixAIOData) {
@@ -1847,22 +1921,37 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
+    AioContext __attribute__((unused)) *ctx = qemu_get_current_aio_context();
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
     if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_plug(bs, aio);
+        LinuxAioState *aio = aio_setup_linux_aio(ctx, NULL);
+        if (aio) {
+            laio_io_plug(bs, aio);
+        }
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_setup_linux_io_uring(ctx, NULL);
+        if (aio) {
+            luring_io_plug(bs, aio);
+        }
     }
 #endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+    BDRVRawState __attribute__((unused)) *s = bs->opaque;
 #ifdef CONFIG_LINUX_AIO
-    BDRVRawState *s = bs->opaque;
-    if (s->use_linux_aio) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
-        laio_io_unplug(bs, aio);
+    if (s->use_linux_aio && raw_get_linux_aio()) {
+        laio_io_unplug(bs, raw_get_linux_aio());
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && raw_get_linux_io_uring()) {
+        luring_io_unplug(bs, raw_get_linux_io_uring());
     }
 #endif
 }
@@ -1878,6 +1967,21 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && raw_get_linux_io_uring()) {
+        if (s->page_cache_inconsistent) {
+            return -EIO;
+        }
+        ret = luring_co_submit(bs, raw_get_linux_io_uring(), s->fd, 0, NULL,
+                               QEMU_AIO_FLUSH);
+        if (ret < 0 && (s->open_flags & O_DIRECT) == 0) {
+            /* See handle_aiocb_flush() */
+            s->page_cache_inconsistent = true;
+        }
+        return ret;
+    }
+#endif
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -1901,6 +2005,52 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
         }
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        LuringState *aio = aio_setup_linux_io_uring(new_context, &local_err);
+        if (!aio) {
+            error_reportf_err(local_err, "Unable to use linux io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        } else {
+            luring_register_fd(aio, s->fd);
+        }
+    }
+#endif
+}
+
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_unregister_fd(aio, s->fd);
+    }
+#endif
+}
+
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_register_buf(aio, host, size);
+    }
+#endif
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_unregister_buf(aio, host);
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -1908,6 +2058,12 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_linux_io_uring) {
+            LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+            luring_unregister_fd(aio, s->fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -2584,6 +2740,22 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int bytes, bool blkdev)
         acb.aio_type |= QEMU_AIO_BLKDEV;
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && raw_get_linux_io_uring() && !blkdev &&
+        s->has_discard) {
+        int ret = luring_co_pdiscard(bs, raw_get_linux_io_uring(), s->fd,
+                                     offset, bytes);
+
+        /*
+         * Kernels without IORING_OP_FALLOCATE fail with -EINVAL; let the
+         * thread pool sort out whether discard works at all.
+         */
+        if (ret != -EINVAL && ret != -EOPNOTSUPP && ret != -ENOTSUP) {
+            return ret;
+        }
+    }
+#endif
+
     return raw_thread_pool_submit(bs, handle_aiocb_discard, &acb);
 }
 
@@ -2753,9 +2925,13 @@ BlockDriver bdrv_file = {
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+    .supports_multiqueue = true,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3227,9 +3403,13 @@ static BlockDriver bdrv_host_device = {
     .bdrv_co_copy_range_from = raw_co_copy_range_from,
     .bdrv_co_copy_range_to  = raw_co_copy_range_to,
     .bdrv_refresh_limits = raw_refresh_limits,
+    .supports_multiqueue = true,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3353,6 +3533,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3484,6 +3665,7 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
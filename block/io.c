@@ -584,6 +584,48 @@ void bdrv_drain_all(void)
     bdrv_drain_all_end();
 }
 
+/**
+ * Return the bitmask of the tracked request shards that index a region
+ */
+static uint32_t tracked_request_shards(int64_t offset, uint64_t bytes)
+{
+    uint64_t first = offset >> BDRV_TRACKED_CHUNK_BITS;
+    uint64_t last = (offset + MAX(bytes, 1) - 1) >> BDRV_TRACKED_CHUNK_BITS;
+    uint32_t shards = 0;
+    uint64_t chunk;
+
+    QEMU_BUILD_BUG_ON(BDRV_TRACKED_SHARDS > 32);
+
+    if (last - first >= BDRV_TRACKED_SHARDS - 1) {
+        return MAKE_64BIT_MASK(0, BDRV_TRACKED_SHARDS);
+    }
+    for (chunk = first; chunk <= last; chunk++) {
+        shards |= 1u << (chunk % BDRV_TRACKED_SHARDS);
+    }
+    return shards;
+}
+
+/**
+ * Link a tracked request into the shards in @shards that do not have it yet
+ */
+static void tracked_request_link(BdrvTrackedRequest *req, uint32_t shards)
+{
+    int i;
+
+    shards &= ~req->shards;
+    req->shards |= shards;
+
+    for (i = 0; i < BDRV_TRACKED_SHARDS; i++) {
+        BdrvTrackedShard *shard = &req->bs->tracked_requests[i];
+
+        if (shards & (1u << i)) {
+            qemu_co_mutex_lock(&shard->lock);
+            QLIST_INSERT_HEAD(&shard->requests, req, list[i]);
+            qemu_co_mutex_unlock(&shard->lock);
+        }
+    }
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -591,14 +633,22 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    int i;
+
     if (req->serialising) {
         atomic_dec(&req->bs->serialising_in_flight);
     }
 
-    qemu_co_mutex_lock(&req->bs->reqs_lock);
-    QLIST_REMOVE(req, list);
-    qemu_co_queue_restart_all(&req->wait_queue);
-    qemu_co_mutex_unlock(&req->bs->reqs_lock);
+    for (i = 0; i < BDRV_TRACKED_SHARDS; i++) {
+        BdrvTrackedShard *shard = &req->bs->tracked_requests[i];
+
+        if (req->shards & (1u << i)) {
+            qemu_co_mutex_lock(&shard->lock);
+            QLIST_REMOVE(req, list[i]);
+            qemu_co_queue_restart_all(&shard->wait_queue);
+            qemu_co_mutex_unlock(&shard->lock);
+        }
+    }
 }
 
 /**
@@ -623,11 +673,7 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .overlap_bytes  = bytes,
     };
 
-    qemu_co_queue_init(&req->wait_queue);
-
-    qemu_co_mutex_lock(&bs->reqs_lock);
-    QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
-    qemu_co_mutex_unlock(&bs->reqs_lock);
+    tracked_request_link(req, tracked_request_shards(offset, bytes));
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -643,6 +689,10 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    /* The widened region may reach into chunks of other shards */
+    tracked_request_link(req, tracked_request_shards(req->overlap_offset,
+                                                     req->overlap_bytes));
 }
 
 static bool is_request_serialising_and_aligned(BdrvTrackedRequest *req)
@@ -720,47 +770,95 @@ void bdrv_dec_in_flight(BlockDriverState *bs)
     bdrv_wakeup(bs);
 }
 
-static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
+bool bdrv_has_tracked_requests(BlockDriverState *bs)
+{
+    int i;
+
+    for (i = 0; i < BDRV_TRACKED_SHARDS; i++) {
+        if (!QLIST_EMPTY(&bs->tracked_requests[i].requests)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Wait for the requests in one shard that overlap @self.  Returns true
+ * if it waited, in which case the caller must look at all shards again.
+ */
+static bool coroutine_fn wait_serialising_requests_in_shard(
+    BdrvTrackedRequest *self, int i)
 {
     BlockDriverState *bs = self->bs;
+    BdrvTrackedShard *shard = &bs->tracked_requests[i];
     BdrvTrackedRequest *req;
+    bool waited = false;
+
+    qemu_co_mutex_lock(&shard->lock);
+    QLIST_FOREACH(req, &shard->requests, list[i]) {
+        if (req == self || (!req->serialising && !self->serialising)) {
+            continue;
+        }
+        if (tracked_request_overlaps(req, self->overlap_offset,
+                                     self->overlap_bytes))
+        {
+            /*
+             * Hitting this means there was a reentrant request, for
+             * example, a block driver issuing nested requests.  This must
+             * never happen since it means deadlock.
+             */
+            assert(qemu_coroutine_self() != req->co);
+
+            /*
+             * If the request is already (indirectly) waiting for us, or
+             * will wait for us as soon as it wakes up, then just go on
+             * (instead of producing a deadlock in the former case).
+             *
+             * Two requests may find each other in different shards, so
+             * the decision is taken under reqs_lock.  The shard lock is
+             * kept until we sleep, so @req cannot complete in between.
+             */
+            qemu_co_mutex_lock(&bs->reqs_lock);
+            if (!req->waiting_for) {
+                self->waiting_for = req;
+                waited = true;
+            }
+            qemu_co_mutex_unlock(&bs->reqs_lock);
+
+            if (waited) {
+                qemu_co_queue_wait(&shard->wait_queue, &shard->lock);
+                qemu_co_mutex_lock(&bs->reqs_lock);
+                self->waiting_for = NULL;
+                qemu_co_mutex_unlock(&bs->reqs_lock);
+                break;
+            }
+        }
+    }
+    qemu_co_mutex_unlock(&shard->lock);
+
+    return waited;
+}
+
+static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
+{
+    uint32_t shards;
     bool retry;
     bool waited = false;
+    int i;
 
-    if (!atomic_read(&bs->serialising_in_flight)) {
+    if (!atomic_read(&self->bs->serialising_in_flight)) {
         return false;
     }
 
+    shards = tracked_request_shards(self->overlap_offset, self->overlap_bytes);
     do {
         retry = false;
-        qemu_co_mutex_lock(&bs->reqs_lock);
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue, &bs->reqs_lock);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
+        for (i = 0; i < BDRV_TRACKED_SHARDS && !retry; i++) {
+            if (shards & (1u << i)) {
+                retry = wait_serialising_requests_in_shard(self, i);
             }
         }
-        qemu_co_mutex_unlock(&bs->reqs_lock);
+        waited |= retry;
     } while (retry);
 
     return waited;
@@ -2890,13 +2988,19 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BdrvChild *child;
+    BlockDriver *drv = bs->drv;
 
     QLIST_FOREACH(child, &bs->children, next) {
         bdrv_io_plug(child->bs);
     }
 
-    if (atomic_fetch_inc(&bs->io_plugged) == 0) {
-        BlockDriver *drv = bs->drv;
+    /*
+     * Multi-queue drivers may be plugged from several threads at once, so
+     * the outermost plug of one thread is not necessarily the first one.
+     * They keep their own nesting count.
+     */
+    if (atomic_fetch_inc(&bs->io_plugged) == 0 ||
+        (drv && drv->supports_multiqueue)) {
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
         }
@@ -2906,10 +3010,11 @@ void bdrv_io_plug(BlockDriverState *bs)
 void bdrv_io_unplug(BlockDriverState *bs)
 {
     BdrvChild *child;
+    BlockDriver *drv = bs->drv;
 
     assert(bs->io_plugged);
-    if (atomic_fetch_dec(&bs->io_plugged) == 1) {
-        BlockDriver *drv = bs->drv;
+    if (atomic_fetch_dec(&bs->io_plugged) == 1 ||
+        (drv && drv->supports_multiqueue)) {
         if (drv && drv->bdrv_io_unplug) {
             drv->bdrv_io_unplug(bs);
         }
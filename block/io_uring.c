@@ -0,0 +1,620 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright (c) 2026 QEMU contributors
+ *
+ * Authors:
+ *  QEMU block layer contributors <qemu-block@nongnu.org>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qemu/error-report.h"
+#include "qapi/error.h"
+#include "trace.h"
+
+#include <liburing.h>
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+#include <linux/falloc.h>
+#endif
+
+/* io_uring ring size */
+#define MAX_ENTRIES 128
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    LuringState *ctx;
+    int fd;
+    int type;
+    uint64_t offset;
+    uint64_t nbytes;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+
+    /*
+     * Buffered I/O may return short reads before EOF.  The rest of the
+     * request is then resubmitted using @resubmit_qiov, which covers the
+     * part of @qiov after the first @total_read bytes.
+     */
+    size_t total_read;
+    QEMUIOVector resubmit_qiov;
+
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch.  Protected by AioContext lock. */
+    LuringQueue io_q;
+
+    /* I/O completion processing.  Only runs in I/O thread.  */
+    QEMUBH *completion_bh;
+
+    /*
+     * File descriptors and buffers registered with the ring.  Requests are
+     * matched against them when they are copied to the submission queue,
+     * so the tables can change while requests are waiting in io_q.
+     */
+    GArray *files;
+    GArray *bufs;
+};
+
+static void ioq_submit(LuringState *s);
+
+/**
+ * luring_find_file:
+ * @s: AIO state
+ * @fd: file descriptor
+ *
+ * Returns the index of @fd in the registered files table, or -1 if @fd
+ * has not been registered.
+ */
+static int luring_find_file(LuringState *s, int fd)
+{
+    int i;
+
+    for (i = 0; i < s->files->len; i++) {
+        if (g_array_index(s->files, int, i) == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * luring_find_buf:
+ * @s: AIO state
+ * @base: start of the I/O buffer
+ * @len: length of the I/O buffer
+ *
+ * Returns the index of the registered buffer that covers all of
+ * [@base, @base + @len), or -1 if there is none.
+ */
+static int luring_find_buf(LuringState *s, void *base, size_t len)
+{
+    uintptr_t start = (uintptr_t)base;
+    int i;
+
+    for (i = 0; i < s->bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->bufs, struct iovec, i);
+        uintptr_t buf = (uintptr_t)iov->iov_base;
+
+        if (start >= buf && start - buf + len <= iov->iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Fills in @sqe for the part of @luringcb that has not completed yet,
+ * using a fixed buffer and a registered file where possible.
+ */
+static void luring_prep_sqe(LuringState *s, LuringAIOCB *luringcb,
+                            struct io_uring_sqe *sqe)
+{
+    QEMUIOVector *qiov = luringcb->qiov;
+    uint64_t offset = luringcb->offset;
+    int fd = luringcb->fd;
+    int index = -1;
+
+    if (luringcb->total_read) {
+        qiov = &luringcb->resubmit_qiov;
+        offset += luringcb->total_read;
+    }
+    if (qiov && qiov->niov == 1) {
+        index = luring_find_buf(s, qiov->iov[0].iov_base,
+                                qiov->iov[0].iov_len);
+    }
+
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+        if (index >= 0) {
+            io_uring_prep_write_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                      qiov->iov[0].iov_len, offset, index);
+        } else {
+            io_uring_prep_writev(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_READ:
+        if (index >= 0) {
+            io_uring_prep_read_fixed(sqe, fd, qiov->iov[0].iov_base,
+                                     qiov->iov[0].iov_len, offset, index);
+        } else {
+            io_uring_prep_readv(sqe, fd, qiov->iov, qiov->niov, offset);
+        }
+        break;
+    case QEMU_AIO_FLUSH:
+        io_uring_prep_fsync(sqe, fd, IORING_FSYNC_DATASYNC);
+        break;
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqe, fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                offset, luringcb->nbytes);
+        break;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+
+    index = luring_find_file(s, fd);
+    if (index >= 0) {
+        sqe->fd = index;
+        sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    io_uring_sqe_set_data(sqe, luringcb);
+}
+
+/*
+ * Puts a request back on the submission queue, e.g. after it was
+ * interrupted or only partially completed.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov = &luringcb->resubmit_qiov;
+
+    trace_luring_resubmit_short_read(s, luringcb, nread);
+
+    luringcb->total_read += nread;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      luringcb->qiov->size - luringcb->total_read);
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ * @s: AIO state
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks.
+ *
+ * Like qemu_laio_process_completions(), this supports nested event loops.
+ * The completion BH is scheduled while callbacks run so that a nested
+ * aio_poll() picks up the remaining cqes, and cancelled once the
+ * completion queue is empty.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    /* Reschedule so nested event loops see currently pending completions */
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0 && cqe) {
+        LuringAIOCB *luringcb = io_uring_cqe_get_data(cqe);
+        int ret = cqe->res;
+        size_t total;
+
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+        trace_luring_process_completion(s, luringcb, ret);
+
+        if (ret == -EINTR) {
+            luring_resubmit(s, luringcb);
+            continue;
+        }
+
+        if (ret >= 0 && luringcb->qiov) {
+            /* total_read is only non-zero for resubmitted reads */
+            total = luringcb->total_read + ret;
+            if (total == luringcb->qiov->size) {
+                ret = 0;
+            } else if (luringcb->type == QEMU_AIO_READ) {
+                if (ret > 0) {
+                    luring_resubmit_short_read(s, luringcb, ret);
+                    continue;
+                }
+                /* Short reads mean EOF, pad with zeros. */
+                qemu_iovec_memset(luringcb->qiov, total, 0,
+                                  luringcb->qiov->size - total);
+                ret = 0;
+            } else {
+                ret = -ENOSPC;
+            }
+        }
+
+        luringcb->ret = ret;
+        qemu_iovec_destroy(&luringcb->resubmit_qiov);
+
+        /*
+         * If the coroutine is already entered it must be in ioq_submit()
+         * and will notice luringcb->ret has been filled in when it
+         * eventually runs later.  Coroutines cannot be entered recursively
+         * so avoid doing that!
+         */
+        if (!qemu_coroutine_entered(luringcb->co)) {
+            aio_co_wake(luringcb->co);
+        }
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    LuringState *s = opaque;
+
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    LuringAIOCB *luringcb;
+    struct io_uring_sqe *sqe;
+    int ret;
+
+    while (s->io_q.in_queue > 0) {
+        while (!QSIMPLEQ_EMPTY(&s->io_q.submit_queue)) {
+            sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            luringcb = QSIMPLEQ_FIRST(&s->io_q.submit_queue);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+            luring_prep_sqe(s, luringcb, sqe);
+        }
+
+        ret = io_uring_submit(&s->ring);
+        trace_luring_io_uring_submit(s, ret);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            /*
+             * The sqes stay in the ring and are picked up by the next
+             * io_uring_submit(), which runs once a completion frees up
+             * some room.
+             */
+            break;
+        }
+
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    trace_luring_io_plug(s);
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    trace_luring_io_unplug(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_do_submit(LuringState *s, LuringAIOCB *luringcb)
+{
+    switch (luringcb->type) {
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_READ:
+    case QEMU_AIO_FLUSH:
+        break;
+    case QEMU_AIO_DISCARD:
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+        break;
+#else
+        return -ENOTSUP;
+#endif
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, luringcb->type);
+        return -EIO;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    trace_luring_do_submit(s, s->io_q.blocked, s->io_q.plugged,
+                           s->io_q.in_queue, s->io_q.in_flight);
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+
+    return 0;
+}
+
+static int coroutine_fn luring_co_do_submit(LuringState *s,
+                                            LuringAIOCB *luringcb)
+{
+    int ret;
+
+    ret = luring_do_submit(s, luringcb);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb->ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb->ret;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ctx        = s,
+        .fd         = fd,
+        .type       = type,
+        .offset     = offset,
+        .nbytes     = qiov ? qiov->size : 0,
+        .qiov       = qiov,
+        .ret        = -EINPROGRESS,
+    };
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, luringcb.nbytes,
+                           type);
+    return luring_co_do_submit(s, &luringcb);
+}
+
+int coroutine_fn luring_co_pdiscard(BlockDriverState *bs, LuringState *s,
+                                    int fd, uint64_t offset, uint64_t bytes)
+{
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ctx        = s,
+        .fd         = fd,
+        .type       = QEMU_AIO_DISCARD,
+        .offset     = offset,
+        .nbytes     = bytes,
+        .ret        = -EINPROGRESS,
+    };
+
+    trace_luring_co_submit(bs, s, &luringcb, fd, offset, bytes,
+                           QEMU_AIO_DISCARD);
+    return luring_co_do_submit(s, &luringcb);
+}
+
+/*
+ * Replaces the registered files table of the ring with s->files.  If the
+ * kernel refuses it, the table is emptied and requests use plain file
+ * descriptors.
+ */
+static void luring_update_files(LuringState *s, int old_len)
+{
+    int ret;
+
+    if (old_len) {
+        io_uring_unregister_files(&s->ring);
+    }
+    if (!s->files->len) {
+        return;
+    }
+
+    ret = io_uring_register_files(&s->ring, (int *)s->files->data,
+                                  s->files->len);
+    trace_luring_register_files(s, s->files->len, ret);
+    if (ret < 0) {
+        g_array_set_size(s->files, 0);
+    }
+}
+
+void luring_register_fd(LuringState *s, int fd)
+{
+    int old_len = s->files->len;
+
+    if (luring_find_file(s, fd) >= 0) {
+        return;
+    }
+    g_array_append_val(s->files, fd);
+    luring_update_files(s, old_len);
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int old_len = s->files->len;
+    int index = luring_find_file(s, fd);
+
+    if (index < 0) {
+        return;
+    }
+    g_array_remove_index(s->files, index);
+    luring_update_files(s, old_len);
+}
+
+/*
+ * Same as luring_update_files() for fixed buffers.  Registration pins the
+ * buffers, so it fails if RLIMIT_MEMLOCK is too low; in that case reads
+ * and writes keep using the vectored opcodes.
+ */
+static void luring_update_bufs(LuringState *s, int old_len)
+{
+    int ret;
+
+    if (old_len) {
+        io_uring_unregister_buffers(&s->ring);
+    }
+    if (!s->bufs->len) {
+        return;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, (struct iovec *)s->bufs->data,
+                                    s->bufs->len);
+    trace_luring_register_buffers(s, s->bufs->len, ret);
+    if (ret < 0) {
+        g_array_set_size(s->bufs, 0);
+    }
+}
+
+void luring_register_buf(LuringState *s, void *host, size_t size)
+{
+    int old_len = s->bufs->len;
+    struct iovec iov = {
+        .iov_base   = host,
+        .iov_len    = size,
+    };
+
+    g_array_append_val(s->bufs, iov);
+    luring_update_bufs(s, old_len);
+}
+
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    int old_len = s->bufs->len;
+    int i;
+
+    for (i = 0; i < s->bufs->len; i++) {
+        if (g_array_index(s->bufs, struct iovec, i).iov_base == host) {
+            g_array_remove_index(s->bufs, i);
+            luring_update_bufs(s, old_len);
+            return;
+        }
+    }
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false, NULL, NULL, NULL,
+                       s);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL, qemu_luring_poll_cb, s);
+}
+
+LuringState *luring_init(Error **errp)
+{
+    int rc;
+    LuringState *s;
+
+    s = g_malloc0(sizeof(*s));
+    rc = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+    s->files = g_array_new(false, false, sizeof(int));
+    s->bufs = g_array_new(false, false, sizeof(struct iovec));
+    trace_luring_init_state(s, sizeof(*s));
+
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    g_array_free(s->files, true);
+    g_array_free(s->bufs, true);
+    trace_luring_cleanup_state(s);
+    g_free(s);
+}
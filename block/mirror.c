@@ -1010,7 +1010,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
             /* The two disks are in sync.  Exit and report successful
              * completion.
              */
-            assert(QLIST_EMPTY(&bs->tracked_requests));
+            assert(!bdrv_has_tracked_requests(bs));
             s->common.job.cancelled = false;
             need_drain = false;
             break;
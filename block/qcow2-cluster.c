@@ -211,7 +211,7 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                    uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
-    int start_of_slice = sizeof(uint64_t) *
+    int start_of_slice = l2_entry_size(s) *
         (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
     return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
@@ -279,7 +279,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * l2_entry_size(s));
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -303,7 +303,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index)
 
     /* allocate a new entry in the l2 cache */
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
@@ -367,7 +367,7 @@ fail:
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -380,13 +380,14 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_slice, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        int cluster_size, uint64_t *l2_slice, int l2_index,
+        uint64_t stop_flags)
 {
     int i;
     QCow2ClusterType first_cluster_type;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_slice[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset) {
@@ -399,7 +400,7 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
            first_cluster_type == QCOW2_CLUSTER_ZERO_ALLOC);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[i]) & mask;
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
         if (offset + (uint64_t) i * cluster_size != l2_entry) {
             break;
         }
@@ -412,8 +413,10 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
  * Checks how many consecutive unallocated clusters in a given L2
  * slice have the same cluster type.
  */
-static int count_contiguous_clusters_unallocated(int nb_clusters,
+static int count_contiguous_clusters_unallocated(BDRVQcow2State *s,
+                                                 int nb_clusters,
                                                  uint64_t *l2_slice,
+                                                 int l2_index,
                                                  QCow2ClusterType wanted_type)
 {
     int i;
@@ -421,7 +424,7 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     assert(wanted_type == QCOW2_CLUSTER_ZERO_PLAIN ||
            wanted_type == QCOW2_CLUSTER_UNALLOCATED);
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t entry = be64_to_cpu(l2_slice[i]);
+        uint64_t entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType type = qcow2_get_cluster_type(entry);
 
         if (type != wanted_type) {
@@ -432,6 +435,86 @@ static int count_contiguous_clusters_unallocated(int nb_clusters,
     return i;
 }
 
+/*
+ * Returns the type of subcluster @sc_index in a cluster with extended L2
+ * entry @l2_entry and allocation bitmap @l2_bitmap, or -EIO if the entry is
+ * invalid. Unallocated subclusters of an allocated cluster are reported as
+ * QCOW2_CLUSTER_UNALLOCATED, too.
+ */
+static int get_subcluster_type(uint64_t l2_entry, uint64_t l2_bitmap,
+                               unsigned sc_index)
+{
+    if (!qcow2_l2_bitmap_valid(l2_entry, l2_bitmap)) {
+        return -EIO;
+    }
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return l2_entry & L2E_OFFSET_MASK ? QCOW2_CLUSTER_ZERO_ALLOC
+                                          : QCOW2_CLUSTER_ZERO_PLAIN;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
+static int check_l2_bitmap(BlockDriverState *bs, uint64_t l2_entry,
+                           uint64_t l2_bitmap, uint64_t guest_offset)
+{
+    if (!qcow2_l2_bitmap_valid(l2_entry, l2_bitmap)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Invalid extended L2 entry "
+                                "%#" PRIx64 " with subcluster bitmap %#"
+                                PRIx64 " (guest offset: %#" PRIx64 ")",
+                                l2_entry, l2_bitmap, guest_offset);
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Counts the subclusters of type @wanted_type in a given L2 slice, starting
+ * with subcluster @sc_index of entry @l2_index and stopping at the first
+ * subcluster of a different type. Allocated subclusters (normal or zero) are
+ * only counted as long as their host clusters are contiguous.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index,
+                                        QCow2ClusterType wanted_type)
+{
+    bool check_offset = wanted_type == QCOW2_CLUSTER_NORMAL ||
+                        wanted_type == QCOW2_CLUSTER_ZERO_ALLOC;
+    uint64_t first_offset = 0;
+    int i, j, count = 0;
+
+    assert(has_subclusters(s));
+    assert(wanted_type != QCOW2_CLUSTER_COMPRESSED);
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        uint64_t offset = l2_entry & L2E_OFFSET_MASK;
+
+        if (i == 0) {
+            first_offset = offset;
+        } else if (check_offset &&
+                   offset != first_offset + ((uint64_t)i << s->cluster_bits)) {
+            break;
+        }
+
+        for (j = i ? 0 : sc_index; j < s->subclusters_per_cluster; j++) {
+            if (get_subcluster_type(l2_entry, l2_bitmap, j) != wanted_type) {
+                return count;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
 static int coroutine_fn do_perform_cow_read(BlockDriverState *bs,
                                             uint64_t src_cluster_offset,
                                             unsigned offset_in_cluster,
@@ -523,7 +606,9 @@ static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
  *
  * On exit, *bytes is the number of bytes starting at offset that have the same
  * cluster type and (if applicable) are stored contiguously in the image file.
- * Compressed clusters are always returned one by one.
+ * Compressed clusters are always returned one by one. With extended L2
+ * entries, the type is that of the subcluster containing offset and *bytes
+ * ends at the first subcluster of a different type.
  *
  * Returns the cluster type (QCOW2_CLUSTER_*) on success, -errno in error
  * cases.
@@ -532,9 +617,9 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                              unsigned int *bytes, uint64_t *cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
-    unsigned int l2_index;
+    unsigned int l2_index, sc_index = 0;
     uint64_t l1_index, l2_offset, *l2_slice;
-    int c;
+    int c = 0, sc = 0;
     unsigned int offset_in_cluster;
     uint64_t bytes_available, bytes_needed, nb_clusters;
     QCow2ClusterType type;
@@ -587,7 +672,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = offset_to_l2_slice_index(s, offset);
-    *cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_slice, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
@@ -595,7 +680,18 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
      * true */
     assert(nb_clusters <= INT_MAX);
 
-    type = qcow2_get_cluster_type(*cluster_offset);
+    if (has_subclusters(s)) {
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+
+        ret = check_l2_bitmap(bs, *cluster_offset, l2_bitmap, offset);
+        if (ret < 0) {
+            goto fail;
+        }
+        sc_index = offset_to_sc_index(s, offset);
+        type = get_subcluster_type(*cluster_offset, l2_bitmap, sc_index);
+    } else {
+        type = qcow2_get_cluster_type(*cluster_offset);
+    }
     if (s->qcow_version < 3 && (type == QCOW2_CLUSTER_ZERO_PLAIN ||
                                 type == QCOW2_CLUSTER_ZERO_ALLOC)) {
         qcow2_signal_corruption(bs, true, -1, -1, "Zero cluster entry found"
@@ -613,15 +709,25 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     case QCOW2_CLUSTER_ZERO_PLAIN:
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_unallocated(nb_clusters,
-                                                  &l2_slice[l2_index], type);
+        if (has_subclusters(s)) {
+            sc = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                              l2_slice, l2_index, type);
+        } else {
+            c = count_contiguous_clusters_unallocated(s, nb_clusters, l2_slice,
+                                                      l2_index, type);
+        }
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_ZERO_ALLOC:
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            sc = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                              l2_slice, l2_index, type);
+        } else {
+            c = count_contiguous_clusters(s, nb_clusters, s->cluster_size,
+                                          l2_slice, l2_index, QCOW_OFLAG_ZERO);
+        }
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1,
@@ -639,7 +745,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
 
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
-    bytes_available = (int64_t)c * s->cluster_size;
+    if (sc) {
+        bytes_available = ((uint64_t)sc_index + sc) << s->subcluster_bits;
+    } else {
+        bytes_available = (int64_t)c * s->cluster_size;
+    }
 
 out:
     if (bytes_available > bytes_needed) {
@@ -707,7 +817,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->l2_size * l2_entry_size(s),
                                 QCOW2_DISCARD_OTHER);
         }
 
@@ -762,7 +872,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
         return 0;
@@ -786,7 +896,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
-    l2_slice[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_slice, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     return cluster_offset;
@@ -967,12 +1080,32 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
          * old cluster. This is what this loop does */
-        if (l2_slice[l2_index + i] != 0) {
-            old_cluster[j++] = l2_slice[l2_index + i];
+        if (get_l2_entry(s, l2_slice, l2_index + i) != 0) {
+            old_cluster[j++] = get_l2_entry(s, l2_slice, l2_index + i);
         }
 
-        l2_slice[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_slice, l2_index + i, (cluster_offset +
+                     (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+
+        /*
+         * Subclusters that were written or copied are allocated now; the
+         * others keep their state.
+         */
+        if (has_subclusters(s)) {
+            uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            unsigned written_from = m->cow_start.offset;
+            unsigned written_to = m->cow_end.offset + m->cow_end.nb_bytes;
+            int first_sc, last_sc;
+
+            written_from = MAX(written_from, i << s->cluster_bits);
+            written_to = MIN(written_to, (i + 1) << s->cluster_bits);
+            assert(written_from < written_to);
+            first_sc = offset_to_sc_index(s, written_from);
+            last_sc = offset_to_sc_index(s, written_to - 1);
+            l2_bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, last_sc + 1);
+            l2_bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, last_sc + 1);
+            set_l2_bitmap(s, l2_slice, l2_index + i, l2_bitmap);
+        }
      }
 
 
@@ -986,7 +1119,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (!m->keep_old_clusters && j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -1019,9 +1152,16 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
         QCow2ClusterType cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        /* Leave invalid entries to the caller, which reports them */
+        if (has_subclusters(s) &&
+            !qcow2_l2_bitmap_valid(l2_entry,
+                                   get_l2_bitmap(s, l2_slice, l2_index + i))) {
+            goto out;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -1071,6 +1211,16 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        /*
+         * With subclusters, the COW area of a new allocation may not cover
+         * the whole cluster; but the rest of it can't be written either
+         * before the cluster is linked into the L2 table.
+         */
+        if (has_subclusters(s) && !old_alloc->keep_old_clusters) {
+            old_start = start_of_cluster(s, old_start);
+            old_end = ROUND_UP(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
@@ -1116,6 +1266,9 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
  * returned *host_offset points to exact byte referenced by guest_offset and
  * therefore isn't cluster aligned as well.
  *
+ * With extended L2 entries, only subclusters that are already allocated can
+ * be written without updating the L2 entry.
+ *
  * Returns:
  *   0:     if no allocated clusters are available at the given offset.
  *          *bytes is normally unchanged. It is set to 0 if the cluster
@@ -1162,7 +1315,16 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_slice[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_slice, l2_index);
+
+    if (has_subclusters(s)) {
+        ret = check_l2_bitmap(bs, cluster_offset,
+                              get_l2_bitmap(s, l2_slice, l2_index),
+                              guest_offset);
+        if (ret < 0) {
+            goto out;
+        }
+    }
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1189,14 +1351,30 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
 
         /* We keep all QCOW_OFLAG_COPIED clusters */
         keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index],
+            count_contiguous_clusters(s, nb_clusters, s->cluster_size,
+                                      l2_slice, l2_index,
                                       QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
         assert(keep_clusters <= nb_clusters);
 
-        *bytes = MIN(*bytes,
-                 keep_clusters * s->cluster_size
-                 - offset_into_cluster(s, guest_offset));
+        if (has_subclusters(s)) {
+            unsigned sc_index = offset_to_sc_index(s, guest_offset);
+            int keep_sc =
+                count_contiguous_subclusters(s, keep_clusters, sc_index,
+                                             l2_slice, l2_index,
+                                             QCOW2_CLUSTER_NORMAL);
+
+            if (keep_sc == 0) {
+                ret = 0;
+                goto out;
+            }
+            *bytes = MIN(*bytes,
+                     (((uint64_t)sc_index + keep_sc) << s->subcluster_bits)
+                     - offset_into_cluster(s, guest_offset));
+        } else {
+            *bytes = MIN(*bytes,
+                     keep_clusters * s->cluster_size
+                     - offset_into_cluster(s, guest_offset));
+        }
 
         ret = 1;
     } else {
@@ -1264,6 +1442,58 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/*
+ * Narrows down the COW regions of an allocation to whole subclusters. Only
+ * the subclusters touched by the write must be filled in, except that any
+ * allocated subclusters of an old cluster that is replaced by a new one must
+ * be copied as well, and compressed clusters are always copied entirely.
+ * The COW regions are initially those of a whole-cluster allocation.
+ */
+static void calculate_subcluster_cow(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int l2_index, int nb_clusters,
+                                     bool keep_old, Qcow2COWRegion *cow_start,
+                                     Qcow2COWRegion *cow_end)
+{
+    unsigned write_start = cow_start->nb_bytes;
+    unsigned write_end = cow_end->offset;
+    unsigned last_cluster = (nb_clusters - 1) << s->cluster_bits;
+    unsigned cow_from = QEMU_ALIGN_DOWN(write_start, s->subcluster_size);
+    unsigned cow_to = QEMU_ALIGN_UP(write_end, s->subcluster_size);
+
+    if (!keep_old) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index);
+        uint32_t sc_alloc = get_l2_bitmap(s, l2_slice, l2_index);
+
+        if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+            cow_from = 0;
+        } else if (sc_alloc) {
+            cow_from = MIN(cow_from, ctz32(sc_alloc) << s->subcluster_bits);
+        }
+
+        l2_entry = get_l2_entry(s, l2_slice, l2_index + nb_clusters - 1);
+        sc_alloc = get_l2_bitmap(s, l2_slice, l2_index + nb_clusters - 1);
+
+        if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+            cow_to = last_cluster + s->cluster_size;
+        } else if (sc_alloc) {
+            cow_to = MAX(cow_to, last_cluster +
+                         ((32 - clz32(sc_alloc)) << s->subcluster_bits));
+        }
+    }
+
+    assert(cow_from <= write_start && write_end <= cow_to);
+    assert(cow_to <= last_cluster + s->cluster_size);
+
+    *cow_start = (Qcow2COWRegion) {
+        .offset     = cow_from,
+        .nb_bytes   = write_start - cow_from,
+    };
+    *cow_end = (Qcow2COWRegion) {
+        .offset     = write_end,
+        .nb_bytes   = cow_to - write_end,
+    };
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
@@ -1294,6 +1524,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t nb_clusters;
     int ret;
     bool keep_old_clusters = false;
+    bool fill_in_place = false;
 
     uint64_t alloc_cluster_offset = 0;
 
@@ -1318,12 +1549,28 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_slice[l2_index]);
+    entry = get_l2_entry(s, l2_slice, l2_index);
+
+    if (has_subclusters(s)) {
+        ret = check_l2_bitmap(bs, entry, get_l2_bitmap(s, l2_slice, l2_index),
+                              guest_offset);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        /*
+         * handle_copied() leaves unallocated subclusters of COPIED clusters
+         * to us; they are filled in place
+         */
+        fill_in_place =
+            qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+            (entry & QCOW_OFLAG_COPIED);
+    }
 
     /* For the moment, overwrite compressed clusters one by one */
     if (entry & QCOW_OFLAG_COMPRESSED) {
         nb_clusters = 1;
-    } else {
+    } else if (!fill_in_place) {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_slice, l2_index);
     }
 
@@ -1332,7 +1579,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
      * wrong with our code. */
     assert(nb_clusters > 0);
 
-    if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_ZERO_ALLOC &&
+    if ((qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_ZERO_ALLOC ||
+         fill_in_place) &&
         (entry & QCOW_OFLAG_COPIED) &&
         (!*host_offset ||
          start_of_cluster(s, *host_offset) == (entry & L2E_OFFSET_MASK)))
@@ -1352,8 +1600,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
          * would be fine, too, but count_cow_clusters() above has limited
          * nb_clusters already to a range of COW clusters */
         preallocated_nb_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_slice[l2_index], QCOW_OFLAG_COPIED);
+            count_contiguous_clusters(s, nb_clusters, s->cluster_size,
+                                      l2_slice, l2_index, QCOW_OFLAG_COPIED);
         assert(preallocated_nb_clusters > 0);
 
         nb_clusters = preallocated_nb_clusters;
@@ -1362,10 +1610,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         /* We want to reuse these clusters, so qcow2_alloc_cluster_link_l2()
          * should not free them. */
         keep_old_clusters = true;
+    } else if (fill_in_place) {
+        /* Can't extend contiguous allocation */
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        *bytes = 0;
+        return 0;
     }
 
-    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
-
     if (!alloc_cluster_offset) {
         /* Allocate, if necessary at a given offset in the image file */
         alloc_cluster_offset = start_of_cluster(s, *host_offset);
@@ -1377,6 +1628,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
         /* Can't extend contiguous allocation */
         if (nb_clusters == 0) {
+            qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
             *bytes = 0;
             return 0;
         }
@@ -1411,6 +1663,20 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
     int nb_bytes = MIN(requested_bytes, avail_bytes);
     QCowL2Meta *old_m = *m;
+    Qcow2COWRegion cow_start = {
+        .offset     = 0,
+        .nb_bytes   = offset_into_cluster(s, guest_offset),
+    };
+    Qcow2COWRegion cow_end = {
+        .offset     = nb_bytes,
+        .nb_bytes   = avail_bytes - nb_bytes,
+    };
+
+    if (has_subclusters(s)) {
+        calculate_subcluster_cow(s, l2_slice, l2_index, nb_clusters,
+                                 keep_old_clusters, &cow_start, &cow_end);
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     *m = g_malloc0(sizeof(**m));
 
@@ -1423,14 +1689,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
         .keep_old_clusters  = keep_old_clusters,
 
-        .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
-        },
-        .cow_end = {
-            .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
-        },
+        .cow_start      = cow_start,
+        .cow_end        = cow_end,
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
     QLIST_INSERT_HEAD(&s->cluster_allocs, *m, next_in_flight);
@@ -1442,6 +1702,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     return 1;
 
 fail:
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
     if (*m && (*m)->nb_clusters > 0) {
         QLIST_REMOVE(*m, next_in_flight);
     }
@@ -1601,7 +1862,31 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_slice[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+
+        if (has_subclusters(s)) {
+            uint64_t old_l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+            uint64_t new_l2_bitmap =
+                full_discard ? 0 : QCOW_L2_BITMAP_ALL_ZEROES;
+
+            /*
+             * Same as below, but the whole cluster must be unallocated in
+             * each of its subclusters for the entry to be left alone.
+             */
+            if (qcow2_get_cluster_type(old_l2_entry) ==
+                QCOW2_CLUSTER_UNALLOCATED &&
+                (old_l2_bitmap == new_l2_bitmap ||
+                 (!full_discard && !bs->backing &&
+                  !(old_l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC)))) {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
+            set_l2_bitmap(s, l2_slice, l2_index + i, new_l2_bitmap);
+            qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+            continue;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1641,9 +1926,9 @@ static int discard_in_l2_slice(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
         if (!full_discard && s->qcow_version >= 3) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_slice[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_slice, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1723,13 +2008,43 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
         uint64_t old_offset;
         QCow2ClusterType cluster_type;
 
-        old_offset = be64_to_cpu(l2_slice[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_slice, l2_index + i);
+        cluster_type = qcow2_get_cluster_type(old_offset);
+
+        if (has_subclusters(s)) {
+            uint64_t new_offset;
+
+            /*
+             * All subclusters read as zeroes through the bitmap; the host
+             * cluster is kept unless it must be unmapped.
+             */
+            if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
+                new_offset = 0;
+            } else {
+                new_offset = old_offset;
+            }
+
+            if (new_offset == old_offset &&
+                get_l2_bitmap(s, l2_slice, l2_index + i) ==
+                QCOW_L2_BITMAP_ALL_ZEROES) {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+            set_l2_entry(s, l2_slice, l2_index + i, new_offset);
+            set_l2_bitmap(s, l2_slice, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+            if (new_offset != old_offset) {
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            continue;
+        }
 
         /*
          * Minimize L2 changes if the cluster already reads back as
          * zeroes with correct allocation.
          */
-        cluster_type = qcow2_get_cluster_type(old_offset);
         if (cluster_type == QCOW2_CLUSTER_ZERO_PLAIN ||
             (cluster_type == QCOW2_CLUSTER_ZERO_ALLOC && !unmap)) {
             continue;
@@ -1737,10 +2052,11 @@ static int zero_in_l2_slice(BlockDriverState *bs, uint64_t offset,
 
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
         if (cluster_type == QCOW2_CLUSTER_COMPRESSED || unmap) {
-            l2_slice[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_slice[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_slice, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1813,7 +2129,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     int ret;
     int i, j;
 
-    slice_size2 = s->l2_slice_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
     n_slices = s->cluster_size / slice_size2;
 
     if (!is_active_l1) {
@@ -1868,7 +2184,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             }
 
             for (j = 0; j < s->l2_slice_size; j++) {
-                uint64_t l2_entry = be64_to_cpu(l2_slice[j]);
+                uint64_t l2_entry = get_l2_entry(s, l2_slice, j);
                 int64_t offset = l2_entry & L2E_OFFSET_MASK;
                 QCow2ClusterType cluster_type =
                     qcow2_get_cluster_type(l2_entry);
@@ -1882,7 +2198,7 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                     if (!bs->backing) {
                         /* not backed; therefore we can simply deallocate the
                          * cluster */
-                        l2_slice[j] = 0;
+                        set_l2_entry(s, l2_slice, j, 0);
                         l2_dirty = true;
                         continue;
                     }
@@ -1944,9 +2260,9 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
                 }
 
                 if (l2_refcount == 1) {
-                    l2_slice[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
+                    set_l2_entry(s, l2_slice, j, offset | QCOW_OFLAG_COPIED);
                 } else {
-                    l2_slice[j] = cpu_to_be64(offset);
+                    set_l2_entry(s, l2_slice, j, offset);
                 }
                 l2_dirty = true;
             }
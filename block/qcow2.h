@@ -71,8 +71,29 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/*
+ * Extended L2 entries are followed by a subcluster allocation bitmap: bit n
+ * is set if subcluster n is allocated, bit 32 + n if it reads as zeroes.
+ */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters [X, Y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC  QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32)
+#define QCOW_L2_BITMAP_ALL_ZEROES QCOW_OFLAG_SUB_ZERO_RANGE(0, 32)
+
+/* Size of normal and extended L2 entries */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
+/* Subclusters may not be smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
 
 /* Must be at least 2 to cover COW */
 #define MIN_L2_CACHE_SIZE 2 /* cache entries */
@@ -199,11 +220,14 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 4,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
     QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+                                 | QCOW2_INCOMPAT_CORRUPT
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -263,6 +287,9 @@ typedef struct BDRVQcow2State {
     int l2_slice_size;
     int l2_bits;
     int l2_size;
+    int subcluster_bits;
+    int subcluster_size;
+    int subclusters_per_cluster;
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -472,6 +499,62 @@ static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+/*
+ * Accessors for entry @idx of an L2 slice. Without extended L2 entries the
+ * bitmap reads as 0 and must not be written.
+ */
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (!has_subclusters(s)) {
+        return 0;
+    }
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx + 1]);
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+static inline uint64_t size_to_subclusters(BDRVQcow2State *s, uint64_t size)
+{
+    return (size + (s->subcluster_size - 1)) >> s->subcluster_bits;
+}
+
 static inline int64_t size_to_l1(BDRVQcow2State *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -514,6 +597,29 @@ static inline QCow2ClusterType qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Check an extended L2 entry for combinations that the format forbids: the
+ * zero flag of normal L2 entries, allocated subclusters without a host
+ * cluster and subclusters that are both allocated and zero. The bitmap of
+ * compressed clusters is ignored.
+ */
+static inline bool qcow2_l2_bitmap_valid(uint64_t l2_entry, uint64_t l2_bitmap)
+{
+    uint32_t sc_alloc = l2_bitmap;
+    uint32_t sc_zero = l2_bitmap >> 32;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return true;
+    }
+    if (l2_entry & QCOW_OFLAG_ZERO) {
+        return false;
+    }
+    if (!(l2_entry & L2E_OFFSET_MASK)) {
+        return !sc_alloc;
+    }
+    return !(sc_alloc & sc_zero);
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
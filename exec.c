@@ -2485,6 +2485,63 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/*
+ * Replace the memory behind a shared RAMBlock with the file @fd, keeping
+ * the same host address.  Used by incoming migration to take
+ * over the RAM of the source QEMU.  On success the block owns @fd.
+ */
+int qemu_ram_remap_fd(RAMBlock *block, int fd, Error **errp)
+{
+    struct stat st;
+    void *area;
+
+    if (!(block->flags & RAM_SHARED) || (block->flags & RAM_PREALLOC) ||
+        xen_enabled()) {
+        error_setg(errp, "RAM block %s is not shared memory", block->idstr);
+        return -EINVAL;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "Cannot stat file of RAM block %s",
+                         block->idstr);
+        return -errno;
+    }
+    if (st.st_size < block->max_length) {
+        error_setg(errp, "File of RAM block %s is too small: %" PRId64
+                   " < " RAM_ADDR_FMT, block->idstr, (int64_t)st.st_size,
+                   block->max_length);
+        return -EINVAL;
+    }
+    if (qemu_fd_getpagesize(fd) != block->page_size) {
+        error_setg(errp, "Mismatched page size for RAM block %s: %zd != %zd",
+                   block->idstr, qemu_fd_getpagesize(fd), block->page_size);
+        return -EINVAL;
+    }
+
+    area = mmap(block->host, block->max_length, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED, fd, 0);
+    if (area != block->host) {
+        /* The old mapping may already be gone, there is no going back */
+        error_report("Could not remap RAM block %s: %s", block->idstr,
+                     strerror(errno));
+        exit(1);
+    }
+    memory_try_enable_merging(block->host, block->max_length);
+    qemu_ram_setup_dump(block->host, block->max_length);
+
+    if (block->fd >= 0) {
+        close(block->fd);
+    }
+    block->fd = fd;
+    return 0;
+}
+#else
+int qemu_ram_remap_fd(RAMBlock *block, int fd, Error **errp)
+{
+    error_setg(errp, "Remapping RAM is not supported on this host");
+    return -ENOTSUP;
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
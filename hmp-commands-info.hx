@@ -594,6 +594,20 @@ STEXI
 @item info migrate_cache_size
 @findex info migrate_cache_size
 Show current migration xbzrle cache size.
+ETEXI
+
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the result of the last calc_dirty_rate",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+STEXI
+@item info dirty_rate
+@findex info dirty_rate
+Show the result of the last guest dirty rate measurement.
 ETEXI
 
     {
@@ -918,6 +932,23 @@ STEXI
 Show SEV information.
 ETEXI
 
+#if defined(CONFIG_MPQEMU)
+    {
+        .name       = "remote_link_stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show latency statistics of the links to remote processes",
+        .cmd        = hmp_info_remote_link_stats,
+    },
+#endif
+
+STEXI
+@item info remote_link_stats
+@findex info remote_link_stats
+Show the number of commands sent to each remote process and a histogram
+of their latencies.
+ETEXI
+
 STEXI
 @end table
 ETEXI
@@ -1184,6 +1184,25 @@ STEXI
 @findex migrate_start_postcopy
 Switch in-progress migration to postcopy mode. Ignored after the end of
 migration (or once already in postcopy).
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "per_vcpu:-v,calc_time:i,sample_pages:i?",
+        .params     = "[-v] calc_time [sample_pages]",
+        .help       = "start measuring the guest dirty rate over calc_time"
+                      " seconds (-v: also for each vCPU, needs the KVM"
+                      " dirty ring)",
+        .cmd        = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate [-v] @var{calc_time} [@var{sample_pages}]
+@findex calc_dirty_rate
+Start measuring the rate at which the guest dirties its memory, over
+@var{calc_time} seconds, sampling @var{sample_pages} pages per GiB of RAM.
+@option{-v} also measures the rate of each vCPU.  Use
+@code{info dirty_rate} to read the result.
 ETEXI
 
     {
@@ -29,6 +29,7 @@
 #include "qapi/error.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/qapi-builtin-visit.h"
+#include "qapi/qapi-visit-migration.h"
 #include "qapi/qapi-commands-block.h"
 #include "qapi/qapi-commands-char.h"
 #include "qapi/qapi-commands-migration.h"
@@ -259,6 +260,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->multifd_bytes >> 10);
         monitor_printf(mon, "pages-per-second: %" PRIu64 "\n",
                        info->ram->pages_per_second);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
 
         if (info->ram->dirty_pages_rate) {
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
@@ -292,6 +295,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss_rate);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        monitor_printf(mon, "xbzrle skipped: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->skipped);
     }
 
     if (info->has_compression) {
@@ -327,6 +332,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_postcopy_latency) {
+        monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                       info->postcopy_latency->requests);
+        monitor_printf(mon, "postcopy request latency: average %" PRIu64
+                       " us, p50 %" PRIu64 " us, p99 %" PRIu64
+                       " us, max %" PRIu64 " us\n",
+                       info->postcopy_latency->average,
+                       info->postcopy_latency->p50,
+                       info->postcopy_latency->p99,
+                       info->postcopy_latency->max);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -437,6 +454,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT),
             params->x_multifd_page_count);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_MULTIFD_COMPRESSION),
+            MultiFDCompression_str(params->x_multifd_compression));
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_X_DEVICE_STATE_THREADS),
+            params->x_device_state_threads);
         monitor_printf(mon, "%s: %" PRIu64 "\n",
             MigrationParameter_str(MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE),
             params->xbzrle_cache_size);
@@ -454,6 +477,41 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateRamBlockList *block;
+    DirtyRateVcpuList *vcpu;
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    if (info->status == DIRTY_RATE_STATUS_UNSTARTED) {
+        goto out;
+    }
+    monitor_printf(mon, "Start time: %" PRId64 " s\n", info->start_time);
+    monitor_printf(mon, "Calculation time: %" PRId64 " s\n",
+                   info->calc_time);
+    monitor_printf(mon, "Sample pages: %" PRIu64 " per GiB\n",
+                   info->sample_pages);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRId64 " MiB/s\n",
+                       info->dirty_rate);
+    }
+    for (block = info->ramblocks; block; block = block->next) {
+        monitor_printf(mon, "  %s: %" PRId64 " MiB/s (%" PRIu64 " of %"
+                       PRIu64 " sampled pages dirty)\n",
+                       block->value->id, block->value->dirty_rate,
+                       block->value->dirty_pages,
+                       block->value->sampled_pages);
+    }
+    for (vcpu = info->vcpus; vcpu; vcpu = vcpu->next) {
+        monitor_printf(mon, "  vCPU %" PRId64 ": %" PRId64 " MiB/s\n",
+                       vcpu->value->id, vcpu->value->dirty_rate);
+    }
+
+out:
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoFastList *cpu_list, *cpu;
@@ -1793,6 +1851,15 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_x_multifd_page_count = true;
         visit_type_int(v, param, &p->x_multifd_page_count, &err);
         break;
+    case MIGRATION_PARAMETER_X_MULTIFD_COMPRESSION:
+        p->has_x_multifd_compression = true;
+        visit_type_MultiFDCompression(v, param, &p->x_multifd_compression,
+                                      &err);
+        break;
+    case MIGRATION_PARAMETER_X_DEVICE_STATE_THREADS:
+        p->has_x_device_state_threads = true;
+        visit_type_int(v, param, &p->x_device_state_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         visit_type_size(v, param, &cache_size, &err);
@@ -1863,6 +1930,23 @@ void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, &err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    bool per_vcpu = qdict_get_try_bool(qdict, "per_vcpu", false);
+    int64_t calc_time = qdict_get_int(qdict, "calc_time");
+    bool has_sample_pages = qdict_haskey(qdict, "sample_pages");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages", 0);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, has_sample_pages, sample_pages,
+                        true, per_vcpu, &err);
+    if (!err) {
+        monitor_printf(mon, "Measuring the dirty rate for %" PRId64
+                       " seconds, see 'info dirty_rate'\n", calc_time);
+    }
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_x_colo_lost_heartbeat(Monitor *mon, const QDict *qdict)
 {
     Error *err = NULL;
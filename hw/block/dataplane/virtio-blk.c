@@ -24,6 +24,7 @@
 #include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
+#include "sysemu/block-backend.h"
 
 struct VirtIOBlockDataPlane {
     bool starting;
@@ -42,6 +43,20 @@ struct VirtIOBlockDataPlane {
      */
     IOThread *iothread;
     AioContext *ctx;
+
+    /*
+     * IOThreads given with the iothreads property, the first of which is
+     * also @iothread.  If the drive supports it, virtqueue i is processed
+     * in iothreads[i % num_iothreads]; otherwise all virtqueues use @ctx.
+     */
+    IOThread **iothreads;
+    unsigned num_iothreads;
+    bool multiqueue;
+    AioContext **vq_aio_context;
+    Error *blocker;
+
+    /* Set while the other IOThreads have external handlers disabled */
+    bool drained;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -87,10 +102,28 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->num_iothreads) {
+        error_setg(errp, "iothread and iothreads cannot be used together");
+        return false;
+    }
+    if (conf->num_iothreads > conf->num_queues) {
+        error_setg(errp, "iothreads must not have more entries than "
+                   "num-queues (%" PRIu16 ")", conf->num_queues);
+        return false;
+    }
+    for (i = 0; i < conf->num_iothreads; i++) {
+        if (!conf->iothreads[i] || !iothread_by_id(conf->iothreads[i])) {
+            error_setg(errp, "iothread '%s' not found",
+                       conf->iothreads[i] ?: "");
+            return false;
+        }
+    }
+
+    if (conf->iothread || conf->num_iothreads) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -119,7 +152,17 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    if (conf->iothread) {
+    if (conf->num_iothreads) {
+        s->num_iothreads = conf->num_iothreads;
+        s->iothreads = g_new(IOThread *, s->num_iothreads);
+        for (i = 0; i < s->num_iothreads; i++) {
+            s->iothreads[i] = iothread_by_id(conf->iothreads[i]);
+            object_ref(OBJECT(s->iothreads[i]));
+        }
+        s->iothread = s->iothreads[0];
+        object_ref(OBJECT(s->iothread));
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else if (conf->iothread) {
         s->iothread = conf->iothread;
         object_ref(OBJECT(s->iothread));
         s->ctx = iothread_get_aio_context(s->iothread);
@@ -128,6 +171,11 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     }
     s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
     s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_aio_context[i] = s->ctx;
+    }
+    error_setg(&s->blocker, "virtio-blk with multiple iothreads is in use");
 
     *dataplane = s;
 
@@ -138,6 +186,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -146,13 +195,65 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
     g_free(s->batch_notify_vqs);
+    g_free(s->vq_aio_context);
+    error_free(s->blocker);
     qemu_bh_delete(s->bh);
     if (s->iothread) {
         object_unref(OBJECT(s->iothread));
     }
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
+    }
+    g_free(s->iothreads);
     g_free(s);
 }
 
+/* Return the AioContext that processes requests from @vq */
+AioContext *virtio_blk_data_plane_get_aio_context(VirtIOBlockDataPlane *s,
+                                                  VirtQueue *vq)
+{
+    return s->vq_aio_context[virtio_get_queue_index(vq)];
+}
+
+/*
+ * Drained sections only disable external handlers in the BlockBackend's
+ * AioContext, so stop the other IOThreads from taking new requests too.
+ * Taking the AioContext lock waits for a handler that is already running.
+ *
+ * Context: the BlockBackend's AioContext is held
+ */
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->multiqueue) {
+        return;
+    }
+
+    s->drained = true;
+    for (i = 1; i < s->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        aio_disable_external(ctx);
+        aio_context_acquire(ctx);
+        aio_context_release(ctx);
+    }
+}
+
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s)
+{
+    unsigned i;
+
+    if (!s->drained) {
+        return;
+    }
+
+    s->drained = false;
+    for (i = 1; i < s->num_iothreads; i++) {
+        aio_enable_external(iothread_get_aio_context(s->iothreads[i]));
+    }
+}
+
 static bool virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
                                                 VirtQueue *vq)
 {
@@ -181,7 +282,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
     s->starting = true;
 
-    if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    s->multiqueue = false;
+    if (s->num_iothreads > 1) {
+        s->multiqueue = bdrv_supports_multiqueue(blk_bs(s->conf->conf.blk));
+        if (!s->multiqueue) {
+            warn_report("virtio-blk: drive does not support multi-queue, "
+                        "using only the first of its iothreads");
+        }
+    }
+    for (i = 0; i < nvqs; i++) {
+        s->vq_aio_context[i] = s->multiqueue ?
+            iothread_get_aio_context(s->iothreads[i % s->num_iothreads]) :
+            s->ctx;
+    }
+
+    /* The batching bitmap and BH belong to the first IOThread */
+    if (!s->multiqueue &&
+        !virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         s->batch_notifications = true;
     } else {
         s->batch_notifications = false;
@@ -213,6 +330,11 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     trace_virtio_blk_data_plane_start(s);
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    if (s->multiqueue) {
+        /* Block jobs and the like are not prepared for concurrent I/O */
+        blk_op_block_all(s->conf->conf.blk, s->blocker);
+        blk_set_multiqueue(s->conf->conf.blk, true);
+    }
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -222,14 +344,15 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_guest_notifiers:
@@ -241,17 +364,20 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
 
 /* Stop notifications for new requests from guest.
  *
- * Context: BH in IOThread
+ * Context: BH in IOThread, once for each IOThread that serves virtqueues
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        }
     }
 }
 
@@ -278,11 +404,23 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    if (s->multiqueue) {
+        for (i = 1; i < s->num_iothreads; i++) {
+            AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+            aio_context_acquire(ctx);
+            aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+            aio_context_release(ctx);
+        }
+        blk_op_unblock_all(s->conf->conf.blk, s->blocker);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
     /* Drain and switch bs back to the QEMU main loop */
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
+    blk_set_multiqueue(s->conf->conf.blk, false);
 
     aio_context_release(s->ctx);
 
@@ -295,5 +433,6 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     k->set_guest_notifiers(qbus->parent, nvqs, false);
 
     vblk->dataplane_started = false;
+    s->multiqueue = false;
     s->stopping = false;
 }
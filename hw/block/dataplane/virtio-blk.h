@@ -24,6 +24,10 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   Error **errp);
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s);
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq);
+AioContext *virtio_blk_data_plane_get_aio_context(VirtIOBlockDataPlane *s,
+                                                  VirtQueue *vq);
+void virtio_blk_data_plane_drained_begin(VirtIOBlockDataPlane *s);
+void virtio_blk_data_plane_drained_end(VirtIOBlockDataPlane *s);
 
 int virtio_blk_data_plane_start(VirtIODevice *vdev);
 void virtio_blk_data_plane_stop(VirtIODevice *vdev);
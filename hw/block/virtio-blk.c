@@ -67,6 +67,19 @@ static void virtio_blk_free_request(VirtIOBlockReq *req)
     g_free(req);
 }
 
+/*
+ * Return the AioContext that processes requests from @vq.  This is the
+ * BlockBackend's AioContext, unless dataplane spreads the virtqueues over
+ * several IOThreads.
+ */
+static AioContext *virtio_blk_vq_aio_context(VirtIOBlock *s, VirtQueue *vq)
+{
+    if (s->dataplane && s->dataplane_started && !s->dataplane_disabled) {
+        return virtio_blk_data_plane_get_aio_context(s->dataplane, vq);
+    }
+    return blk_get_aio_context(s->blk);
+}
+
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
 {
     VirtIOBlock *s = req->dev;
@@ -93,8 +106,10 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
         /* Break the link as the next request is going to be parsed from the
          * ring again. Otherwise we may end up doing a double completion! */
         req->mr_next = NULL;
+        qemu_mutex_lock(&s->rq_lock);
         req->next = s->rq;
         s->rq = req;
+        qemu_mutex_unlock(&s->rq_lock);
     } else if (action == BLOCK_ERROR_ACTION_REPORT) {
         virtio_blk_req_complete(req, VIRTIO_BLK_S_IOERR);
         if (acct_failed) {
@@ -112,8 +127,9 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
     VirtIOBlockReq *next = opaque;
     VirtIOBlock *s = next->dev;
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    AioContext *ctx = virtio_blk_vq_aio_context(s, next->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     while (next) {
         VirtIOBlockReq *req = next;
         next = req->mr_next;
@@ -146,15 +162,16 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
         block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
         virtio_blk_free_request(req);
     }
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_flush_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *req = opaque;
     VirtIOBlock *s = req->dev;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, 0, true)) {
             goto out;
@@ -166,7 +183,7 @@ static void virtio_blk_flush_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
@@ -175,8 +192,9 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     VirtIOBlock *s = req->dev;
     bool is_write_zeroes = (virtio_ldl_p(VIRTIO_DEVICE(s), &req->out.type) &
                             ~VIRTIO_BLK_T_BARRIER) == VIRTIO_BLK_T_WRITE_ZEROES;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, req->vq);
 
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_acquire(ctx);
     if (ret) {
         if (virtio_blk_handle_rw_error(req, -ret, false, is_write_zeroes)) {
             goto out;
@@ -190,7 +208,7 @@ static void virtio_blk_discard_write_zeroes_complete(void *opaque, int ret)
     virtio_blk_free_request(req);
 
 out:
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
 }
 
 #ifdef __linux__
@@ -208,6 +226,7 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     VirtIODevice *vdev = VIRTIO_DEVICE(s);
     struct virtio_scsi_inhdr *scsi;
     struct sg_io_hdr *hdr;
+    AioContext *ctx;
 
     scsi = (void *)req->elem.in_sg[req->elem.in_num - 2].iov_base;
 
@@ -237,10 +256,11 @@ static void virtio_blk_ioctl_complete(void *opaque, int status)
     virtio_stl_p(vdev, &scsi->data_len, hdr->dxfer_len);
 
 out:
-    aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
+    ctx = virtio_blk_vq_aio_context(s, req->vq);
+    aio_context_acquire(ctx);
     virtio_blk_req_complete(req, status);
     virtio_blk_free_request(req);
-    aio_context_release(blk_get_aio_context(s->conf.conf.blk));
+    aio_context_release(ctx);
     g_free(ioctl_req);
 }
 
@@ -758,8 +778,9 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
     bool progress = false;
+    AioContext *ctx = virtio_blk_vq_aio_context(s, vq);
 
-    aio_context_acquire(blk_get_aio_context(s->blk));
+    aio_context_acquire(ctx);
     blk_io_plug(s->blk);
 
     do {
@@ -782,7 +803,7 @@ bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     }
 
     blk_io_unplug(s->blk);
-    aio_context_release(blk_get_aio_context(s->blk));
+    aio_context_release(ctx);
     return progress;
 }
 
@@ -810,13 +831,16 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_blk_dma_restart_bh(void *opaque)
 {
     VirtIOBlock *s = opaque;
-    VirtIOBlockReq *req = s->rq;
+    VirtIOBlockReq *req;
     MultiReqBuffer mrb = {};
 
     qemu_bh_delete(s->bh);
     s->bh = NULL;
 
+    qemu_mutex_lock(&s->rq_lock);
+    req = s->rq;
     s->rq = NULL;
+    qemu_mutex_unlock(&s->rq_lock);
 
     aio_context_acquire(blk_get_aio_context(s->conf.conf.blk));
     while (req) {
@@ -1087,8 +1111,28 @@ static void virtio_blk_resize(void *opaque)
     virtio_notify_config(vdev);
 }
 
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane && s->dataplane_started && !s->dataplane_disabled) {
+        virtio_blk_data_plane_drained_begin(s->dataplane);
+    }
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->dataplane) {
+        virtio_blk_data_plane_drained_end(s->dataplane);
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1163,6 +1207,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
+    qemu_mutex_init(&s->rq_lock);
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
@@ -1171,6 +1216,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        qemu_mutex_destroy(&s->rq_lock);
         virtio_cleanup(vdev);
         return;
     }
@@ -1189,6 +1235,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
 
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
+    qemu_mutex_destroy(&s->rq_lock);
     qemu_del_vm_change_state_handler(s->change);
     blockdev_mark_auto_del(s->blk);
     virtio_cleanup(vdev);
@@ -1203,6 +1250,14 @@ static void virtio_blk_instance_init(Object *obj)
                                   DEVICE(obj), NULL);
 }
 
+static void virtio_blk_instance_finalize(Object *obj)
+{
+    VirtIOBlock *s = VIRTIO_BLK(obj);
+
+    /* The strings themselves are freed with the array element properties */
+    g_free(s->conf.iothreads);
+}
+
 static const VMStateDescription vmstate_virtio_blk = {
     .name = "virtio-blk",
     .minimum_version_id = 2,
@@ -1230,6 +1285,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_UINT16("queue-size", VirtIOBlock, conf.queue_size, 128),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_ARRAY("iothreads", VirtIOBlock, conf.num_iothreads,
+                      conf.iothreads, qdev_prop_string, char *),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BIT64("write-zeroes", VirtIOBlock, host_features,
@@ -1267,6 +1324,7 @@ static const TypeInfo virtio_blk_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIOBlock),
     .instance_init = virtio_blk_instance_init,
+    .instance_finalize = virtio_blk_instance_finalize,
     .class_init = virtio_blk_class_init,
 };
 
@@ -230,6 +230,37 @@ static void machine_set_kvm_shadow_mem(Object *obj, Visitor *v,
     ms->kvm_shadow_mem = value;
 }
 
+static void machine_get_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    uint32_t value = ms->kvm_dirty_ring_size;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void machine_set_kvm_dirty_ring_size(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+    Error *error = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, name, &value, &error);
+    if (error) {
+        error_propagate(errp, error);
+        return;
+    }
+    if (value & (value - 1)) {
+        error_setg(errp, "kvm-dirty-ring-size must be a power of two");
+        return;
+    }
+
+    ms->kvm_dirty_ring_size = value;
+}
+
 static char *machine_get_kernel(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -679,6 +710,13 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "kvm-shadow-mem",
         "KVM shadow MMU size", &error_abort);
 
+    object_class_property_add(oc, "kvm-dirty-ring-size", "uint32",
+        machine_get_kvm_dirty_ring_size, machine_set_kvm_dirty_ring_size,
+        NULL, NULL, &error_abort);
+    object_class_property_set_description(oc, "kvm-dirty-ring-size",
+        "Entries of the per-vCPU KVM dirty ring, 0 to use the dirty bitmap",
+        &error_abort);
+
     object_class_property_add_str(oc, "kernel",
         machine_get_kernel, machine_set_kernel, &error_abort);
     object_class_property_set_description(oc, "kernel",
@@ -836,6 +874,11 @@ int machine_kvm_shadow_mem(MachineState *machine)
     return machine->kvm_shadow_mem;
 }
 
+uint32_t machine_kvm_dirty_ring_size(MachineState *machine)
+{
+    return machine->kvm_dirty_ring_size;
+}
+
 int machine_phandle_start(MachineState *machine)
 {
     return machine->phandle_start;
@@ -520,10 +520,16 @@ static const VMStateDescription vmstate_i8257_regs = {
     }
 };
 
+/*
+ * Transfers touch other devices, so they are left to the main loop rather
+ * than run here, where the load may happen without the BQL.
+ */
 static int i8257_post_load(void *opaque, int version_id)
 {
     I8257State *d = opaque;
-    i8257_dma_run(d);
+
+    qemu_bh_schedule_idle(d->dma_bh);
+    d->dma_bh_scheduled = true;
 
     return 0;
 }
@@ -532,6 +538,7 @@ static const VMStateDescription vmstate_i8257 = {
     .name = "dma",
     .version_id = 1,
     .minimum_version_id = 1,
+    .parallel = true,
     .post_load = i8257_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8(command, I8257State),
@@ -28,6 +28,7 @@
 #include "qemu/compiler.h"
 #include "qemu/int128.h"
 #include "qemu/range.h"
+#include "qemu/timer.h"
 #include "exec/memory.h"
 #include "exec/cpu-common.h"
 #include "cpu.h"
@@ -52,13 +53,7 @@ type_init(remote_mem_sync_register_types)
 static void proxy_ml_begin(MemoryListener *listener)
 {
     RemoteMemSync *sync = container_of(listener, RemoteMemSync, listener);
-    int mrs;
 
-    for (mrs = 0; mrs < sync->n_mr_sections; mrs++) {
-        memory_region_unref(sync->mr_sections[mrs].mr);
-    }
-
-    g_free(sync->mr_sections);
     sync->mr_sections = NULL;
     sync->n_mr_sections = 0;
 }
@@ -150,41 +145,142 @@ static void proxy_ml_region_addnop(MemoryListener *listener,
     }
 }
 
-static void proxy_ml_commit(MemoryListener *listener)
+static bool proxy_mrs_equal(MemoryRegionSection *a, MemoryRegionSection *b)
+{
+    return a->mr == b->mr &&
+           a->offset_within_address_space == b->offset_within_address_space &&
+           a->offset_within_region == b->offset_within_region &&
+           int128_eq(a->size, b->size);
+}
+
+static bool proxy_mrs_find(MemoryRegionSection *sections, int n,
+                           MemoryRegionSection *section)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (proxy_mrs_equal(&sections[i], section)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void proxy_ml_send_sections(RemoteMemSync *sync, proc_cmd_t cmd,
+                                   MemoryRegionSection **sections, int n)
 {
-    RemoteMemSync *sync = container_of(listener, RemoteMemSync, listener);
     ProcMsg msg;
     ram_addr_t offset;
     MemoryRegion *mr;
-    MemoryRegionSection section;
     uintptr_t host_addr;
+    int64_t start;
     int region;
 
     memset(&msg, 0, sizeof(ProcMsg));
 
-    msg.cmd = SYNC_SYSMEM;
+    msg.cmd = cmd;
     msg.bytestream = 0;
-    msg.num_fds = sync->n_mr_sections;
     msg.size = sizeof(msg.data1);
-    assert(msg.num_fds <= REMOTE_MAX_FDS);
+    msg.data1.sync_sysmem.nregions = n;
+    assert(n <= REMOTE_MAX_FDS);
 
-    for (region = 0; region < sync->n_mr_sections; region++) {
-        section = sync->mr_sections[region];
+    for (region = 0; region < n; region++) {
         msg.data1.sync_sysmem.gpas[region] =
-            section.offset_within_address_space;
-        msg.data1.sync_sysmem.sizes[region] = int128_get64(section.size);
-        host_addr = (uintptr_t)memory_region_get_ram_ptr(section.mr) +
-                    section.offset_within_region;
-        mr = memory_region_from_host((void *)host_addr, &offset);
-        msg.fds[region] = memory_region_get_fd(mr);
-        msg.data1.sync_sysmem.offsets[region] = offset;
+            sections[region]->offset_within_address_space;
+        msg.data1.sync_sysmem.sizes[region] =
+            int128_get64(sections[region]->size);
+        if (cmd == SYNC_SYSMEM) {
+            host_addr =
+                (uintptr_t)memory_region_get_ram_ptr(sections[region]->mr) +
+                sections[region]->offset_within_region;
+            mr = memory_region_from_host((void *)host_addr, &offset);
+            msg.fds[region] = memory_region_get_fd(mr);
+            msg.data1.sync_sysmem.offsets[region] = offset;
+        }
     }
+    msg.num_fds = (cmd == SYNC_SYSMEM) ? n : 0;
+
+    start = get_clock();
     proxy_proc_send(sync->proxy_link, &msg);
+    proxy_link_account(sync->proxy_link, cmd, start);
+}
+
+/*
+ * Sends the difference between the layout shared with the remote process
+ * and the new one: regions that went away first, then the new ones, at
+ * most REMOTE_MAX_FDS per message. Regions that did not change are left
+ * mapped in the remote process.
+ */
+static void proxy_ml_commit(MemoryListener *listener)
+{
+    RemoteMemSync *sync = container_of(listener, RemoteMemSync, listener);
+    MemoryRegionSection *batch[REMOTE_MAX_FDS];
+    MemoryRegionSection *section;
+    int region, n = 0;
+
+    for (region = 0; region < sync->n_sent_sections; region++) {
+        section = &sync->sent_sections[region];
+        if (proxy_mrs_find(sync->mr_sections, sync->n_mr_sections, section)) {
+            continue;
+        }
+        batch[n++] = section;
+        if (n == REMOTE_MAX_FDS) {
+            proxy_ml_send_sections(sync, SYSMEM_DEL, batch, n);
+            n = 0;
+        }
+    }
+    if (n) {
+        proxy_ml_send_sections(sync, SYSMEM_DEL, batch, n);
+        n = 0;
+    }
+
+    for (region = 0; region < sync->n_mr_sections; region++) {
+        section = &sync->mr_sections[region];
+        if (proxy_mrs_find(sync->sent_sections, sync->n_sent_sections,
+                           section)) {
+            continue;
+        }
+        batch[n++] = section;
+        if (n == REMOTE_MAX_FDS) {
+            proxy_ml_send_sections(sync, SYNC_SYSMEM, batch, n);
+            n = 0;
+        }
+    }
+    if (n) {
+        proxy_ml_send_sections(sync, SYNC_SYSMEM, batch, n);
+    }
+
+    for (region = 0; region < sync->n_sent_sections; region++) {
+        memory_region_unref(sync->sent_sections[region].mr);
+    }
+    g_free(sync->sent_sections);
+
+    sync->sent_sections = sync->mr_sections;
+    sync->n_sent_sections = sync->n_mr_sections;
+    sync->mr_sections = NULL;
+    sync->n_mr_sections = 0;
+}
+
+static void proxy_mrs_release(MemoryRegionSection **sections, int *n)
+{
+    int region;
+
+    for (region = 0; region < *n; region++) {
+        memory_region_unref((*sections)[region].mr);
+    }
+    g_free(*sections);
+
+    *sections = NULL;
+    *n = 0;
 }
 
 void deconfigure_memory_sync(RemoteMemSync *sync)
 {
     memory_listener_unregister(&sync->listener);
+
+    proxy_mrs_release(&sync->mr_sections, &sync->n_mr_sections);
+    proxy_mrs_release(&sync->sent_sections, &sync->n_sent_sections);
 }
 
 /*
@@ -201,6 +297,8 @@ void configure_memory_sync(RemoteMemSync *sync, ProxyLinkState *proxy_link)
 {
     sync->n_mr_sections = 0;
     sync->mr_sections = NULL;
+    sync->n_sent_sections = 0;
+    sync->sent_sections = NULL;
 
     sync->proxy_link = proxy_link;
 
@@ -98,6 +98,88 @@ void hmp_remote_proc_list(Monitor *mon, const QDict *qdict)
     }
 }
 
+RemoteLinkStatsList *qmp_query_remote_link_stats(Error **errp)
+{
+    RemoteLinkStatsList *list = NULL, *entry;
+    RemoteLinkCmdStatsList *cmd_entry;
+    uint64List *bucket_entry;
+    RemoteLinkCmdStats *cs;
+    ProxyLinkStats *stats;
+    PCIProxyDev *pdev;
+    int cmd, bucket;
+
+    QLIST_FOREACH(pdev, &proxy_dev_list.devices, next) {
+        entry = g_malloc0(sizeof(RemoteLinkStatsList));
+        entry->next = list;
+        list = entry;
+        entry->value = g_malloc0(sizeof(RemoteLinkStats));
+        entry->value->id = g_strdup(DEVICE(pdev)->id);
+        entry->value->pid = pdev->remote_pid;
+
+        for (cmd = MAX - 1; cmd >= 0; cmd--) {
+            stats = &pdev->proxy_link->stats[cmd];
+            if (!stat64_get(&stats->count)) {
+                continue;
+            }
+
+            cs = g_malloc0(sizeof(RemoteLinkCmdStats));
+            cs->cmd = g_strdup(proxy_cmd_name(cmd));
+            cs->count = stat64_get(&stats->count);
+            cs->total_ns = stat64_get(&stats->total_ns);
+            cs->max_ns = stat64_get(&stats->max_ns);
+
+            for (bucket = PROXY_LINK_HIST_BUCKETS - 1; bucket >= 0; bucket--) {
+                bucket_entry = g_malloc0(sizeof(uint64List));
+                bucket_entry->value = stat64_get(&stats->hist[bucket]);
+                bucket_entry->next = cs->histogram;
+                cs->histogram = bucket_entry;
+            }
+
+            cmd_entry = g_malloc0(sizeof(RemoteLinkCmdStatsList));
+            cmd_entry->value = cs;
+            cmd_entry->next = entry->value->cmds;
+            entry->value->cmds = cmd_entry;
+        }
+    }
+
+    return list;
+}
+
+void hmp_info_remote_link_stats(Monitor *mon, const QDict *qdict)
+{
+    RemoteLinkStatsList *list, *entry;
+    RemoteLinkCmdStatsList *cmd_entry;
+    RemoteLinkCmdStats *cs;
+    uint64List *bucket_entry;
+    int bucket;
+
+    list = qmp_query_remote_link_stats(NULL);
+
+    for (entry = list; entry; entry = entry->next) {
+        monitor_printf(mon, "%s (pid %d):\n", entry->value->id,
+                       entry->value->pid);
+
+        for (cmd_entry = entry->value->cmds; cmd_entry;
+             cmd_entry = cmd_entry->next) {
+            cs = cmd_entry->value;
+            monitor_printf(mon, "  %-16s count %" PRIu64 " avg %" PRIu64
+                           " ns max %" PRIu64 " ns\n", cs->cmd, cs->count,
+                           cs->total_ns / cs->count, cs->max_ns);
+
+            for (bucket = 0, bucket_entry = cs->histogram; bucket_entry;
+                 bucket++, bucket_entry = bucket_entry->next) {
+                if (bucket_entry->value) {
+                    monitor_printf(mon, "    >= %12" PRIu64 " ns: %" PRIu64
+                                   "\n", (uint64_t)1 << bucket,
+                                   bucket_entry->value);
+                }
+            }
+        }
+    }
+
+    qapi_free_RemoteLinkStatsList(list);
+}
+
 static PCIProxyDev *get_proxy_device(QDict *qdict, Error **errp)
 {
     PCMachineState *pcms = PC_MACHINE(current_machine);
@@ -151,7 +233,7 @@ static void rdevice_add_del(QDict *qdict, proc_cmd_t cmd, Error **errp)
     msg.fds[0] = wait;
 
     proxy_proc_send(pdev->proxy_link, &msg);
-    (void)wait_for_remote(wait);
+    (void)proxy_link_wait(pdev->proxy_link, wait);
     PUT_REMOTE_WAIT(wait);
 
     qstring_destroy_obj(QOBJECT(json));
@@ -237,7 +319,7 @@ void hmp_rdrive_add(Monitor *mon, const QDict *qdict)
     msg.fds[0] = wait;
 
     proxy_proc_send(pdev->proxy_link, &msg);
-    (void)wait_for_remote(wait);
+    (void)proxy_link_wait(pdev->proxy_link, wait);
     PUT_REMOTE_WAIT(wait);
 
     /* TODO: Only on success */
@@ -276,7 +358,7 @@ void hmp_rdrive_del(Monitor *mon, const QDict *qdict)
     msg.fds[0] = wait;
 
     proxy_proc_send(pdev->proxy_link, &msg);
-    (void)wait_for_remote(wait);
+    (void)proxy_link_wait(pdev->proxy_link, wait);
     PUT_REMOTE_WAIT(wait);
 
     /* TODO: Only on success */
@@ -315,7 +397,7 @@ void qmp_rblock_resize(const char *rdev_id, const char *device, int64_t size,
     msg.fds[0] = wait;
 
     proxy_proc_send(pdev->proxy_link, &msg);
-    (void)wait_for_remote(wait);
+    (void)proxy_link_wait(pdev->proxy_link, wait);
     PUT_REMOTE_WAIT(wait);
 }
 
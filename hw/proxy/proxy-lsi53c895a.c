@@ -107,6 +107,19 @@ static const MemoryRegionOps proxy_lsi_mmio_ops = {
     },
 };
 
+/* Writing SIGP to ISTAT0 is the doorbell that wakes the SCRIPTS processor */
+#define PROXY_LSI_ISTAT0       0x14
+#define PROXY_LSI_ISTAT0_SEM   0x10
+#define PROXY_LSI_ISTAT0_SIGP  0x20
+
+static void proxy_lsi_add_ioeventfds(PCIProxyDev *dev, int bar)
+{
+    proxy_add_ioeventfd(dev, bar, PROXY_LSI_ISTAT0, 1, true,
+                        PROXY_LSI_ISTAT0_SIGP);
+    proxy_add_ioeventfd(dev, bar, PROXY_LSI_ISTAT0, 1, true,
+                        PROXY_LSI_ISTAT0_SIGP | PROXY_LSI_ISTAT0_SEM);
+}
+
 static void proxy_lsi_realize(PCIProxyDev *dev, Error **errp)
 {
     ProxyLSIState *s = LSI_PROXY_DEV(dev);
@@ -126,6 +139,9 @@ static void proxy_lsi_realize(PCIProxyDev *dev, Error **errp)
     pci_register_bar(pci_dev, 0, PCI_BASE_ADDRESS_SPACE_IO, &s->io_io);
     pci_register_bar(pci_dev, 1, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->mmio_io);
     pci_register_bar(pci_dev, 2, PCI_BASE_ADDRESS_SPACE_MEMORY, &s->ram_io);
+
+    proxy_lsi_add_ioeventfds(dev, 0);
+    proxy_lsi_add_ioeventfds(dev, 1);
 }
 
 static void proxy_lsi_class_init(ObjectClass *klass, void *data)
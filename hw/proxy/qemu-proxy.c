@@ -39,6 +39,7 @@
 #include "qemu/int128.h"
 #include "qemu/range.h"
 #include "hw/pci/pci.h"
+#include "hw/qdev-properties.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qapi/qmp/qjson.h"
@@ -48,11 +49,18 @@
 #include "hw/proxy/memory-sync.h"
 #include "qom/object.h"
 #include "qemu/event_notifier.h"
+#include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 #include "sysemu/kvm.h"
+#include "qom/cpu.h"
 #include "util/event_notifier-posix.c"
 #include "hw/i386/pc.h"
 #include "hw/boards.h"
 #include "include/qemu/log.h"
+#include "migration/register.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file-types.h"
+#include "migration/qemu-file.h"
 
 /*
  * TODO: kvm_vm_ioctl is only available for per-target objects (NEED_CPU_H).
@@ -62,6 +70,9 @@
 int kvm_vm_ioctl(KVMState *s, int type, ...);
 
 QEMUTimer *hb_timer;
+static QEMUBH *restart_bh;
+static EventNotifier childsig_notifier;
+static bool childsig_notifier_ready;
 static void pci_proxy_dev_realize(PCIDevice *dev, Error **errp);
 static void setup_irqfd(PCIProxyDev *dev);
 static void pci_dev_exit(PCIDevice *dev);
@@ -69,18 +80,36 @@ static void start_heartbeat_timer(void);
 static void stop_heartbeat_timer(void);
 static void childsig_handler(int sig, siginfo_t *siginfo, void *ctx);
 static void broadcast_msg(ProcMsg *msg, bool need_reply);
+static void proxy_posted_flush(PCIProxyDev *dev);
+static void proxy_posted_pause(PCIProxyDev *dev, bool paused);
 
+/*
+ * Runs in signal context, so it only writes to childsig_notifier; the
+ * restart itself is kicked off from the main loop by childsig_read().
+ */
 static void childsig_handler(int sig, siginfo_t *siginfo, void *ctx)
 {
-    /* TODO: Add proper handler. */
-    printf("Child (pid %d) is dead? Signal is %d, Exit code is %d.\n",
-           siginfo->si_pid, siginfo->si_signo, siginfo->si_code);
+    int saved_errno = errno;
+
+    if (childsig_notifier_ready) {
+        event_notifier_set(&childsig_notifier);
+    }
+
+    errno = saved_errno;
+}
+
+static void childsig_read(void *opaque)
+{
+    if (event_notifier_test_and_clear(&childsig_notifier)) {
+        qemu_bh_schedule(restart_bh);
+    }
 }
 
 static void broadcast_msg(ProcMsg *msg, bool need_reply)
 {
     PCIProxyDev *entry;
     unsigned int pid;
+    int64_t start;
     int wait;
 
     QLIST_FOREACH(entry, &proxy_dev_list.devices, next) {
@@ -90,10 +119,12 @@ static void broadcast_msg(ProcMsg *msg, bool need_reply)
             msg->fds[0] = wait;
         }
 
+        start = get_clock();
         proxy_proc_send(entry->proxy_link, msg);
         if (need_reply) {
-            pid = (uint32_t)wait_for_remote(wait);
+            pid = (uint32_t)proxy_link_wait(entry->proxy_link, wait);
             PUT_REMOTE_WAIT(wait);
+            proxy_link_account(entry->proxy_link, msg->cmd, start);
             /* TODO: Add proper handling. */
             if (pid) {
                 need_reply = 0;
@@ -106,6 +137,7 @@ static void broadcast_msg(ProcMsg *msg, bool need_reply)
 
 static void remote_ping(void *opaque)
 {
+    PCIProxyDev *entry;
     ProcMsg msg;
 
     memset(&msg, 0, sizeof(ProcMsg));
@@ -116,6 +148,14 @@ static void remote_ping(void *opaque)
     msg.size = 0;
 
     broadcast_msg(&msg, true);
+
+    QLIST_FOREACH(entry, &proxy_dev_list.devices, next) {
+        if (entry->auto_restart && proxy_link_is_dead(entry->proxy_link)) {
+            qemu_bh_schedule(restart_bh);
+            break;
+        }
+    }
+
     timer_mod(hb_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + NOP_INTERVAL);
 
 }
@@ -135,28 +175,217 @@ static void stop_heartbeat_timer(void)
     timer_free(hb_timer);
 }
 
+static void proxy_restart_bh(void *opaque);
+
 static void set_sigchld_handler(void)
 {
     struct sigaction sa_sigterm;
+
+    if (!restart_bh) {
+        restart_bh = qemu_bh_new(proxy_restart_bh, NULL);
+    }
+
+    if (!childsig_notifier_ready) {
+        if (event_notifier_init(&childsig_notifier, 0) < 0) {
+            error_report("Failed to create SIGCHLD notifier");
+            return;
+        }
+        qemu_set_fd_handler(event_notifier_get_fd(&childsig_notifier),
+                            childsig_read, NULL, NULL);
+        childsig_notifier_ready = true;
+    }
+
     memset(&sa_sigterm, 0, sizeof(sa_sigterm));
     sa_sigterm.sa_sigaction = childsig_handler;
     sa_sigterm.sa_flags = SA_SIGINFO | SA_NOCLDWAIT | SA_NOCLDSTOP;
     sigaction(SIGCHLD, &sa_sigterm, NULL);
 }
 
+static void setup_ring(PCIProxyDev *dev)
+{
+    Error *local_err = NULL;
+    ProcMsg msg;
+
+    proxy_posted_flush(dev);
+
+    if (proxy_link_ring_create(dev->proxy_link, dev->ring_poll_ns, &msg,
+                               &local_err)) {
+        warn_report_err(local_err);
+        return;
+    }
+
+    proxy_proc_send(dev->proxy_link, &msg);
+}
+
+/*
+ * Makes the remote process answer reads through completion slots shared
+ * with QEMU, instead of an eventfd created and passed for each read.
+ */
+static void setup_completion(PCIProxyDev *dev)
+{
+    Error *local_err = NULL;
+    ProcMsg msg;
+
+    if (proxy_link_completion_create(dev->proxy_link, &msg, &local_err)) {
+        warn_report_err(local_err);
+        return;
+    }
+
+    proxy_proc_send(dev->proxy_link, &msg);
+}
+
+/*
+ * Completion slot of the calling thread: one per vCPU, and slot 0 for
+ * everything else.
+ */
+static uint32_t proxy_completion_slot(void)
+{
+    if (!current_cpu) {
+        return 0;
+    }
+
+    return 1 + current_cpu->cpu_index % (PROXY_COMPLETION_SLOTS - 1);
+}
+
+/*
+ * Lets KVM signal the guest writes to the BAR offsets registered with
+ * proxy_add_ioeventfd() straight to the remote process, without an exit
+ * to QEMU. The remote process handles the ring and the messages already
+ * on the socket before a doorbell. Posted writes are held in QEMU, where
+ * the remote process cannot see them, so they are turned off while the
+ * doorbells are set up.
+ */
+static void setup_ioeventfds(PCIProxyDev *dev)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(dev);
+    ProxyIOEventFD *ioeventfd;
+    MemoryRegion *mr;
+    ProcMsg msg;
+
+    if (!dev->ioeventfd || !kvm_enabled() || !kvm_eventfds_enabled()) {
+        return;
+    }
+
+    QLIST_FOREACH(ioeventfd, &dev->ioeventfds, next) {
+        mr = pci_dev->io_regions[ioeventfd->bar].memory;
+        if (!mr) {
+            continue;
+        }
+
+        if (event_notifier_init(&ioeventfd->notifier, 0)) {
+            continue;
+        }
+
+        proxy_posted_pause(dev, true);
+
+        memset(&msg, 0, sizeof(ProcMsg));
+        msg.cmd = SET_IOEVENTFD;
+        msg.bytestream = 0;
+        msg.size = sizeof(msg.data1);
+        msg.data1.set_ioeventfd.bar = ioeventfd->bar;
+        msg.data1.set_ioeventfd.offset = ioeventfd->offset;
+        msg.data1.set_ioeventfd.size = ioeventfd->size;
+        msg.data1.set_ioeventfd.match_data = ioeventfd->match_data;
+        msg.data1.set_ioeventfd.data = ioeventfd->data;
+        msg.num_fds = 1;
+        msg.fds[0] = event_notifier_get_fd(&ioeventfd->notifier);
+
+        proxy_proc_send(dev->proxy_link, &msg);
+
+        memory_region_add_eventfd(mr, ioeventfd->offset, ioeventfd->size,
+                                  ioeventfd->match_data, ioeventfd->data,
+                                  &ioeventfd->notifier);
+        ioeventfd->active = true;
+    }
+}
+
+static void teardown_ioeventfds(PCIProxyDev *dev)
+{
+    PCIDevice *pci_dev = PCI_DEVICE(dev);
+    ProxyIOEventFD *ioeventfd;
+    MemoryRegion *mr;
+    ProcMsg msg;
+
+    QLIST_FOREACH(ioeventfd, &dev->ioeventfds, next) {
+        if (!ioeventfd->active) {
+            continue;
+        }
+
+        mr = pci_dev->io_regions[ioeventfd->bar].memory;
+        memory_region_del_eventfd(mr, ioeventfd->offset, ioeventfd->size,
+                                  ioeventfd->match_data, ioeventfd->data,
+                                  &ioeventfd->notifier);
+
+        if (!proxy_link_is_dead(dev->proxy_link)) {
+            memset(&msg, 0, sizeof(ProcMsg));
+            msg.cmd = DEL_IOEVENTFD;
+            msg.bytestream = 0;
+            msg.size = sizeof(msg.data1);
+            msg.data1.set_ioeventfd.bar = ioeventfd->bar;
+            msg.data1.set_ioeventfd.offset = ioeventfd->offset;
+            msg.data1.set_ioeventfd.size = ioeventfd->size;
+            msg.data1.set_ioeventfd.match_data = ioeventfd->match_data;
+            msg.data1.set_ioeventfd.data = ioeventfd->data;
+            msg.num_fds = 0;
+
+            proxy_proc_send(dev->proxy_link, &msg);
+        }
+
+        event_notifier_cleanup(&ioeventfd->notifier);
+        ioeventfd->active = false;
+    }
+
+    proxy_posted_pause(dev, false);
+}
+
+/* Sets up everything that is shared with the remote process over the link */
+static void setup_link(PCIProxyDev *dev)
+{
+    setup_irqfd(dev);
+    if (dev->shm_ring) {
+        setup_ring(dev);
+    }
+    if (dev->completion) {
+        setup_completion(dev);
+    }
+    setup_ioeventfds(dev);
+}
+
 static void proxy_ready(PCIDevice *dev)
 {
     PCIProxyDev *pdev = PCI_PROXY_DEV(dev);
 
-    setup_irqfd(pdev);
+    setup_link(pdev);
     set_sigchld_handler();
     start_heartbeat_timer();
+
+    if (pdev->checkpoint_timer) {
+        timer_mod(pdev->checkpoint_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  pdev->checkpoint_ms);
+    }
+}
+
+static void send_remote_opts(PCIProxyDev *pdev, const char *str,
+                             unsigned int cmd)
+{
+    ProcMsg msg;
+
+    memset(&msg, 0, sizeof(ProcMsg));
+
+    msg.data2 = (uint8_t *)str;
+    msg.cmd = cmd;
+    msg.bytestream = 1;
+    msg.size = strlen(str) + 1;
+    msg.num_fds = 0;
+
+    proxy_proc_send(pdev->proxy_link, &msg);
 }
 
 static void set_remote_opts(PCIDevice *dev, QDict *qdict, unsigned int cmd)
 {
+    ProxyRemoteOpts *opts;
     QString *qstr;
-    ProcMsg msg;
     const char *str;
     PCIProxyDev *pdev;
 
@@ -166,17 +395,15 @@ static void set_remote_opts(PCIDevice *dev, QDict *qdict, unsigned int cmd)
     str = qstring_get_str(qstr);
     qemu_log_mask(LOG_REMOTE_DEBUG, "remote qdict in proxy: %s.\n", str);
 
-    memset(&msg, 0, sizeof(ProcMsg));
-
-    msg.data2 = (uint8_t *)str;
-    msg.cmd = cmd;
-    msg.bytestream = 1;
-    msg.size = qstring_get_length(qstr) + 1;
-    msg.num_fds = 0;
+    send_remote_opts(pdev, str, cmd);
 
-    proxy_proc_send(pdev->proxy_link, &msg);
+    /* Kept to be replayed if the remote process is restarted */
+    opts = g_new0(ProxyRemoteOpts, 1);
+    opts->cmd = cmd;
+    opts->json = g_strdup(str);
+    QSIMPLEQ_INSERT_TAIL(&pdev->remote_opts, opts, next);
 
-    return;
+    qobject_unref(qstr);
 }
 
 static int config_op_send(PCIProxyDev *dev, uint32_t addr, uint32_t *val, int l,
@@ -184,8 +411,24 @@ static int config_op_send(PCIProxyDev *dev, uint32_t addr, uint32_t *val, int l,
 {
     ProcMsg msg;
     struct conf_data_msg conf_data;
+    int64_t start;
     int wait;
 
+    proxy_posted_flush(dev);
+
+    start = get_clock();
+
+    if (dev->proxy_link->ring) {
+        if (op == CONF_READ) {
+            *val = (uint32_t)proxy_ring_submit(dev->proxy_link, op, addr, 0,
+                                               l, false);
+        } else {
+            proxy_ring_submit(dev->proxy_link, op, addr, *val, l, false);
+        }
+        proxy_link_account(dev->proxy_link, op, start);
+        return 0;
+    }
+
     memset(&msg, 0, sizeof(ProcMsg));
     conf_data.addr = addr;
     conf_data.val = (op == CONF_WRITE) ? *val : 0;
@@ -205,6 +448,10 @@ static int config_op_send(PCIProxyDev *dev, uint32_t addr, uint32_t *val, int l,
 
     if (op == CONF_WRITE) {
         msg.num_fds = 0;
+    } else if (dev->proxy_link->comp) {
+        msg.num_fds = 0;
+        proxy_link_completion_begin(dev->proxy_link, &msg,
+                                    proxy_completion_slot());
     } else {
         wait = GET_REMOTE_WAIT;
         msg.num_fds = 1;
@@ -214,10 +461,17 @@ static int config_op_send(PCIProxyDev *dev, uint32_t addr, uint32_t *val, int l,
     proxy_proc_send(dev->proxy_link, &msg);
 
     if (op == CONF_READ) {
-        *val = (uint32_t)wait_for_remote(wait);
-        PUT_REMOTE_WAIT(wait);
+        if (msg.id) {
+            *val = (uint32_t)proxy_link_completion_wait(dev->proxy_link,
+                                                        &msg);
+        } else {
+            *val = (uint32_t)proxy_link_wait(dev->proxy_link, wait);
+            PUT_REMOTE_WAIT(wait);
+        }
     }
 
+    proxy_link_account(dev->proxy_link, op, start);
+
     free(msg.data2);
 
     return 0;
@@ -242,14 +496,191 @@ static void pci_proxy_write_config(PCIDevice *d, uint32_t addr, uint32_t val,
     config_op_send(PCI_PROXY_DEV(d), addr, &val, l, CONF_WRITE);
 }
 
+/*
+ * The state of the remote devices is opaque to QEMU. The remote process
+ * writes it to a pipe, and it is sent on the migration stream as a
+ * length-prefixed blob that the destination feeds back to its own remote
+ * process.
+ */
+static int proxy_save_state(PCIProxyDev *dev, GByteArray *state)
+{
+    uint8_t buf[4096];
+    ProcMsg msg;
+    ssize_t len;
+    uint64_t ret;
+    int pipefd[2];
+    int wait;
+
+    /*
+     * DEVICE_SAVE goes over the socket, so the state must include the
+     * writes still queued on the ring, which the socket does not order.
+     */
+    proxy_posted_flush(dev);
+    if (dev->proxy_link->ring) {
+        proxy_ring_drain(dev->proxy_link);
+    }
+
+    if (pipe(pipefd)) {
+        return -errno;
+    }
+
+    wait = GET_REMOTE_WAIT;
+
+    memset(&msg, 0, sizeof(ProcMsg));
+    msg.cmd = DEVICE_SAVE;
+    msg.bytestream = 0;
+    msg.size = 0;
+    msg.num_fds = 2;
+    msg.fds[0] = pipefd[1];
+    msg.fds[1] = wait;
+
+    proxy_proc_send(dev->proxy_link, &msg);
+    close(pipefd[1]);
+
+    do {
+        len = read(pipefd[0], buf, sizeof(buf));
+        if (len > 0) {
+            g_byte_array_append(state, buf, len);
+        }
+    } while (len > 0 || (len < 0 && errno == EINTR));
+    close(pipefd[0]);
+
+    ret = proxy_link_wait(dev->proxy_link, wait);
+    PUT_REMOTE_WAIT(wait);
+
+    return (len < 0 || ret) ? -EIO : 0;
+}
+
+static void proxy_vm_save(QEMUFile *f, void *opaque)
+{
+    PCIProxyDev *dev = opaque;
+    GByteArray *state;
+    int ret;
+
+    state = g_byte_array_new();
+
+    ret = proxy_save_state(dev, state);
+    if (ret) {
+        error_report("Failed to save the state of remote device %s",
+                     DEVICE(dev)->id);
+        qemu_file_set_error(f, ret);
+    }
+
+    qemu_put_be64(f, state->len);
+    qemu_put_buffer(f, state->data, state->len);
+
+    g_byte_array_free(state, TRUE);
+}
+
+static int proxy_load_state(PCIProxyDev *dev, const uint8_t *state,
+                            uint64_t len)
+{
+    uint64_t done;
+    ProcMsg msg;
+    ssize_t rc;
+    uint64_t ret;
+    int pipefd[2];
+    int wait;
+
+    if (pipe(pipefd)) {
+        return -errno;
+    }
+
+    wait = GET_REMOTE_WAIT;
+
+    memset(&msg, 0, sizeof(ProcMsg));
+    msg.cmd = DEVICE_LOAD;
+    msg.bytestream = 0;
+    msg.size = 0;
+    msg.num_fds = 2;
+    msg.fds[0] = pipefd[0];
+    msg.fds[1] = wait;
+
+    proxy_proc_send(dev->proxy_link, &msg);
+    close(pipefd[0]);
+
+    for (done = 0; done < len; done += rc) {
+        rc = write(pipefd[1], state + done, len - done);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                rc = 0;
+                continue;
+            }
+            break;
+        }
+    }
+    close(pipefd[1]);
+
+    ret = proxy_link_wait(dev->proxy_link, wait);
+    PUT_REMOTE_WAIT(wait);
+
+    return (done == len && !ret) ? 0 : -EINVAL;
+}
+
+static int proxy_vm_load(QEMUFile *f, void *opaque, int version_id)
+{
+    PCIProxyDev *dev = opaque;
+    uint8_t *state;
+    uint64_t len;
+    int ret;
+
+    len = qemu_get_be64(f);
+    state = g_malloc(len);
+    if (qemu_get_buffer(f, state, len) != len) {
+        g_free(state);
+        return -EINVAL;
+    }
+
+    ret = proxy_load_state(dev, state, len);
+    g_free(state);
+
+    return ret;
+}
+
+/*
+ * Remote device state is migrated non-iteratively, in the stop-and-copy
+ * phase only: it is plain VMState, and guest RAM is migrated by QEMU.
+ */
+static SaveVMHandlers savevm_proxy_dev = {
+    .save_state = proxy_vm_save,
+    .load_state = proxy_vm_load,
+};
+
+static const VMStateDescription vmstate_pci_proxy_dev = {
+    .name = TYPE_PCI_PROXY_DEV,
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_PCI_DEVICE(parent_dev, PCIProxyDev),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static Property pci_proxy_dev_properties[] = {
+    DEFINE_PROP_BOOL("shm-ring", PCIProxyDev, shm_ring, false),
+    DEFINE_PROP_UINT64("ring-poll-ns", PCIProxyDev, ring_poll_ns, 50000),
+    DEFINE_PROP_BOOL("posted-writes", PCIProxyDev, posted_writes, false),
+    DEFINE_PROP_UINT32("posted-write-delay-us", PCIProxyDev, posted_delay_us,
+                       100),
+    DEFINE_PROP_BOOL("ioeventfd", PCIProxyDev, ioeventfd, false),
+    DEFINE_PROP_BOOL("completion", PCIProxyDev, completion, false),
+    DEFINE_PROP_BOOL("auto-restart", PCIProxyDev, auto_restart, false),
+    DEFINE_PROP_UINT32("checkpoint-ms", PCIProxyDev, checkpoint_ms, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void pci_proxy_dev_class_init(ObjectClass *klass, void *data)
 {
+    DeviceClass *dc = DEVICE_CLASS(klass);
     PCIDeviceClass *k = PCI_DEVICE_CLASS(klass);
 
     k->realize = pci_proxy_dev_realize;
     k->exit = pci_dev_exit;
     k->config_read = pci_proxy_read_config;
     k->config_write = pci_proxy_write_config;
+
+    dc->props = pci_proxy_dev_properties;
+    dc->vmsd = &vmstate_pci_proxy_dev;
 }
 
 static const TypeInfo pci_proxy_dev_type_info = {
@@ -293,6 +724,36 @@ static void proxy_intx_update(PCIDevice *pci_dev)
     (void) kvm_vm_ioctl(kvm_state, KVM_IRQFD, &dev->irqfd);
 }
 
+/*
+ * Without KVM irqfds, the interrupt of the remote device is raised from
+ * the QEMU main loop. Like the vfio INTx slow path, it stays asserted
+ * until the guest accesses a BAR of the device, which is taken as the end
+ * of interrupt; the resample eventfd then makes the remote process signal
+ * again if its interrupt is still asserted.
+ */
+static void proxy_intx_interrupt(void *opaque)
+{
+    PCIProxyDev *dev = opaque;
+
+    if (!event_notifier_test_and_clear(&dev->intr)) {
+        return;
+    }
+
+    dev->intx_pending = true;
+    pci_set_irq(PCI_DEVICE(dev), 1);
+}
+
+static void proxy_intx_eoi(PCIProxyDev *dev)
+{
+    if (!dev->intx_pending) {
+        return;
+    }
+
+    dev->intx_pending = false;
+    pci_set_irq(PCI_DEVICE(dev), 0);
+    event_notifier_set(&dev->resample);
+}
+
 static void setup_irqfd(PCIProxyDev *dev)
 {
     PCIDevice *pci_dev = PCI_DEVICE(dev);
@@ -313,13 +774,41 @@ static void setup_irqfd(PCIProxyDev *dev)
 
     memset(&dev->irqfd, 0, sizeof(struct kvm_irqfd));
 
+    if (!kvm_enabled() || !kvm_irqfds_enabled() ||
+        !kvm_resamplefds_enabled()) {
+        qemu_set_fd_handler(event_notifier_get_fd(&dev->intr),
+                            proxy_intx_interrupt, NULL, dev);
+        return;
+    }
+
     proxy_intx_update(pci_dev);
 
     pci_device_set_intx_routing_notifier(pci_dev, proxy_intx_update);
 }
 
+static void teardown_irqfd(PCIProxyDev *dev)
+{
+    if (!dev->irqfd.fd) {
+        qemu_set_fd_handler(event_notifier_get_fd(&dev->intr), NULL, NULL,
+                            NULL);
+        proxy_intx_eoi(dev);
+    } else {
+        dev->irqfd.flags = KVM_IRQFD_FLAG_DEASSIGN;
+        (void) kvm_vm_ioctl(kvm_state, KVM_IRQFD, &dev->irqfd);
+        memset(&dev->irqfd, 0, sizeof(struct kvm_irqfd));
+    }
+
+    event_notifier_cleanup(&dev->intr);
+    event_notifier_cleanup(&dev->resample);
+}
+
+/*
+ * pdev->proxy_link and pdev->remote_pid are only updated once the new
+ * process is running, so on failure the caller still owns the old link.
+ */
 static void init_emulation_process(PCIProxyDev *pdev, char *command, Error **errp)
 {
+    ProxyLinkState *proxy_link;
     char *args[3];
     pid_t rpid;
     int fd[2];
@@ -333,7 +822,6 @@ static void init_emulation_process(PCIProxyDev *pdev, char *command, Error **err
     rpid = qemu_fork(errp);
 
     if (rpid == -1) {
-        error_setg(errp, "Unable to spawn emulation program.");
         close(fd[0]);
         close(fd[1]);
         return;
@@ -350,19 +838,192 @@ static void init_emulation_process(PCIProxyDev *pdev, char *command, Error **err
         exit(1);
     }
 
-    pdev->proxy_link = proxy_link_create();
+    close(fd[1]);
+
+    proxy_link = proxy_link_create();
+    proxy_link_set_sock(proxy_link, fd[0]);
+
+    pdev->proxy_link = proxy_link;
     pdev->remote_pid = rpid;
+}
 
-    if (!pdev->proxy_link) {
-        error_setg(errp, "Failed to create proxy link");
-        close(fd[0]);
-        close(fd[1]);
+static void proxy_posted_flush_locked(PCIProxyDev *dev)
+{
+    ProcMsg msg;
+    int64_t start;
+
+    if (!dev->n_posted) {
         return;
     }
 
-    proxy_link_set_sock(pdev->proxy_link, fd[0]);
+    memset(&msg, 0, sizeof(ProcMsg));
 
-    close(fd[1]);
+    msg.cmd = BAR_WRITE_BATCH;
+    msg.bytestream = 1;
+    msg.size = dev->n_posted * sizeof(bar_access_msg_t);
+    msg.data2 = (uint8_t *)dev->posted;
+    msg.num_fds = 0;
+
+    start = get_clock();
+    proxy_proc_send(dev->proxy_link, &msg);
+    proxy_link_account(dev->proxy_link, BAR_WRITE_BATCH, start);
+
+    dev->n_posted = 0;
+    timer_del(dev->posted_timer);
+}
+
+/*
+ * Sends the BAR writes queued by proxy_default_bar_write(). Must be called
+ * before anything else is sent to the remote device, so that it observes
+ * the accesses in the order the guest issued them.
+ */
+static void proxy_posted_flush(PCIProxyDev *dev)
+{
+    if (!dev->posted_writes) {
+        return;
+    }
+
+    qemu_mutex_lock(&dev->posted_lock);
+    proxy_posted_flush_locked(dev);
+    qemu_mutex_unlock(&dev->posted_lock);
+}
+
+/*
+ * While paused, BAR writes are sent as soon as they are issued, so that
+ * none of them is still held in QEMU when the guest rings a doorbell.
+ */
+static void proxy_posted_pause(PCIProxyDev *dev, bool paused)
+{
+    if (!dev->posted_writes) {
+        return;
+    }
+
+    qemu_mutex_lock(&dev->posted_lock);
+    proxy_posted_flush_locked(dev);
+    atomic_set(&dev->posted_paused, paused);
+    qemu_mutex_unlock(&dev->posted_lock);
+}
+
+static void proxy_posted_timer_cb(void *opaque)
+{
+    proxy_posted_flush(opaque);
+}
+
+static void proxy_posted_write(PCIProxyDev *dev, hwaddr addr, uint64_t val,
+                               unsigned size, bool memory)
+{
+    bar_access_msg_t *bar_access;
+
+    qemu_mutex_lock(&dev->posted_lock);
+
+    bar_access = &dev->posted[dev->n_posted++];
+    bar_access->addr = addr;
+    bar_access->val = val;
+    bar_access->size = size;
+    bar_access->memory = memory;
+
+    if (dev->n_posted == PROXY_POSTED_WRITES_MAX || dev->posted_paused) {
+        proxy_posted_flush_locked(dev);
+    } else if (dev->n_posted == 1) {
+        timer_mod(dev->posted_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                  dev->posted_delay_us);
+    }
+
+    qemu_mutex_unlock(&dev->posted_lock);
+}
+
+static void proxy_checkpoint_timer_cb(void *opaque)
+{
+    PCIProxyDev *dev = opaque;
+    GByteArray *state;
+
+    if (runstate_is_running() && !proxy_link_is_dead(dev->proxy_link)) {
+        state = g_byte_array_new();
+        if (proxy_save_state(dev, state)) {
+            g_byte_array_free(state, TRUE);
+        } else {
+            if (dev->checkpoint) {
+                g_byte_array_free(dev->checkpoint, TRUE);
+            }
+            dev->checkpoint = state;
+        }
+    }
+
+    timer_mod(dev->checkpoint_timer,
+              qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + dev->checkpoint_ms);
+}
+
+/*
+ * Replaces a remote process that died with a new one, and brings it to
+ * the state of the old one: same memory layout, options, irqfds and
+ * ioeventfds, and the device state of the last checkpoint. Accesses that
+ * were in flight when the process died have already failed, reads with
+ * all ones. The rest of the VM keeps running meanwhile.
+ */
+static void proxy_restart(PCIProxyDev *dev)
+{
+    PCIProxyDevClass *k = PCI_PROXY_DEV_GET_CLASS(dev);
+    ProxyLinkState *old_link = dev->proxy_link;
+    Error *local_err = NULL;
+    ProxyRemoteOpts *opts;
+    int64_t start = get_clock();
+
+    error_report("Remote process %d of %s died, restarting it",
+                 dev->remote_pid, DEVICE(dev)->id);
+
+    if (dev->posted_writes) {
+        qemu_mutex_lock(&dev->posted_lock);
+        dev->n_posted = 0;
+        timer_del(dev->posted_timer);
+        qemu_mutex_unlock(&dev->posted_lock);
+    }
+
+    teardown_ioeventfds(dev);
+    teardown_irqfd(dev);
+    deconfigure_memory_sync(dev->sync);
+
+    init_emulation_process(dev, k->command, &local_err);
+    if (local_err) {
+        /* dev->proxy_link is still old_link, the next ping retries */
+        error_report_err(local_err);
+        return;
+    }
+
+    /*
+     * Threads that were waiting on the old link may still be looking at
+     * it, so it is only freed with the device.
+     */
+    dev->dead_links = g_slist_prepend(dev->dead_links, old_link);
+
+    configure_memory_sync(dev->sync, dev->proxy_link);
+
+    QSIMPLEQ_FOREACH(opts, &dev->remote_opts, next) {
+        send_remote_opts(dev, opts->json, opts->cmd);
+    }
+
+    setup_link(dev);
+
+    if (dev->checkpoint &&
+        proxy_load_state(dev, dev->checkpoint->data, dev->checkpoint->len)) {
+        error_report("Failed to restore the state of remote device %s",
+                     DEVICE(dev)->id);
+    }
+
+    info_report("Remote process of %s restarted as %d in %" PRId64 " us",
+                DEVICE(dev)->id, dev->remote_pid,
+                (get_clock() - start) / SCALE_US);
+}
+
+static void proxy_restart_bh(void *opaque)
+{
+    PCIProxyDev *entry;
+
+    QLIST_FOREACH(entry, &proxy_dev_list.devices, next) {
+        if (entry->auto_restart && proxy_link_is_dead(entry->proxy_link)) {
+            proxy_restart(entry);
+        }
+    }
 }
 
 static void pci_proxy_dev_realize(PCIDevice *device, Error **errp)
@@ -373,7 +1034,14 @@ static void pci_proxy_dev_realize(PCIDevice *device, Error **errp)
     PCMachineState *pcms = PC_MACHINE(current_machine);
     DeviceState *d = DEVICE(dev);
 
-    init_emulation_process(dev, k->command, errp);
+    QLIST_INIT(&dev->ioeventfds);
+    QSIMPLEQ_INIT(&dev->remote_opts);
+
+    init_emulation_process(dev, k->command, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
 
     (void)g_hash_table_insert(pcms->remote_devs, (gpointer)d->id, (gpointer)dev);
 
@@ -387,6 +1055,21 @@ static void pci_proxy_dev_realize(PCIDevice *device, Error **errp)
     dev->sync = REMOTE_MEM_SYNC(object_new(TYPE_MEMORY_LISTENER));
 
     configure_memory_sync(dev->sync, dev->proxy_link);
+
+    dev->n_posted = 0;
+    if (dev->posted_writes) {
+        qemu_mutex_init(&dev->posted_lock);
+        dev->posted_timer = timer_new_us(QEMU_CLOCK_REALTIME,
+                                         proxy_posted_timer_cb, dev);
+    }
+
+    if (dev->auto_restart && dev->checkpoint_ms) {
+        dev->checkpoint_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                             proxy_checkpoint_timer_cb, dev);
+    }
+
+    register_savevm_live(d, "proxy-device", -1, 1, &savevm_proxy_dev, dev);
+
     dev->set_remote_opts = set_remote_opts;
     dev->proxy_ready = proxy_ready;
 
@@ -396,9 +1079,51 @@ static void pci_dev_exit(PCIDevice *pdev)
 {
     PCIProxyDev *entry, *sentry;
     PCIProxyDev *dev = PCI_PROXY_DEV(pdev);
+    ProxyIOEventFD *ioeventfd, *next_ioeventfd;
+    ProxyRemoteOpts *opts;
+    GSList *link;
 
     stop_heartbeat_timer();
 
+    unregister_savevm(DEVICE(dev), "proxy-device", dev);
+
+    teardown_ioeventfds(dev);
+    QLIST_FOREACH_SAFE(ioeventfd, &dev->ioeventfds, next, next_ioeventfd) {
+        QLIST_REMOVE(ioeventfd, next);
+        g_free(ioeventfd);
+    }
+
+    if (dev->checkpoint_timer) {
+        timer_del(dev->checkpoint_timer);
+        timer_free(dev->checkpoint_timer);
+        dev->checkpoint_timer = NULL;
+    }
+    if (dev->checkpoint) {
+        g_byte_array_free(dev->checkpoint, TRUE);
+        dev->checkpoint = NULL;
+    }
+
+    while (!QSIMPLEQ_EMPTY(&dev->remote_opts)) {
+        opts = QSIMPLEQ_FIRST(&dev->remote_opts);
+        QSIMPLEQ_REMOVE_HEAD(&dev->remote_opts, next);
+        g_free(opts->json);
+        g_free(opts);
+    }
+
+    for (link = dev->dead_links; link; link = link->next) {
+        proxy_link_finalize(link->data);
+    }
+    g_slist_free(dev->dead_links);
+    dev->dead_links = NULL;
+
+    if (dev->posted_timer) {
+        proxy_posted_flush(dev);
+        timer_del(dev->posted_timer);
+        timer_free(dev->posted_timer);
+        dev->posted_timer = NULL;
+        qemu_mutex_destroy(&dev->posted_lock);
+    }
+
     QLIST_FOREACH_SAFE(entry, &proxy_dev_list.devices, next, sentry) {
         if (entry->remote_pid == dev->remote_pid) {
             QLIST_REMOVE(entry, next);
@@ -415,8 +1140,23 @@ static void send_bar_access_msg(ProxyLinkState *proxy_link, MemoryRegion *mr,
                                 unsigned size, bool memory)
 {
     ProcMsg msg;
+    int64_t start;
     int wait;
 
+    start = get_clock();
+
+    if (proxy_link->ring) {
+        if (write) {
+            proxy_ring_submit(proxy_link, BAR_WRITE, mr->addr + addr, *val,
+                              size, memory);
+        } else {
+            *val = proxy_ring_submit(proxy_link, BAR_READ, mr->addr + addr, 0,
+                                     size, memory);
+        }
+        proxy_link_account(proxy_link, write ? BAR_WRITE : BAR_READ, start);
+        return;
+    }
+
     memset(&msg, 0, sizeof(ProcMsg));
 
     msg.bytestream = 0;
@@ -428,6 +1168,10 @@ static void send_bar_access_msg(ProxyLinkState *proxy_link, MemoryRegion *mr,
     if (write) {
         msg.cmd = BAR_WRITE;
         msg.data1.bar_access.val = *val;
+    } else if (proxy_link->comp) {
+        msg.cmd = BAR_READ;
+        proxy_link_completion_begin(proxy_link, &msg,
+                                    proxy_completion_slot());
     } else {
         wait = GET_REMOTE_WAIT;
 
@@ -438,15 +1182,27 @@ static void send_bar_access_msg(ProxyLinkState *proxy_link, MemoryRegion *mr,
 
     proxy_proc_send(proxy_link, &msg);
 
-    if (!write) {
-        *val = wait_for_remote(wait);
+    if (msg.id) {
+        *val = proxy_link_completion_wait(proxy_link, &msg);
+    } else if (!write) {
+        *val = proxy_link_wait(proxy_link, wait);
         PUT_REMOTE_WAIT(wait);
     }
+
+    proxy_link_account(proxy_link, msg.cmd, start);
 }
 
 void proxy_default_bar_write(PCIProxyDev *dev, MemoryRegion *mr, hwaddr addr,
                              uint64_t val, unsigned size, bool memory)
 {
+    proxy_intx_eoi(dev);
+
+    if (dev->posted_writes && !atomic_read(&dev->posted_paused) &&
+        !dev->proxy_link->ring) {
+        proxy_posted_write(dev, mr->addr + addr, val, size, memory);
+        return;
+    }
+
     send_bar_access_msg(dev->proxy_link, mr, true, addr, &val, size, memory);
 }
 
@@ -455,7 +1211,30 @@ uint64_t proxy_default_bar_read(PCIProxyDev *dev, MemoryRegion *mr, hwaddr addr,
 {
     uint64_t val;
 
+    proxy_intx_eoi(dev);
+    proxy_posted_flush(dev);
+
     send_bar_access_msg(dev->proxy_link, mr, false, addr, &val, size, memory);
 
     return val;
 }
+
+/*
+ * Registers a BAR offset that the remote process may be notified of with
+ * an ioeventfd instead of a BAR_WRITE message. Meant to be called from the
+ * realize function of proxy devices; takes effect once the remote device
+ * is ready, if the "ioeventfd" property is set and KVM supports it.
+ */
+void proxy_add_ioeventfd(PCIProxyDev *dev, int bar, hwaddr offset,
+                         unsigned size, bool match_data, uint64_t data)
+{
+    ProxyIOEventFD *ioeventfd = g_new0(ProxyIOEventFD, 1);
+
+    ioeventfd->bar = bar;
+    ioeventfd->offset = offset;
+    ioeventfd->size = size;
+    ioeventfd->match_data = match_data;
+    ioeventfd->data = data;
+
+    QLIST_INSERT_HEAD(&dev->ioeventfds, ioeventfd, next);
+}
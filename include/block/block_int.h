@@ -56,9 +56,19 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
+/*
+ * Tracked requests are indexed by the chunks of the image that they touch, so
+ * that overlap checks only look at requests near the one being checked.
+ * Chunk i is indexed in shard i % BDRV_TRACKED_SHARDS; a request spanning
+ * BDRV_TRACKED_SHARDS chunks or more is linked into every shard.
+ */
+#define BDRV_TRACKED_SHARDS         16
+#define BDRV_TRACKED_CHUNK_BITS     16
+
 enum BdrvTrackedRequestType {
     BDRV_TRACKED_READ,
     BDRV_TRACKED_WRITE,
@@ -76,13 +86,22 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_offset;
     uint64_t overlap_bytes;
 
-    QLIST_ENTRY(BdrvTrackedRequest) list;
+    /* Bitmask of the shards that the request is linked into */
+    uint32_t shards;
+    QLIST_ENTRY(BdrvTrackedRequest) list[BDRV_TRACKED_SHARDS];
     Coroutine *co; /* owner, used for deadlock detection */
-    CoQueue wait_queue; /* coroutines blocked on this request */
 
+    /* Protected by BlockDriverState.reqs_lock */
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
 
+typedef struct BdrvTrackedShard {
+    CoMutex lock;
+    QLIST_HEAD(, BdrvTrackedRequest) requests;
+    /* Coroutines waiting for a request in this shard to complete */
+    CoQueue wait_queue;
+} BdrvTrackedShard;
+
 struct BlockDriver {
     const char *format_name;
     int instance_size;
@@ -118,6 +137,16 @@ struct BlockDriver {
     /* Set if a driver can support backing files */
     bool supports_backing;
 
+    /*
+     * Set if the driver can take requests from several AioContexts at the
+     * same time, so that a multi-queue device can submit to the node from
+     * each of its IOThreads.  Such drivers run a request in the AioContext
+     * of the thread that submitted it, and .bdrv_io_plug/.bdrv_io_unplug
+     * are called for every plug and unplug rather than only for the
+     * outermost ones, so they must keep a nesting count per AioContext.
+     */
+    bool supports_multiqueue;
+
     /* For handling image reopen for split or non-split files */
     int (*bdrv_reopen_prepare)(BDRVReopenState *reopen_state,
                                BlockReopenQueue *queue, Error **errp);
@@ -860,9 +889,11 @@ struct BlockDriverState {
 
     unsigned int write_gen;               /* Current data generation */
 
+    /* In-flight requests, see BDRV_TRACKED_SHARDS */
+    BdrvTrackedShard tracked_requests[BDRV_TRACKED_SHARDS];
+
     /* Protected by reqs_lock.  */
     CoMutex reqs_lock;
-    QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
     CoQueue flush_queue;                  /* Serializing flush queue */
     bool active_flush_req;                /* Flush request in flight? */
 
@@ -1211,6 +1242,7 @@ void bdrv_restore_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *backup);
 
 void bdrv_inc_in_flight(BlockDriverState *bs);
 void bdrv_dec_in_flight(BlockDriverState *bs);
+bool bdrv_has_tracked_requests(BlockDriverState *bs);
 
 void blockdev_close_all_bdrv_states(void);
 
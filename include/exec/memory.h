@@ -414,6 +414,8 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /* Like log_sync, but for listeners that can only sync all regions */
+    void (*log_sync_global)(MemoryListener *listener);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -1710,15 +1712,26 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter);
  */
 void memory_listener_unregister(MemoryListener *listener);
 
+/* Users of the global dirty log */
+#define GLOBAL_DIRTY_MIGRATION  (1U << 0)
+#define GLOBAL_DIRTY_DIRTY_RATE (1U << 1)
+#define GLOBAL_DIRTY_MASK       (0x3)
+
 /**
  * memory_global_dirty_log_start: begin dirty logging for all regions
+ *
+ * Logging stays on until every user that started it has stopped it.
+ *
+ * @flags: the GLOBAL_DIRTY_* users that need the log
  */
-void memory_global_dirty_log_start(void);
+void memory_global_dirty_log_start(unsigned int flags);
 
 /**
  * memory_global_dirty_log_stop: end dirty logging for all regions
+ *
+ * @flags: the GLOBAL_DIRTY_* users that no longer need the log
  */
-void memory_global_dirty_log_stop(void);
+void memory_global_dirty_log_stop(unsigned int flags);
 
 void mtree_info(fprintf_function mon_printf, void *f, bool flatview,
                 bool dispatch_tree, bool owner);
@@ -50,6 +50,10 @@ struct RAMBlock {
     unsigned long *unsentmap;
     /* bitmap of already received pages in postcopy */
     unsigned long *receivedmap;
+    /* bitmap of pages that were dirtied again since the bulk stage */
+    unsigned long *xbzrle_hotmap;
+    /* XBZRLE encoding statistics, one entry per region of the block */
+    struct XBZRLERegion *xbzrle_regions;
 };
 
 static inline bool offset_in_ramblock(RAMBlock *b, ram_addr_t offset)
@@ -42,6 +42,9 @@ typedef struct RemoteMemSync {
     int n_mr_sections;
     MemoryRegionSection *mr_sections;
 
+    int n_sent_sections;
+    MemoryRegionSection *sent_sections;
+
     ProxyLinkState *proxy_link;
 } RemoteMemSync;
 
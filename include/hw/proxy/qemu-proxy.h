@@ -42,6 +42,26 @@
 #define PCI_PROXY_DEV_GET_CLASS(obj) \
             OBJECT_GET_CLASS(PCIProxyDevClass, (obj), TYPE_PCI_PROXY_DEV)
 
+#define PROXY_POSTED_WRITES_MAX 64
+
+typedef struct ProxyIOEventFD {
+    EventNotifier notifier;
+    bool active;
+    int bar;
+    hwaddr offset;
+    unsigned size;
+    bool match_data;
+    uint64_t data;
+    QLIST_ENTRY(ProxyIOEventFD) next;
+} ProxyIOEventFD;
+
+/* Options sent with DEV_OPTS or DRIVE_OPTS, replayed on restart */
+typedef struct ProxyRemoteOpts {
+    unsigned int cmd;
+    char *json;
+    QSIMPLEQ_ENTRY(ProxyRemoteOpts) next;
+} ProxyRemoteOpts;
+
 typedef struct PCIProxyDev {
     PCIDevice parent_dev;
 
@@ -55,10 +75,34 @@ typedef struct PCIProxyDev {
 
     EventNotifier intr;
     EventNotifier resample;
+    bool intx_pending;
 
     pid_t remote_pid;
     char *rid;
 
+    bool shm_ring;
+    uint64_t ring_poll_ns;
+
+    bool posted_writes;
+    uint32_t posted_delay_us;
+    bar_access_msg_t posted[PROXY_POSTED_WRITES_MAX];
+    int n_posted;
+    QemuMutex posted_lock;
+    QEMUTimer *posted_timer;
+    bool posted_paused;
+
+    bool ioeventfd;
+    QLIST_HEAD(, ProxyIOEventFD) ioeventfds;
+
+    bool completion;
+
+    bool auto_restart;
+    uint32_t checkpoint_ms;
+    QEMUTimer *checkpoint_timer;
+    GByteArray *checkpoint;
+    QSIMPLEQ_HEAD(, ProxyRemoteOpts) remote_opts;
+    GSList *dead_links;
+
     QLIST_ENTRY(PCIProxyDev) next;
 
     void (*set_remote_opts) (PCIDevice *dev, QDict *qdict, unsigned int cmd);
@@ -87,4 +131,7 @@ void proxy_default_bar_write(PCIProxyDev *dev, MemoryRegion *mr, hwaddr addr,
 uint64_t proxy_default_bar_read(PCIProxyDev *dev, MemoryRegion *mr, hwaddr addr,
                                 unsigned size, bool memory);
 
+void proxy_add_ioeventfd(PCIProxyDev *dev, int bar, hwaddr offset,
+                         unsigned size, bool match_data, uint64_t data);
+
 #endif /* QEMU_PROXY_H */
@@ -34,6 +34,8 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    uint32_t num_iothreads;
+    char **iothreads;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -49,6 +51,7 @@ typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
     void *rq;
+    QemuMutex rq_lock;
     QEMUBH *bh;
     VirtIOBlkConf conf;
     unsigned short sector_mask;
@@ -37,6 +37,8 @@
 #include "qemu/thread.h"
 #include "exec/cpu-common.h"
 #include "exec/hwaddr.h"
+#include "block/aio.h"
+#include "qemu/stats64.h"
 
 typedef struct ProxyLinkState ProxyLinkState;
 
@@ -55,7 +57,7 @@ typedef struct ProxyLinkState ProxyLinkState;
  * Following commands are supported:
  * CONF_READ        PCI config. space read
  * CONF_WRITE       PCI config. space write
- * SYNC_SYSMEM      Shares QEMU's RAM with remote device's RAM
+ * SYNC_SYSMEM      Shares regions of QEMU's RAM with the remote device
  * BAR_WRITE        Writes to PCI BAR region
  * BAR_READ         Reads from PCI BAR region
  * SET_IRQFD        Sets the IRQFD to be used to raise interrupts directly
@@ -65,6 +67,16 @@ typedef struct ProxyLinkState ProxyLinkState;
  * DRIVE_ADD        HMP command to hotplug drive
  * DRIVE_DEL        HMP command to hot-unplug drive
  * BLOCK_RESIZE     QMP/HMP command to resize block backend
+ * RING_SETUP       Shares a ring in memory with the remote process, used
+ *                  to carry BAR and config. space accesses without syscalls
+ * BAR_WRITE_BATCH  Writes to PCI BAR regions, coalesced into one message
+ * SET_IOEVENTFD    Sets an eventfd signalled by KVM when the guest writes
+ *                  to a BAR offset, replayed as a BAR write by the remote
+ * SYSMEM_DEL       Stops sharing regions of RAM added with SYNC_SYSMEM
+ * DEVICE_SAVE      Writes the state of the remote devices to a pipe
+ * DEVICE_LOAD      Reads the state of the remote devices from a pipe
+ * COMPLETION_SETUP Shares completion slots with the remote process, used
+ *                  to answer reads without an eventfd for each of them
  *
  */
 typedef enum {
@@ -83,6 +95,14 @@ typedef enum {
     DRIVE_DEL,
     PROXY_PING,
     BLOCK_RESIZE,
+    RING_SETUP,
+    BAR_WRITE_BATCH,
+    SET_IOEVENTFD,
+    SYSMEM_DEL,
+    DEVICE_SAVE,
+    DEVICE_LOAD,
+    COMPLETION_SETUP,
+    DEL_IOEVENTFD,
     MAX,
 } proc_cmd_t;
 
@@ -93,6 +113,8 @@ typedef enum {
  * bytestream  Indicates if the data to be shared is structured (data1)
  *             or unstructured (data2)
  * size        Size of the data to be shared
+ * slot        Completion slot the reply is written to, if id is not 0
+ * id          Non-zero id of the command in its completion slot
  * data1       Structured data
  * fds         File descriptors to be shared with remote device
  * data2       Unstructured data
@@ -102,6 +124,7 @@ typedef struct {
     hwaddr gpas[REMOTE_MAX_FDS];
     uint64_t sizes[REMOTE_MAX_FDS];
     ram_addr_t offsets[REMOTE_MAX_FDS];
+    int nregions;
 } sync_sysmem_msg_t;
 
 typedef struct {
@@ -115,16 +138,33 @@ typedef struct {
     int intx;
 } set_irqfd_msg_t;
 
+typedef struct {
+    uint64_t size;
+    uint64_t poll_ns;
+} ring_setup_msg_t;
+
+typedef struct {
+    int bar;
+    hwaddr offset;
+    unsigned size;
+    bool match_data;
+    uint64_t data;
+} set_ioeventfd_msg_t;
+
 typedef struct {
     proc_cmd_t cmd;
     int bytestream;
     size_t size;
+    uint32_t slot;
+    uint64_t id;
 
     union {
         uint64_t u64;
         sync_sysmem_msg_t sync_sysmem;
         bar_access_msg_t bar_access;
         set_irqfd_msg_t set_irqfd;
+        ring_setup_msg_t ring_setup;
+        set_ioeventfd_msg_t set_ioeventfd;
     } data1;
 
     int fds[REMOTE_MAX_FDS];
@@ -139,6 +179,88 @@ struct conf_data_msg {
     int l;
 };
 
+/*
+ * ProxyRing Single-producer single-consumer ring shared between QEMU and
+ * the remote process
+ *
+ * QEMU produces descriptors at prod, the remote process consumes them at
+ * cons. The result of a read is published in resp_val, and resp_seq is
+ * then set to the seq of the descriptor it answers. The *_waiting flags
+ * tell the other side that it must kick the eventfd after updating the
+ * ring, because the waiter gave up polling and went to sleep:
+ * prod_waiting for a reply, space_waiting for a free slot in a full ring.
+ *
+ */
+#define PROXY_RING_ENTRIES 256
+
+typedef struct {
+    uint32_t cmd;
+    uint32_t size;
+    uint64_t addr;
+    uint64_t val;
+    uint64_t seq;
+    uint32_t memory;
+    uint32_t pad;
+} ProxyRingDesc;
+
+typedef struct {
+    uint32_t prod;
+    uint32_t prod_waiting;
+    uint32_t space_waiting;
+    uint8_t pad0[52];
+
+    uint32_t cons;
+    uint32_t cons_waiting;
+    uint64_t resp_seq;
+    uint64_t resp_val;
+    uint8_t pad1[40];
+
+    ProxyRingDesc desc[PROXY_RING_ENTRIES];
+} ProxyRing;
+
+typedef uint64_t (*proxy_ring_handler)(ProxyRingDesc *desc);
+
+/*
+ * ProxyCompletion Slot shared between QEMU and the remote process, through
+ * which the remote process answers a command that has a non-zero id.
+ *
+ * Each vCPU thread of QEMU uses its own slot, and slot 0 is used outside
+ * of vCPU threads, so that a slot normally has a single waiter. The remote
+ * process writes the reply to val and then the low 32 bits of the id to
+ * seq. seq doubles as a futex, which is woken only if QEMU set waiting.
+ *
+ */
+#define PROXY_COMPLETION_SLOTS 64
+
+typedef struct {
+    uint32_t seq;
+    uint32_t waiting;
+    uint64_t val;
+    uint8_t pad[48];
+} ProxyCompletion;
+
+/*
+ * ProxyLinkStats Latency of the commands sent over the link, as seen by
+ * QEMU. For commands that expect a reply, this covers the round trip
+ * until the reply is received; for the others, the time it took to queue
+ * them on the link.
+ *
+ * count      Number of commands sent
+ * total_ns   Sum of the latencies
+ * max_ns     Longest latency
+ * hist       hist[i] counts the latencies in [2^i, 2^(i+1)) ns, the last
+ *            bucket also counts everything above
+ *
+ */
+#define PROXY_LINK_HIST_BUCKETS 32
+
+typedef struct {
+    Stat64 count;
+    Stat64 total_ns;
+    Stat64 max_ns;
+    Stat64 hist[PROXY_LINK_HIST_BUCKETS];
+} ProxyLinkStats;
+
 typedef void (*proxy_link_callback)(GIOCondition cond);
 
 typedef struct ProxySrc {
@@ -146,6 +268,14 @@ typedef struct ProxySrc {
     GPollFD gpfd;
 } ProxySrc;
 
+typedef struct ProxyNotifierSrc {
+    GSource gsrc;
+    GPollFD gpfd;
+    EventNotifier *e;
+    EventNotifierHandler *handler;
+    GDestroyNotify destroy;
+} ProxyNotifierSrc;
+
 /*
  * ProxyLinkState Instance info. of the communication
  * link between QEMU and remote process
@@ -153,8 +283,24 @@ typedef struct ProxySrc {
  * ctx        GMainContext to be used for communication
  * loop       Main loop that would be used to poll for incoming data
  * src        Source fds to poll on, and which events to poll on
+ * aio_ctx    AioContext polling the link instead of ctx, if any
  * sock       Unix socket used for the link
+ * dead       Set once the remote process has closed the socket
  * lock       Lock to synchronize access to the link
+ * ring       Shared memory ring, NULL if only the socket is used
+ * ring_fd    memfd backing the ring
+ * ring_kick  eventfd kicked by QEMU when the remote is asleep
+ * ring_reply eventfd kicked by the remote when QEMU is asleep
+ * ring_space eventfd kicked by the remote when it frees a slot of the ring
+ * ring_poll_ns  Time to busy-poll the ring before blocking
+ * ring_seq   Sequence number of the last descriptor produced
+ * ring_lock  Serializes producers of the ring
+ * ring_space_lock  Serializes producers waiting on ring_space
+ * comp       Completion slots, NULL if replies come on eventfds
+ * comp_fd    memfd backing the completion slots
+ * comp_ids   Id of the last command sent on each slot
+ * comp_lock  Serializes the users of each slot
+ * stats      Latency statistics, indexed by proc_cmd_t
  *
  */
 struct ProxyLinkState {
@@ -163,10 +309,33 @@ struct ProxyLinkState {
     GMainContext *ctx;
     GMainLoop *loop;
     ProxySrc *src;
+    AioContext *aio_ctx;
 
     int sock;
+    bool dead;
     QemuMutex lock;
 
+    ProxyRing *ring;
+    int ring_fd;
+    int ring_kick;
+    int ring_reply;
+    int ring_space;
+    uint64_t ring_poll_ns;
+    uint64_t ring_seq;
+    QemuMutex ring_lock;
+    QemuMutex ring_space_lock;
+    QemuThread ring_thread;
+    bool ring_thread_running;
+    bool ring_stop;
+    proxy_ring_handler ring_handler;
+
+    ProxyCompletion *comp;
+    int comp_fd;
+    uint64_t comp_ids[PROXY_COMPLETION_SLOTS];
+    QemuMutex comp_lock[PROXY_COMPLETION_SLOTS];
+
+    ProxyLinkStats stats[MAX];
+
     proxy_link_callback callback;
 };
 
@@ -180,10 +349,38 @@ void proxy_link_finalize(ProxyLinkState *s);
 void proxy_proc_send(ProxyLinkState *s, ProcMsg *msg);
 int proxy_proc_recv(ProxyLinkState *s, ProcMsg *msg);
 uint64_t wait_for_remote(int efd);
+uint64_t proxy_link_wait(ProxyLinkState *s, int efd);
+bool proxy_link_is_dead(ProxyLinkState *s);
 void notify_proxy(int fd, uint64_t val);
 
 void proxy_link_set_sock(ProxyLinkState *s, int fd);
 void proxy_link_set_callback(ProxyLinkState *s, proxy_link_callback callback);
 void start_handler(ProxyLinkState *s);
+void proxy_link_set_aio_context(ProxyLinkState *s, AioContext *ctx);
+GSource *proxy_link_add_notifier(ProxyLinkState *s, EventNotifier *e,
+                                 EventNotifierHandler *handler);
+void proxy_link_del_notifier(ProxyLinkState *s, EventNotifier *e,
+                             GSource *src, GDestroyNotify destroy);
+void proxy_link_dispatch_pending(ProxyLinkState *s);
+
+int proxy_link_ring_create(ProxyLinkState *s, uint64_t poll_ns, ProcMsg *msg,
+                           Error **errp);
+int proxy_link_ring_attach(ProxyLinkState *s, ProcMsg *msg, Error **errp);
+uint64_t proxy_ring_submit(ProxyLinkState *s, proc_cmd_t cmd, hwaddr addr,
+                           uint64_t val, unsigned size, bool memory);
+void proxy_ring_drain(ProxyLinkState *s);
+void proxy_link_ring_start(ProxyLinkState *s, proxy_ring_handler handler);
+
+int proxy_link_completion_create(ProxyLinkState *s, ProcMsg *msg,
+                                 Error **errp);
+int proxy_link_completion_attach(ProxyLinkState *s, ProcMsg *msg,
+                                 Error **errp);
+void proxy_link_completion_begin(ProxyLinkState *s, ProcMsg *msg,
+                                 uint32_t slot);
+uint64_t proxy_link_completion_wait(ProxyLinkState *s, ProcMsg *msg);
+void proxy_link_reply(ProxyLinkState *s, ProcMsg *msg, uint64_t val);
+
+const char *proxy_cmd_name(proc_cmd_t cmd);
+void proxy_link_account(ProxyLinkState *s, proc_cmd_t cmd, int64_t start_ns);
 
 #endif
@@ -181,6 +181,13 @@ struct VMStateDescription {
     int minimum_version_id;
     int minimum_version_id_old;
     MigrationPriority priority;
+    /*
+     * With x-parallel-device-state, this section may be saved and loaded
+     * on a worker thread, without the BQL, concurrently with other
+     * sections of the same priority.  Only set it if the callbacks touch
+     * nothing but the device's own state.
+     */
+    bool parallel;
     LoadStateHandler *load_state_old;
     int (*pre_load)(void *opaque);
     int (*post_load)(void *opaque, int version_id);
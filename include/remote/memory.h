@@ -29,6 +29,7 @@
 #include "exec/hwaddr.h"
 #include "io/proxy-link.h"
 
-void remote_sysmem_reconfig(ProcMsg *msg, Error **errp);
+void remote_sysmem_add(ProcMsg *msg, Error **errp);
+void remote_sysmem_del(ProcMsg *msg, Error **errp);
 
 #endif
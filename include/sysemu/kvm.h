@@ -215,6 +215,23 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/**
+ * kvm_dirty_ring_enabled:
+ *
+ * Returns: true if KVM reports dirty pages through per-vCPU rings, in
+ * which case CPUState.dirty_pages counts the pages each vCPU wrote while
+ * dirty logging was on.
+ */
+bool kvm_dirty_ring_enabled(void);
+
+/**
+ * kvm_dirty_ring_flush_all:
+ *
+ * Harvest the pages written so far by all vCPUs.  Must be called with the
+ * BQL held.
+ */
+void kvm_dirty_ring_flush_all(void);
+
 int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
 int kvm_destroy_vcpu(CPUState *cpu);
@@ -32,16 +32,41 @@
 #include <sys/un.h>
 #include <unistd.h>
 #include <limits.h>
+#include <sys/mman.h>
+#include <poll.h>
 
 #include "qemu/module.h"
 #include "io/proxy-link.h"
 #include "qemu/log.h"
+#include "qemu/atomic.h"
+#include "qemu/memfd.h"
+#include "qemu/processor.h"
+#include "qemu/futex.h"
+#include "qemu/timer.h"
+#include "qemu/host-utils.h"
+#include "qapi/error.h"
+#include "trace.h"
 
 static void proxy_link_inst_init(Object *obj)
 {
     ProxyLinkState *s = PROXY_LINK(obj);
+    int i;
 
     qemu_mutex_init(&s->lock);
+    qemu_mutex_init(&s->ring_lock);
+    qemu_mutex_init(&s->ring_space_lock);
+    for (i = 0; i < PROXY_COMPLETION_SLOTS; i++) {
+        qemu_mutex_init(&s->comp_lock[i]);
+    }
+
+    s->ring = NULL;
+    s->ring_fd = -1;
+    s->ring_kick = -1;
+    s->ring_reply = -1;
+    s->ring_space = -1;
+
+    s->comp = NULL;
+    s->comp_fd = -1;
 
     s->sock = STDIN_FILENO;
     s->ctx = g_main_context_new();
@@ -67,15 +92,74 @@ ProxyLinkState *proxy_link_create(void)
     return PROXY_LINK(object_new(TYPE_PROXY_LINK));
 }
 
+static size_t proxy_completion_size(void)
+{
+    return ROUND_UP(PROXY_COMPLETION_SLOTS * sizeof(ProxyCompletion),
+                    qemu_real_host_page_size);
+}
+
+static void proxy_ring_kick(int efd)
+{
+    uint64_t val = 1;
+
+    if (write(efd, &val, sizeof(val)) == -1) {
+        qemu_log_mask(LOG_REMOTE_DEBUG, "Error proxy_ring_kick: %s\n",
+                      strerror(errno));
+    }
+}
+
 void proxy_link_finalize(ProxyLinkState *s)
 {
-    g_source_unref(&s->src->gsrc);
+    int i;
+
+    if (s->aio_ctx) {
+        aio_set_fd_handler(s->aio_ctx, s->sock, false, NULL, NULL, NULL, NULL);
+        s->aio_ctx = NULL;
+    }
+
+    /*
+     * Only the remote side runs start_handler(), so links owned by QEMU
+     * (including dead ones left behind by a restart) have no source.
+     */
+    if (s->src) {
+        g_source_unref(&s->src->gsrc);
+        s->src = NULL;
+    }
+    g_main_loop_quit(s->loop);
     g_main_loop_unref(s->loop);
     g_main_context_unref(s->ctx);
-    g_main_loop_quit(s->loop);
 
     close(s->sock);
 
+    if (s->ring_thread_running) {
+        atomic_set(&s->ring_stop, true);
+        /* Pairs with the barrier before the consumer goes to sleep */
+        smp_mb();
+        proxy_ring_kick(s->ring_kick);
+        qemu_thread_join(&s->ring_thread);
+        s->ring_thread_running = false;
+    }
+
+    if (s->ring) {
+        munmap(s->ring, ROUND_UP(sizeof(ProxyRing), qemu_real_host_page_size));
+        close(s->ring_fd);
+        close(s->ring_kick);
+        close(s->ring_reply);
+        close(s->ring_space);
+        s->ring = NULL;
+    }
+
+    if (s->comp) {
+        munmap(s->comp, proxy_completion_size());
+        close(s->comp_fd);
+        s->comp = NULL;
+    }
+
+    for (i = 0; i < PROXY_COMPLETION_SLOTS; i++) {
+        qemu_mutex_destroy(&s->comp_lock[i]);
+    }
+    qemu_mutex_destroy(&s->ring_space_lock);
+    qemu_mutex_destroy(&s->ring_lock);
     qemu_mutex_destroy(&s->lock);
 
     object_unref(OBJECT(s));
@@ -119,6 +203,8 @@ void proxy_proc_send(ProxyLinkState *s, ProcMsg *msg)
         hdr.msg_controllen = chdr->cmsg_len;
     }
 
+    trace_proxy_proc_send(s, msg->cmd, msg->size, msg->num_fds);
+
     qemu_mutex_lock(&s->lock);
 
     do {
@@ -174,11 +260,11 @@ int proxy_proc_recv(ProxyLinkState *s, ProcMsg *msg)
         rc = recvmsg(s->sock, &hdr, 0);
     } while (rc < 0 && (errno == EINTR || errno == EAGAIN));
 
-    if (rc < 0) {
+    if (rc <= 0) {
         qemu_log_mask(LOG_REMOTE_DEBUG, "%s - recvmsg rc is %d, errno is %d,"
                       " sock %d\n", __func__, rc, errno, s->sock);
         qemu_mutex_unlock(&s->lock);
-        return rc;
+        return rc ? rc : -ECONNRESET;
     }
 
     msg->num_fds = 0;
@@ -208,9 +294,74 @@ int proxy_proc_recv(ProxyLinkState *s, ProcMsg *msg)
 
     qemu_mutex_unlock(&s->lock);
 
+    trace_proxy_proc_recv(s, msg->cmd, msg->size, msg->num_fds);
+
     return rc;
 }
 
+/*
+ * Returns true once the remote process has closed its end of the link,
+ * which happens when it exits or crashes.
+ */
+bool proxy_link_is_dead(ProxyLinkState *s)
+{
+    struct pollfd pfd = { .fd = s->sock, .events = 0 };
+
+    if (!atomic_read(&s->dead) && poll(&pfd, 1, 0) == 1 &&
+        (pfd.revents & (POLLHUP | POLLERR))) {
+        atomic_set(&s->dead, true);
+    }
+
+    return atomic_read(&s->dead);
+}
+
+/*
+ * Waits for efd to become readable. Returns false instead if the remote
+ * process closes its end of the link first.
+ */
+static bool proxy_link_poll(ProxyLinkState *s, int efd)
+{
+    struct pollfd pfd[2] = {
+        { .fd = efd, .events = POLLIN },
+        { .fd = s->sock, .events = 0 },
+    };
+
+    while (!atomic_read(&s->dead)) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_log_mask(LOG_REMOTE_DEBUG, "Error proxy_link_poll: %s\n",
+                          strerror(errno));
+            atomic_set(&s->dead, true);
+            break;
+        }
+
+        if (pfd[0].revents & POLLIN) {
+            return true;
+        }
+
+        if (pfd[1].revents & (POLLHUP | POLLERR)) {
+            atomic_set(&s->dead, true);
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Like wait_for_remote(), but returns ULLONG_MAX if the remote process
+ * dies before it answers, instead of blocking forever.
+ */
+uint64_t proxy_link_wait(ProxyLinkState *s, int efd)
+{
+    if (!proxy_link_poll(s, efd)) {
+        return ULLONG_MAX;
+    }
+
+    return wait_for_remote(efd);
+}
+
 uint64_t wait_for_remote(int efd)
 {
     uint64_t val;
@@ -299,3 +450,643 @@ void start_handler(ProxyLinkState *s)
 
     g_main_loop_run(s->loop);
 }
+
+static void proxy_link_aio_read(void *opaque)
+{
+    ProxyLinkState *s = opaque;
+
+    s->callback(G_IO_IN);
+}
+
+/*
+ * Moves the handling of incoming messages to ctx, so that they are
+ * processed by the thread running that AioContext instead of the one in
+ * start_handler(). start_handler() keeps waiting until the link is
+ * finalized. A closed socket shows up as an error from proxy_proc_recv().
+ */
+void proxy_link_set_aio_context(ProxyLinkState *s, AioContext *ctx)
+{
+    if (s->src) {
+        g_source_destroy(&s->src->gsrc);
+    }
+
+    s->aio_ctx = ctx;
+    aio_set_fd_handler(ctx, s->sock, false, proxy_link_aio_read, NULL, NULL,
+                       s);
+}
+
+static gboolean proxy_notifier_prepare(GSource *gsrc, gint *timeout)
+{
+    *timeout = -1;
+
+    return FALSE;
+}
+
+static gboolean proxy_notifier_check(GSource *gsrc)
+{
+    ProxyNotifierSrc *src = (ProxyNotifierSrc *)gsrc;
+
+    return src->gpfd.revents & G_IO_IN;
+}
+
+static gboolean proxy_notifier_dispatch(GSource *gsrc, GSourceFunc func,
+                                        gpointer data)
+{
+    ProxyNotifierSrc *src = (ProxyNotifierSrc *)gsrc;
+
+    src->handler(src->e);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void proxy_notifier_finalize(GSource *gsrc)
+{
+    ProxyNotifierSrc *src = (ProxyNotifierSrc *)gsrc;
+
+    if (src->destroy) {
+        src->destroy(src->e);
+    }
+}
+
+static GSourceFuncs proxy_notifier_funcs = {
+    .prepare = proxy_notifier_prepare,
+    .check = proxy_notifier_check,
+    .dispatch = proxy_notifier_dispatch,
+    .finalize = proxy_notifier_finalize,
+};
+
+/*
+ * Polls e from the thread that handles the messages of the link: the
+ * AioContext given to proxy_link_set_aio_context(), or start_handler()
+ * otherwise. handler can thus call proxy_link_dispatch_pending(). The
+ * return value is to be passed to proxy_link_del_notifier().
+ */
+GSource *proxy_link_add_notifier(ProxyLinkState *s, EventNotifier *e,
+                                 EventNotifierHandler *handler)
+{
+    ProxyNotifierSrc *src;
+
+    if (s->aio_ctx) {
+        aio_set_event_notifier(s->aio_ctx, e, false, handler, NULL);
+        return NULL;
+    }
+
+    src = (ProxyNotifierSrc *)g_source_new(&proxy_notifier_funcs,
+                                           sizeof(ProxyNotifierSrc));
+    src->e = e;
+    src->handler = handler;
+    src->gpfd.fd = event_notifier_get_fd(e);
+    src->gpfd.events = G_IO_IN;
+    g_source_add_poll(&src->gsrc, &src->gpfd);
+    g_source_attach(&src->gsrc, s->ctx);
+
+    return &src->gsrc;
+}
+
+/*
+ * Stops polling e. Must be called from the thread that polls it, maybe
+ * from the handler itself, so destroy(e) is deferred until the handler
+ * has returned.
+ */
+void proxy_link_del_notifier(ProxyLinkState *s, EventNotifier *e,
+                             GSource *src, GDestroyNotify destroy)
+{
+    if (!src) {
+        aio_set_event_notifier(s->aio_ctx, e, false, NULL, NULL);
+        aio_bh_schedule_oneshot(s->aio_ctx, destroy, e);
+        return;
+    }
+
+    ((ProxyNotifierSrc *)src)->destroy = destroy;
+    g_source_destroy(src);
+    g_source_unref(src);
+}
+
+/*
+ * Handles the messages that are already on the socket. Called from the
+ * thread that handles the messages of the link, it lets an event from
+ * QEMU take effect only after what QEMU sent on the link before it.
+ */
+void proxy_link_dispatch_pending(ProxyLinkState *s)
+{
+    struct pollfd pfd = { .fd = s->sock, .events = POLLIN };
+
+    while (poll(&pfd, 1, 0) == 1 && pfd.revents == POLLIN) {
+        s->callback(G_IO_IN);
+    }
+}
+
+static void proxy_ring_sleep(int efd)
+{
+    uint64_t val;
+
+    if (read(efd, &val, sizeof(val)) == -1 && errno != EINTR) {
+        qemu_log_mask(LOG_REMOTE_DEBUG, "Error proxy_ring_sleep: %s\n",
+                      strerror(errno));
+    }
+}
+
+/*
+ * Creates the ring on the QEMU side of the link and fills msg with the
+ * RING_SETUP command that hands it over to the remote process. The ring
+ * is usable as soon as this returns: anything produced before the remote
+ * attaches is consumed once its ring thread starts.
+ */
+int proxy_link_ring_create(ProxyLinkState *s, uint64_t poll_ns, ProcMsg *msg,
+                           Error **errp)
+{
+    size_t size = ROUND_UP(sizeof(ProxyRing), qemu_real_host_page_size);
+    int fd;
+
+    s->ring = qemu_memfd_alloc("proxy-ring", size,
+                               F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                               &fd, errp);
+    if (!s->ring) {
+        return -1;
+    }
+
+    s->ring_kick = eventfd(0, 0);
+    s->ring_reply = eventfd(0, 0);
+    s->ring_space = eventfd(0, 0);
+    if (s->ring_kick < 0 || s->ring_reply < 0 || s->ring_space < 0) {
+        error_setg_errno(errp, errno, "Failed to create ring eventfds");
+        if (s->ring_kick >= 0) {
+            close(s->ring_kick);
+        }
+        if (s->ring_reply >= 0) {
+            close(s->ring_reply);
+        }
+        if (s->ring_space >= 0) {
+            close(s->ring_space);
+        }
+        s->ring_kick = s->ring_reply = s->ring_space = -1;
+        qemu_memfd_free(s->ring, size, fd);
+        s->ring = NULL;
+        return -1;
+    }
+
+    s->ring_fd = fd;
+    s->ring_poll_ns = poll_ns;
+    s->ring_seq = 0;
+
+    memset(msg, 0, sizeof(ProcMsg));
+    msg->cmd = RING_SETUP;
+    msg->bytestream = 0;
+    msg->size = sizeof(msg->data1);
+    msg->data1.ring_setup.size = size;
+    msg->data1.ring_setup.poll_ns = poll_ns;
+    msg->num_fds = 4;
+    msg->fds[0] = s->ring_fd;
+    msg->fds[1] = s->ring_kick;
+    msg->fds[2] = s->ring_reply;
+    msg->fds[3] = s->ring_space;
+
+    return 0;
+}
+
+/* Maps the ring received with RING_SETUP in the remote process */
+int proxy_link_ring_attach(ProxyLinkState *s, ProcMsg *msg, Error **errp)
+{
+    ring_setup_msg_t *setup = &msg->data1.ring_setup;
+    void *ring;
+
+    if (msg->num_fds != 4 || setup->size < sizeof(ProxyRing)) {
+        error_setg(errp, "Invalid RING_SETUP message");
+        return -1;
+    }
+
+    ring = mmap(NULL, setup->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                msg->fds[0], 0);
+    if (ring == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Failed to map proxy ring");
+        return -1;
+    }
+
+    s->ring = ring;
+    s->ring_fd = msg->fds[0];
+    s->ring_kick = msg->fds[1];
+    s->ring_reply = msg->fds[2];
+    s->ring_space = msg->fds[3];
+    s->ring_poll_ns = setup->poll_ns;
+
+    return 0;
+}
+
+/*
+ * Sleeps until the remote process frees a slot of the full ring. Called
+ * without ring_lock, so that the other producers are not held up behind a
+ * stalled consumer; they wait on ring_space_lock instead, as only one
+ * thread at a time may sleep on the ring_space eventfd. Returns false if
+ * the remote process dies.
+ */
+static bool proxy_ring_wait_space(ProxyLinkState *s)
+{
+    ProxyRing *ring = s->ring;
+    bool ok = true;
+
+    qemu_mutex_lock(&s->ring_space_lock);
+
+    atomic_set(&ring->space_waiting, 1);
+    /* Pairs with the barrier after the consumer advances cons */
+    smp_mb();
+    if (atomic_read(&ring->prod) - atomic_load_acquire(&ring->cons) ==
+        PROXY_RING_ENTRIES) {
+        ok = proxy_link_poll(s, s->ring_space);
+        if (ok) {
+            proxy_ring_sleep(s->ring_space);
+        }
+    }
+    atomic_set(&ring->space_waiting, 0);
+
+    qemu_mutex_unlock(&s->ring_space_lock);
+
+    return ok;
+}
+
+/*
+ * Queues an access on the ring. Writes return as soon as the descriptor is
+ * visible to the remote process; reads busy-poll for the reply for up to
+ * ring_poll_ns and then sleep on the reply eventfd. If the ring is full,
+ * the producer busy-polls for a free slot for up to ring_poll_ns as well,
+ * and then sleeps until the remote process frees one.
+ */
+uint64_t proxy_ring_submit(ProxyLinkState *s, proc_cmd_t cmd, hwaddr addr,
+                           uint64_t val, unsigned size, bool memory)
+{
+    ProxyRing *ring = s->ring;
+    ProxyRingDesc *desc;
+    bool reply = (cmd == BAR_READ || cmd == CONF_READ);
+    uint32_t prod;
+    uint64_t seq;
+    int64_t start;
+
+    qemu_mutex_lock(&s->ring_lock);
+
+    start = get_clock();
+    while ((prod = ring->prod) - atomic_load_acquire(&ring->cons) ==
+           PROXY_RING_ENTRIES) {
+        if (proxy_link_is_dead(s)) {
+            qemu_mutex_unlock(&s->ring_lock);
+            return ULLONG_MAX;
+        }
+        if (atomic_read(&ring->cons_waiting)) {
+            proxy_ring_kick(s->ring_kick);
+        }
+        if (get_clock() - start < s->ring_poll_ns) {
+            cpu_relax();
+            continue;
+        }
+
+        qemu_mutex_unlock(&s->ring_lock);
+        if (!proxy_ring_wait_space(s)) {
+            return ULLONG_MAX;
+        }
+        qemu_mutex_lock(&s->ring_lock);
+        start = get_clock();
+    }
+
+    seq = ++s->ring_seq;
+
+    desc = &ring->desc[prod % PROXY_RING_ENTRIES];
+    desc->cmd = cmd;
+    desc->size = size;
+    desc->addr = addr;
+    desc->val = val;
+    desc->seq = seq;
+    desc->memory = memory;
+
+    atomic_store_release(&ring->prod, prod + 1);
+
+    trace_proxy_ring_submit(s, cmd, seq, addr, size);
+
+    smp_mb();
+    if (atomic_read(&ring->cons_waiting)) {
+        proxy_ring_kick(s->ring_kick);
+    }
+
+    if (!reply) {
+        qemu_mutex_unlock(&s->ring_lock);
+        return 0;
+    }
+
+    start = get_clock();
+    while (atomic_load_acquire(&ring->resp_seq) != seq) {
+        if (get_clock() - start < s->ring_poll_ns) {
+            cpu_relax();
+            continue;
+        }
+
+        atomic_set(&ring->prod_waiting, 1);
+        smp_mb();
+        if (atomic_load_acquire(&ring->resp_seq) != seq) {
+            if (!proxy_link_poll(s, s->ring_reply)) {
+                atomic_set(&ring->prod_waiting, 0);
+                qemu_mutex_unlock(&s->ring_lock);
+                return ULLONG_MAX;
+            }
+            proxy_ring_sleep(s->ring_reply);
+        }
+        atomic_set(&ring->prod_waiting, 0);
+    }
+
+    val = atomic_read(&ring->resp_val);
+
+    qemu_mutex_unlock(&s->ring_lock);
+
+    trace_proxy_ring_reply(s, seq, val);
+
+    return val;
+}
+
+/*
+ * Waits until the ring thread of the remote process has handled every
+ * descriptor that was on the ring when this was called. Used on both ends
+ * of the link; returns early if the other end goes away.
+ */
+void proxy_ring_drain(ProxyLinkState *s)
+{
+    ProxyRing *ring = s->ring;
+    uint32_t prod = atomic_load_acquire(&ring->prod);
+
+    while ((int32_t)(atomic_load_acquire(&ring->cons) - prod) < 0) {
+        if (proxy_link_is_dead(s)) {
+            return;
+        }
+        if (atomic_read(&ring->cons_waiting)) {
+            proxy_ring_kick(s->ring_kick);
+        }
+        cpu_relax();
+    }
+}
+
+/*
+ * Runs the consumer side of the ring in the remote process, until
+ * proxy_link_finalize() stops it.
+ */
+static void *proxy_ring_consume(void *opaque)
+{
+    ProxyLinkState *s = opaque;
+    proxy_ring_handler handler = s->ring_handler;
+    ProxyRing *ring = s->ring;
+    ProxyRingDesc *desc;
+    uint32_t cons = ring->cons;
+    uint64_t val;
+    int64_t start;
+
+    while (!atomic_read(&s->ring_stop)) {
+        while (cons != atomic_load_acquire(&ring->prod)) {
+            desc = &ring->desc[cons % PROXY_RING_ENTRIES];
+
+            trace_proxy_ring_consume(s, desc->cmd, desc->seq, desc->addr,
+                                     desc->size);
+
+            val = handler(desc);
+
+            if (desc->cmd == BAR_READ || desc->cmd == CONF_READ) {
+                atomic_set(&ring->resp_val, val);
+                atomic_store_release(&ring->resp_seq, desc->seq);
+            }
+
+            atomic_store_release(&ring->cons, ++cons);
+
+            smp_mb();
+            if (atomic_read(&ring->prod_waiting)) {
+                proxy_ring_kick(s->ring_reply);
+            }
+            if (atomic_read(&ring->space_waiting)) {
+                proxy_ring_kick(s->ring_space);
+            }
+        }
+
+        start = get_clock();
+        while (cons == atomic_load_acquire(&ring->prod) &&
+               get_clock() - start < s->ring_poll_ns) {
+            cpu_relax();
+        }
+
+        if (cons != atomic_load_acquire(&ring->prod)) {
+            continue;
+        }
+
+        atomic_set(&ring->cons_waiting, 1);
+        smp_mb();
+        if (cons == atomic_load_acquire(&ring->prod) &&
+            !atomic_read(&s->ring_stop)) {
+            proxy_ring_sleep(s->ring_kick);
+        }
+        atomic_set(&ring->cons_waiting, 0);
+    }
+
+    return NULL;
+}
+
+/*
+ * Starts the thread that consumes the ring in the remote process. handler
+ * is called for every descriptor in order; its return value is the reply
+ * for BAR_READ and CONF_READ. The thread is joined by
+ * proxy_link_finalize() before the ring is unmapped.
+ */
+void proxy_link_ring_start(ProxyLinkState *s, proxy_ring_handler handler)
+{
+    s->ring_handler = handler;
+    s->ring_stop = false;
+    qemu_thread_create(&s->ring_thread, "remote-ring", proxy_ring_consume,
+                       s, QEMU_THREAD_JOINABLE);
+    s->ring_thread_running = true;
+}
+
+/*
+ * Creates the completion slots on the QEMU side of the link and fills msg
+ * with the COMPLETION_SETUP command that hands them over to the remote
+ * process. Commands sent after msg may use the slots.
+ */
+int proxy_link_completion_create(ProxyLinkState *s, ProcMsg *msg,
+                                 Error **errp)
+{
+    int fd;
+
+    s->comp = qemu_memfd_alloc("proxy-completion", proxy_completion_size(),
+                               F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                               &fd, errp);
+    if (!s->comp) {
+        return -1;
+    }
+
+    s->comp_fd = fd;
+    memset(s->comp_ids, 0, sizeof(s->comp_ids));
+
+    memset(msg, 0, sizeof(ProcMsg));
+    msg->cmd = COMPLETION_SETUP;
+    msg->bytestream = 0;
+    msg->size = 0;
+    msg->num_fds = 1;
+    msg->fds[0] = s->comp_fd;
+
+    return 0;
+}
+
+/* Maps the completion slots received with COMPLETION_SETUP */
+int proxy_link_completion_attach(ProxyLinkState *s, ProcMsg *msg,
+                                 Error **errp)
+{
+    void *comp;
+
+    if (msg->num_fds != 1) {
+        error_setg(errp, "Invalid COMPLETION_SETUP message");
+        return -1;
+    }
+
+    comp = mmap(NULL, proxy_completion_size(), PROT_READ | PROT_WRITE,
+                MAP_SHARED, msg->fds[0], 0);
+    if (comp == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Failed to map completion slots");
+        return -1;
+    }
+
+    s->comp = comp;
+    s->comp_fd = msg->fds[0];
+
+    return 0;
+}
+
+/*
+ * Makes msg answer on a completion slot. The slot is owned by the caller
+ * until proxy_link_completion_wait() returns, which must follow once msg
+ * has been sent.
+ */
+void proxy_link_completion_begin(ProxyLinkState *s, ProcMsg *msg,
+                                 uint32_t slot)
+{
+    slot %= PROXY_COMPLETION_SLOTS;
+
+    qemu_mutex_lock(&s->comp_lock[slot]);
+
+    msg->slot = slot;
+    msg->id = ++s->comp_ids[slot];
+}
+
+#define PROXY_LINK_DEAD_POLL_NS 100000000
+
+uint64_t proxy_link_completion_wait(ProxyLinkState *s, ProcMsg *msg)
+{
+    ProxyCompletion *comp = &s->comp[msg->slot];
+    struct timespec ts = { .tv_nsec = PROXY_LINK_DEAD_POLL_NS };
+    uint32_t seq = (uint32_t)msg->id;
+    uint32_t cur;
+    uint64_t val = ULLONG_MAX;
+
+    while ((cur = atomic_load_acquire(&comp->seq)) != seq) {
+        atomic_set(&comp->waiting, 1);
+        smp_mb();
+        if (atomic_read(&comp->seq) == cur) {
+            /* Time out now and then to notice that the remote has died */
+            qemu_futex(&comp->seq, FUTEX_WAIT, (int)cur, &ts, NULL, 0);
+        }
+        atomic_set(&comp->waiting, 0);
+
+        if (atomic_read(&comp->seq) == cur && proxy_link_is_dead(s)) {
+            goto out;
+        }
+    }
+
+    val = atomic_read(&comp->val);
+
+out:
+    qemu_mutex_unlock(&s->comp_lock[msg->slot]);
+
+    return val;
+}
+
+/*
+ * Answers msg in the remote process, on its completion slot if it has
+ * one, on the eventfd passed with it otherwise.
+ */
+void proxy_link_reply(ProxyLinkState *s, ProcMsg *msg, uint64_t val)
+{
+    ProxyCompletion *comp;
+
+    if (!msg->id) {
+        notify_proxy(msg->fds[0], val);
+        PUT_REMOTE_WAIT(msg->fds[0]);
+        return;
+    }
+
+    if (!s->comp || msg->slot >= PROXY_COMPLETION_SLOTS) {
+        qemu_log_mask(LOG_REMOTE_DEBUG, "%s: Invalid completion slot %u\n",
+                      __func__, msg->slot);
+        return;
+    }
+
+    comp = &s->comp[msg->slot];
+
+    atomic_set(&comp->val, val);
+    atomic_store_release(&comp->seq, (uint32_t)msg->id);
+
+    smp_mb();
+    if (atomic_read(&comp->waiting)) {
+        qemu_futex_wake(&comp->seq, INT_MAX);
+    }
+}
+
+static const char *proxy_cmd_names[MAX] = {
+    [INIT] = "init",
+    [CONF_READ] = "conf-read",
+    [CONF_WRITE] = "conf-write",
+    [SYNC_SYSMEM] = "sync-sysmem",
+    [BAR_WRITE] = "bar-write",
+    [BAR_READ] = "bar-read",
+    [SET_IRQFD] = "set-irqfd",
+    [DEV_OPTS] = "dev-opts",
+    [DRIVE_OPTS] = "drive-opts",
+    [DEVICE_ADD] = "device-add",
+    [DEVICE_DEL] = "device-del",
+    [DRIVE_ADD] = "drive-add",
+    [DRIVE_DEL] = "drive-del",
+    [PROXY_PING] = "proxy-ping",
+    [BLOCK_RESIZE] = "block-resize",
+    [RING_SETUP] = "ring-setup",
+    [BAR_WRITE_BATCH] = "bar-write-batch",
+    [SET_IOEVENTFD] = "set-ioeventfd",
+    [SYSMEM_DEL] = "sysmem-del",
+    [DEVICE_SAVE] = "device-save",
+    [DEVICE_LOAD] = "device-load",
+    [COMPLETION_SETUP] = "completion-setup",
+    [DEL_IOEVENTFD] = "del-ioeventfd",
+};
+
+const char *proxy_cmd_name(proc_cmd_t cmd)
+{
+    if (cmd >= MAX || !proxy_cmd_names[cmd]) {
+        return "unknown";
+    }
+
+    return proxy_cmd_names[cmd];
+}
+
+/*
+ * Records the latency of a command that was started at start_ns, as
+ * returned by get_clock(). Called by the QEMU side of the link once the
+ * command is complete.
+ */
+void proxy_link_account(ProxyLinkState *s, proc_cmd_t cmd, int64_t start_ns)
+{
+    ProxyLinkStats *stats;
+    uint64_t ns;
+    int bucket;
+
+    if (cmd >= MAX) {
+        return;
+    }
+
+    ns = MAX(get_clock() - start_ns, 0);
+    bucket = ns ? 63 - clz64(ns) : 0;
+    bucket = MIN(bucket, PROXY_LINK_HIST_BUCKETS - 1);
+
+    stats = &s->stats[cmd];
+    stat64_add(&stats->count, 1);
+    stat64_add(&stats->total_ns, ns);
+    stat64_max(&stats->max_ns, ns);
+    stat64_add(&stats->hist[bucket], 1);
+
+    trace_proxy_link_account(s, cmd, ns);
+}
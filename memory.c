@@ -37,7 +37,8 @@
 static unsigned memory_region_transaction_depth;
 static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
-static bool global_dirty_log = false;
+/* GLOBAL_DIRTY_* flags of the users that need the dirty log */
+static unsigned int global_dirty_tracking;
 
 static QTAILQ_HEAD(, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
@@ -1815,7 +1816,7 @@ bool memory_region_is_ram_device(MemoryRegion *mr)
 uint8_t memory_region_get_dirty_log_mask(MemoryRegion *mr)
 {
     uint8_t mask = mr->dirty_log_mask;
-    if (global_dirty_log && mr->ram_block) {
+    if (global_dirty_tracking && mr->ram_block) {
         mask |= (1 << DIRTY_MEMORY_MIGRATION);
     }
     return mask;
@@ -2052,6 +2053,11 @@ static void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
      * address space once.
      */
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global) {
+            /* Whatever @mr is, such a listener can only sync everything */
+            listener->log_sync_global(listener);
+            continue;
+        }
         if (!listener->log_sync) {
             continue;
         }
@@ -2567,52 +2573,79 @@ void memory_global_dirty_log_sync(void)
 }
 
 static VMChangeStateEntry *vmstate_change;
+/* Flags whose stop waits for the VM to run again */
+static unsigned int postponed_stop_flags;
 
-void memory_global_dirty_log_start(void)
+static void memory_global_dirty_log_do_stop(unsigned int flags)
 {
-    if (vmstate_change) {
-        qemu_del_vm_change_state_handler(vmstate_change);
-        vmstate_change = NULL;
+    flags &= global_dirty_tracking;
+    if (!flags) {
+        return;
     }
 
-    global_dirty_log = true;
-
-    MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
+    global_dirty_tracking &= ~flags;
+    if (global_dirty_tracking) {
+        /* Somebody else still needs the log */
+        return;
+    }
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
     memory_region_transaction_commit();
+
+    MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
 }
 
-static void memory_global_dirty_log_do_stop(void)
+static void memory_global_dirty_log_stop_postponed(void)
 {
-    global_dirty_log = false;
+    memory_global_dirty_log_do_stop(postponed_stop_flags);
+    postponed_stop_flags = 0;
+
+    qemu_del_vm_change_state_handler(vmstate_change);
+    vmstate_change = NULL;
+}
+
+void memory_global_dirty_log_start(unsigned int flags)
+{
+    unsigned int old_flags = global_dirty_tracking;
+
+    assert(flags && !(flags & ~GLOBAL_DIRTY_MASK));
+
+    if (vmstate_change) {
+        /* The log stays on for @flags, run the rest of the stop now */
+        postponed_stop_flags &= ~flags;
+        memory_global_dirty_log_stop_postponed();
+        old_flags = global_dirty_tracking;
+    }
+
+    global_dirty_tracking |= flags;
+    if (old_flags) {
+        return;
+    }
+
+    MEMORY_LISTENER_CALL_GLOBAL(log_global_start, Forward);
 
     /* Refresh DIRTY_LOG_MIGRATION bit.  */
     memory_region_transaction_begin();
     memory_region_update_pending = true;
     memory_region_transaction_commit();
-
-    MEMORY_LISTENER_CALL_GLOBAL(log_global_stop, Reverse);
 }
 
 static void memory_vm_change_state_handler(void *opaque, int running,
                                            RunState state)
 {
     if (running) {
-        memory_global_dirty_log_do_stop();
-
-        if (vmstate_change) {
-            qemu_del_vm_change_state_handler(vmstate_change);
-            vmstate_change = NULL;
-        }
+        memory_global_dirty_log_stop_postponed();
     }
 }
 
-void memory_global_dirty_log_stop(void)
+void memory_global_dirty_log_stop(unsigned int flags)
 {
+    assert(flags && !(flags & ~GLOBAL_DIRTY_MASK));
+
     if (!runstate_is_running()) {
+        postponed_stop_flags |= flags;
         if (vmstate_change) {
             return;
         }
@@ -2621,7 +2654,7 @@ void memory_global_dirty_log_stop(void)
         return;
     }
 
-    memory_global_dirty_log_do_stop();
+    memory_global_dirty_log_do_stop(flags);
 }
 
 static void listener_add_address_space(MemoryListener *listener,
@@ -2633,7 +2666,7 @@ static void listener_add_address_space(MemoryListener *listener,
     if (listener->begin) {
         listener->begin(listener);
     }
-    if (global_dirty_log) {
+    if (global_dirty_tracking) {
         if (listener->log_global_start) {
             listener->log_global_start(listener);
         }
@@ -0,0 +1,347 @@
+/*
+ * Guest dirty rate estimation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#include "qemu/rcu.h"
+#include "qemu/units.h"
+#include "qemu/timer.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-commands-migration.h"
+#include "qapi/qapi-visit-migration.h"
+#include "qapi/qmp/qerror.h"
+#include "exec/cpu-common.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
+#include "qom/cpu.h"
+#include "sysemu/kvm.h"
+#include "trace.h"
+
+/*
+ * The dirty rate of a RAM block is estimated from a random sample of its
+ * pages: each page is hashed at the start and at the end of the
+ * measurement, and the fraction of pages whose hash changed is applied to
+ * the whole block.  Guest memory is only read, so a migration that runs at
+ * the same time is not affected.
+ *
+ * The per-vCPU rate comes from the KVM dirty ring, which counts the pages
+ * each vCPU writes while dirty logging is on.
+ */
+
+#define DIRTY_RATE_DEFAULT_SAMPLE_PAGES 512
+#define DIRTY_RATE_MAX_SAMPLE_PAGES     10000
+#define DIRTY_RATE_MAX_CALC_TIME        60
+
+typedef struct DirtyRateBlockSample {
+    char *idstr;
+    ram_addr_t used_length;
+    uint64_t npages;
+    ram_addr_t *offsets;
+    uint32_t *hashes;
+    uint64_t dirty;
+} DirtyRateBlockSample;
+
+typedef struct DirtyRateConfig {
+    int64_t calc_time;
+    uint64_t sample_pages;
+    bool per_vcpu;
+} DirtyRateConfig;
+
+typedef struct DirtyRateMeasure {
+    DirtyRateConfig config;
+    GArray *blocks;
+    /* dirty_pages of each vCPU at the start, indexed by cpu_index */
+    GHashTable *vcpu_start;
+} DirtyRateMeasure;
+
+static struct {
+    /* DirtyRateStatus, only set with atomics */
+    int status;
+    /* Result of the last measurement, valid when status is measured */
+    DirtyRateInfo *info;
+} dirty_rate = {
+    .status = DIRTY_RATE_STATUS_UNSTARTED,
+};
+
+static uint32_t dirty_rate_hash_page(void *host, ram_addr_t offset)
+{
+    size_t page_size = qemu_target_page_size();
+
+    return crc32(0, (uint8_t *)host + offset, page_size);
+}
+
+static int dirty_rate_sample_block(RAMBlock *block, void *opaque)
+{
+    DirtyRateMeasure *m = opaque;
+    DirtyRateBlockSample sample = { 0 };
+    size_t page_size = qemu_target_page_size();
+    uint64_t block_pages, i;
+    void *host;
+
+    block_pages = qemu_ram_get_used_length(block) / page_size;
+    if (!qemu_ram_is_migratable(block) || !block_pages) {
+        return 0;
+    }
+
+    sample.idstr = g_strdup(qemu_ram_get_idstr(block));
+    sample.used_length = qemu_ram_get_used_length(block);
+    sample.npages = MAX(1, m->config.sample_pages * sample.used_length /
+                           (1ULL << 30));
+    sample.npages = MIN(sample.npages, block_pages);
+    sample.offsets = g_new(ram_addr_t, sample.npages);
+    sample.hashes = g_new(uint32_t, sample.npages);
+
+    host = qemu_ram_get_host_addr(block);
+    for (i = 0; i < sample.npages; i++) {
+        uint64_t page = (((uint64_t)g_random_int() << 32) | g_random_int()) %
+                        block_pages;
+
+        sample.offsets[i] = page * page_size;
+        sample.hashes[i] = dirty_rate_hash_page(host, sample.offsets[i]);
+    }
+
+    g_array_append_val(m->blocks, sample);
+    return 0;
+}
+
+static int dirty_rate_compare_block(RAMBlock *block, void *opaque)
+{
+    DirtyRateMeasure *m = opaque;
+    DirtyRateBlockSample *sample;
+    void *host;
+    uint64_t i;
+    int j;
+
+    for (j = 0; j < m->blocks->len; j++) {
+        sample = &g_array_index(m->blocks, DirtyRateBlockSample, j);
+        if (!strcmp(sample->idstr, qemu_ram_get_idstr(block))) {
+            break;
+        }
+    }
+    if (j == m->blocks->len) {
+        /* Added during the measurement */
+        return 0;
+    }
+    if (sample->used_length != qemu_ram_get_used_length(block)) {
+        /* Resized, the sample is meaningless now; count it all as dirty */
+        sample->dirty = sample->npages;
+        return 0;
+    }
+
+    host = qemu_ram_get_host_addr(block);
+    for (i = 0; i < sample->npages; i++) {
+        if (dirty_rate_hash_page(host, sample->offsets[i]) !=
+            sample->hashes[i]) {
+            sample->dirty++;
+        }
+    }
+    return 0;
+}
+
+/* Called with the BQL held */
+static void dirty_rate_vcpu_start(DirtyRateMeasure *m)
+{
+    CPUState *cpu;
+
+    memory_global_dirty_log_start(GLOBAL_DIRTY_DIRTY_RATE);
+    kvm_dirty_ring_flush_all();
+
+    m->vcpu_start = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+    CPU_FOREACH(cpu) {
+        g_hash_table_insert(m->vcpu_start, GINT_TO_POINTER(cpu->cpu_index),
+                            g_memdup(&cpu->dirty_pages,
+                                     sizeof(cpu->dirty_pages)));
+    }
+}
+
+/* Called with the BQL held */
+static DirtyRateVcpuList *dirty_rate_vcpu_end(DirtyRateMeasure *m,
+                                              int64_t elapsed_ms)
+{
+    DirtyRateVcpuList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    kvm_dirty_ring_flush_all();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_DIRTY_RATE);
+
+    CPU_FOREACH(cpu) {
+        uint64_t *start = g_hash_table_lookup(m->vcpu_start,
+                                              GINT_TO_POINTER(cpu->cpu_index));
+        DirtyRateVcpuList *entry;
+        uint64_t bytes;
+
+        if (!start) {
+            /* Hotplugged during the measurement */
+            continue;
+        }
+        bytes = (cpu->dirty_pages - *start) * qemu_real_host_page_size;
+
+        entry = g_new0(DirtyRateVcpuList, 1);
+        entry->value = g_new0(DirtyRateVcpu, 1);
+        entry->value->id = cpu->cpu_index;
+        entry->value->dirty_rate = bytes * 1000 / elapsed_ms / MiB;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    g_hash_table_destroy(m->vcpu_start);
+    m->vcpu_start = NULL;
+    return head;
+}
+
+static void dirty_rate_fill_blocks(DirtyRateMeasure *m, DirtyRateInfo *info,
+                                   int64_t elapsed_ms)
+{
+    DirtyRateRamBlockList **tail = &info->ramblocks;
+    int64_t total = 0;
+    int i;
+
+    for (i = 0; i < m->blocks->len; i++) {
+        DirtyRateBlockSample *sample =
+            &g_array_index(m->blocks, DirtyRateBlockSample, i);
+        DirtyRateRamBlockList *entry = g_new0(DirtyRateRamBlockList, 1);
+        uint64_t bytes;
+
+        bytes = sample->used_length / sample->npages * sample->dirty;
+
+        entry->value = g_new0(DirtyRateRamBlock, 1);
+        entry->value->id = g_strdup(sample->idstr);
+        entry->value->size = sample->used_length;
+        entry->value->sampled_pages = sample->npages;
+        entry->value->dirty_pages = sample->dirty;
+        entry->value->dirty_rate = bytes * 1000 / elapsed_ms / MiB;
+        total += entry->value->dirty_rate;
+        *tail = entry;
+        tail = &entry->next;
+
+        trace_dirty_rate_block(sample->idstr, sample->npages, sample->dirty,
+                               entry->value->dirty_rate);
+
+        g_free(sample->idstr);
+        g_free(sample->offsets);
+        g_free(sample->hashes);
+    }
+
+    info->has_ramblocks = true;
+    info->has_dirty_rate = true;
+    info->dirty_rate = total;
+}
+
+static void *dirty_rate_thread(void *opaque)
+{
+    DirtyRateMeasure *m = opaque;
+    DirtyRateInfo *info = dirty_rate.info;
+    int64_t start, elapsed_ms;
+
+    rcu_register_thread();
+
+    m->blocks = g_array_new(false, true, sizeof(DirtyRateBlockSample));
+    qemu_ram_foreach_block(dirty_rate_sample_block, m);
+
+    if (m->config.per_vcpu) {
+        qemu_mutex_lock_iothread();
+        dirty_rate_vcpu_start(m);
+        qemu_mutex_unlock_iothread();
+    }
+
+    start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    g_usleep(m->config.calc_time * G_USEC_PER_SEC);
+    elapsed_ms = MAX(1, qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start);
+
+    if (m->config.per_vcpu) {
+        qemu_mutex_lock_iothread();
+        info->vcpus = dirty_rate_vcpu_end(m, elapsed_ms);
+        info->has_vcpus = true;
+        qemu_mutex_unlock_iothread();
+    }
+
+    qemu_ram_foreach_block(dirty_rate_compare_block, m);
+    dirty_rate_fill_blocks(m, info, elapsed_ms);
+    trace_dirty_rate_done(info->dirty_rate, elapsed_ms);
+
+    g_array_free(m->blocks, true);
+    g_free(m);
+
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURED);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, bool has_per_vcpu,
+                         bool per_vcpu, Error **errp)
+{
+    DirtyRateMeasure *m;
+    QemuThread thread;
+
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to 60");
+        return;
+    }
+    if (!has_sample_pages) {
+        sample_pages = DIRTY_RATE_DEFAULT_SAMPLE_PAGES;
+    } else if (sample_pages < 1 ||
+               sample_pages > DIRTY_RATE_MAX_SAMPLE_PAGES) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "sample-pages",
+                   "an integer in the range of 1 to 10000");
+        return;
+    }
+    if (has_per_vcpu && per_vcpu && !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "The per-vCPU dirty rate needs the KVM dirty ring "
+                   "(machine property kvm-dirty-ring-size)");
+        return;
+    }
+
+    /* Only the monitor starts and reads measurements, no race here */
+    if (atomic_read(&dirty_rate.status) == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already running");
+        return;
+    }
+
+    qapi_free_DirtyRateInfo(dirty_rate.info);
+    dirty_rate.info = g_new0(DirtyRateInfo, 1);
+    dirty_rate.info->start_time =
+        qemu_clock_get_ms(QEMU_CLOCK_HOST) / 1000;
+    dirty_rate.info->calc_time = calc_time;
+    dirty_rate.info->sample_pages = sample_pages;
+
+    m = g_new0(DirtyRateMeasure, 1);
+    m->config.calc_time = calc_time;
+    m->config.sample_pages = sample_pages;
+    m->config.per_vcpu = has_per_vcpu && per_vcpu;
+
+    trace_dirty_rate_start(calc_time, sample_pages, m->config.per_vcpu);
+    atomic_mb_set(&dirty_rate.status, DIRTY_RATE_STATUS_MEASURING);
+    qemu_thread_create(&thread, "dirtyrate", dirty_rate_thread, m,
+                       QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    int status = atomic_mb_read(&dirty_rate.status);
+    DirtyRateInfo *info;
+
+    switch (status) {
+    case DIRTY_RATE_STATUS_MEASURED:
+        info = QAPI_CLONE(DirtyRateInfo, dirty_rate.info);
+        break;
+    case DIRTY_RATE_STATUS_MEASURING:
+        info = g_new0(DirtyRateInfo, 1);
+        info->start_time = dirty_rate.info->start_time;
+        info->calc_time = dirty_rate.info->calc_time;
+        info->sample_pages = dirty_rate.info->sample_pages;
+        break;
+    default:
+        info = g_new0(DirtyRateInfo, 1);
+        break;
+    }
+    info->status = status;
+    return info;
+}
@@ -83,6 +83,7 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
+#define DEFAULT_MIGRATE_DEVICE_STATE_THREADS 4
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -209,6 +210,10 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -596,9 +601,18 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
 
         /*
          * Common migration only needs one channel, so we can start
-         * right now.  Multifd needs more than one channel, we wait.
+         * right now.  Multifd and postcopy preempt need more than one
+         * channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() && !migrate_postcopy_preempt();
+    } else if (migrate_postcopy_preempt()) {
+        /* The second connection carries urgent postcopy pages */
+        if (mis->postcopy_qemufile_dst) {
+            error_setg(errp, "Unexpected extra postcopy preempt channel");
+            return;
+        }
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        start_migration = true;
     } else {
         Error *local_err = NULL;
         /* Multiple connections */
@@ -628,6 +642,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -770,6 +788,10 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_multifd_channels = s->parameters.x_multifd_channels;
     params->has_x_multifd_page_count = true;
     params->x_multifd_page_count = s->parameters.x_multifd_page_count;
+    params->has_x_multifd_compression = true;
+    params->x_multifd_compression = s->parameters.x_multifd_compression;
+    params->has_x_device_state_threads = true;
+    params->x_device_state_threads = s->parameters.x_device_state_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -842,6 +864,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -852,6 +875,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss = xbzrle_counters.cache_miss;
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->skipped = xbzrle_counters.skipped;
     }
 
     if (migrate_use_compression()) {
@@ -934,6 +958,10 @@ static void fill_source_migration_info(MigrationInfo *info)
         info->downtime = s->downtime;
         info->has_setup_time = true;
         info->setup_time = s->setup_time;
+        if (migrate_parallel_device_state()) {
+            info->has_x_device_state_batches = true;
+            info->x_device_state_batches = s->device_state_batches;
+        }
 
         populate_ram_info(info, s);
         break;
@@ -1023,6 +1051,26 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_X_IGNORE_SHARED_FDS] &&
+        !cap_list[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+        error_setg(errp, "x-ignore-shared-fds requires x-ignore-shared");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /* Both add connections after the main one, they can't be told apart */
+        if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            error_setg(errp, "Postcopy preempt is not compatible with "
+                       "multifd");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1166,6 +1214,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
                    "is invalid, it should be in the range of 1 to 10000");
         return false;
     }
+    if (params->has_x_device_state_threads &&
+        (params->x_device_state_threads < 1 ||
+         params->x_device_state_threads > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x-device-state-threads",
+                   "is invalid, it should be in the range of 1 to 255");
+        return false;
+    }
 
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
@@ -1280,6 +1336,12 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_x_multifd_page_count) {
         dest->x_multifd_page_count = params->x_multifd_page_count;
     }
+    if (params->has_x_multifd_compression) {
+        dest->x_multifd_compression = params->x_multifd_compression;
+    }
+    if (params->has_x_device_state_threads) {
+        dest->x_device_state_threads = params->x_device_state_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         dest->xbzrle_cache_size = params->xbzrle_cache_size;
     }
@@ -1373,6 +1435,12 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_x_multifd_page_count) {
         s->parameters.x_multifd_page_count = params->x_multifd_page_count;
     }
+    if (params->has_x_multifd_compression) {
+        s->parameters.x_multifd_compression = params->x_multifd_compression;
+    }
+    if (params->has_x_device_state_threads) {
+        s->parameters.x_device_state_threads = params->x_device_state_threads;
+    }
     if (params->has_xbzrle_cache_size) {
         s->parameters.xbzrle_cache_size = params->xbzrle_cache_size;
         xbzrle_cache_resize(params->xbzrle_cache_size, errp);
@@ -1521,6 +1589,10 @@ static void migrate_fd_cleanup(void *opaque)
         qemu_mutex_lock_iothread();
 
         multifd_save_cleanup();
+        if (s->postcopy_qemufile_src) {
+            qemu_fclose(s->postcopy_qemufile_src);
+            s->postcopy_qemufile_src = NULL;
+        }
         qemu_mutex_lock(&s->qemu_file_lock);
         tmp = s->to_dst_file;
         s->to_dst_file = NULL;
@@ -1576,6 +1648,9 @@ static void migrate_fd_cancel(MigrationState *s)
         /* shutdown the rp socket, so causing the rp thread to shutdown */
         qemu_file_shutdown(s->rp_state.from_dst_file);
     }
+    if (s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
 
     do {
         old_state = s->state;
@@ -1693,6 +1768,7 @@ void migrate_init(MigrationState *s)
     s->downtime = 0;
     s->expected_downtime = 0;
     s->setup_time = 0;
+    s->device_state_batches = 0;
     s->start_postcopy = false;
     s->postcopy_after_devices = false;
     s->migration_thread_running = false;
@@ -1913,6 +1989,25 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* File descriptors can only be passed over a UNIX socket */
+    if (migrate_ignore_shared_fds() && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "x-ignore-shared-fds requires a unix URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
+    /* The preempt channel is a second connection to the same address */
+    if (migrate_postcopy_preempt() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "Postcopy preempt requires a tcp or unix URI");
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        block_cleanup_parameters(s);
+        return;
+    }
+
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
 #ifdef CONFIG_RDMA
@@ -2052,6 +2147,15 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2115,6 +2219,15 @@ bool migrate_ignore_shared(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
 }
 
+bool migrate_ignore_shared_fds(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED_FDS];
+}
+
 bool migrate_use_events(void)
 {
     MigrationState *s;
@@ -2161,6 +2274,34 @@ int migrate_multifd_page_count(void)
     return s->parameters.x_multifd_page_count;
 }
 
+MultiFDCompression migrate_multifd_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_compression;
+}
+
+bool migrate_parallel_device_state(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[
+        MIGRATION_CAPABILITY_X_PARALLEL_DEVICE_STATE];
+}
+
+int migrate_device_state_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_device_state_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2535,6 +2676,13 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    if (postcopy_preempt_wait_channel(ms)) {
+        error_report("Postcopy preempt channel could not be connected");
+        migrate_set_state(&ms->state, ms->state, MIGRATION_STATUS_FAILED);
+        return -1;
+    }
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3285,6 +3433,7 @@ static void *migration_thread(void *opaque)
 
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
+    Error *local_err = NULL;
     int64_t rate_limit;
     bool resume = s->state == MIGRATION_STATUS_POSTCOPY_PAUSED;
 
@@ -3332,6 +3481,15 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         return;
     }
 
+    if (postcopy_preempt_setup(s, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (multifd_save_setup() != 0) {
         migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
                           MIGRATION_STATUS_FAILED);
@@ -3406,6 +3564,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT32("x-multifd-page-count", MigrationState,
                       parameters.x_multifd_page_count,
                       DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT),
+    DEFINE_PROP_UINT8("x-device-state-threads", MigrationState,
+                      parameters.x_device_state_threads,
+                      DEFAULT_MIGRATE_DEVICE_STATE_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -3466,6 +3627,7 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -3496,6 +3658,8 @@ static void migration_instance_init(Object *obj)
     params->has_block_incremental = true;
     params->has_x_multifd_channels = true;
     params->has_x_multifd_page_count = true;
+    params->has_x_multifd_compression = true;
+    params->has_x_device_state_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -3506,6 +3670,7 @@ static void migration_instance_init(Object *obj)
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
@@ -24,6 +24,17 @@
 #include "net/announce.h"
 
 struct PostcopyBlocktimeContext;
+struct PostcopyLatencyContext;
+
+/*
+ * Streams of RAM pages.  With postcopy-preempt, the pages the destination
+ * faulted on travel on their own channel during postcopy.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX,
+};
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
@@ -59,8 +70,14 @@ struct MigrationIncomingState {
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
     RAMBlock *last_rb;
-    void     *postcopy_tmp_page;
+    /* Temporary host pages and last RAMBlock received, per channel */
+    void     *postcopy_tmp_pages[RAM_CHANNEL_MAX];
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     void     *postcopy_tmp_zero_page;
+    /* postcopy-preempt channel and the thread that loads pages from it */
+    QEMUFile *postcopy_qemufile_dst;
+    bool      have_preempt_thread;
+    QemuThread preempt_thread;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -80,6 +97,9 @@ struct MigrationIncomingState {
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
 
+    /* Latency of the page requests sent to the source during postcopy */
+    struct PostcopyLatencyContext *latency_ctx;
+
     /* notify PAUSED postcopy incoming migrations to try to continue */
     bool postcopy_recover_triggered;
     QemuSemaphore postcopy_pause_sem_dst;
@@ -174,6 +194,8 @@ struct MigrationState
     int64_t expected_downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
+    /* MIG_CMD_DEVICE_BATCH commands sent by the latest migration */
+    int64_t device_state_batches;
     /*
      * Whether guest was running when we enter the completion stage.
      * If migration is interrupted by any reason, we need to continue
@@ -230,6 +252,13 @@ struct MigrationState
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /*
+     * postcopy-preempt channel, NULL if it failed to connect.  The
+     * semaphore is posted once the connection attempt is over.
+     */
+    QEMUFile *postcopy_qemufile_src;
+    QemuSemaphore postcopy_qemufile_src_sem;
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -269,12 +298,16 @@ bool migrate_postcopy_ram(void);
 bool migrate_zero_blocks(void);
 bool migrate_dirty_bitmaps(void);
 bool migrate_ignore_shared(void);
+bool migrate_ignore_shared_fds(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 int migrate_multifd_page_count(void);
+MultiFDCompression migrate_multifd_compression(void);
+bool migrate_parallel_device_state(void);
+int migrate_device_state_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -294,6 +327,7 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
@@ -1,6 +1,7 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative hash of the page address; pages
+ * within a set are replaced in LRU order
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -31,11 +32,18 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that can share a hash bucket */
+#define CACHE_WAYS 4
+
+#define CACHE_ADDR_INVALID ((uint64_t)-1)
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* value of lru_clock at the last access */
+    uint64_t it_lru;
     uint8_t *it_data;
 };
 
@@ -44,6 +52,9 @@ struct PageCache {
     size_t page_size;
     size_t max_num_items;
     size_t num_items;
+    size_t num_sets;
+    size_t ways;
+    uint64_t lru_clock;
 };
 
 PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
@@ -75,8 +86,12 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     cache->page_size = page_size;
     cache->num_items = 0;
     cache->max_num_items = num_pages;
+    cache->ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->ways;
+    cache->lru_clock = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %zu, %zu ways\n", cache->num_sets,
+            cache->ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -91,7 +106,8 @@ PageCache *cache_init(int64_t new_size, size_t page_size, Error **errp)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
-        cache->page_cache[i].it_addr = -1;
+        cache->page_cache[i].it_lru = 0;
+        cache->page_cache[i].it_addr = CACHE_ADDR_INVALID;
     }
 
     return cache;
@@ -113,45 +129,96 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t addr)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t pos;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+    g_assert(cache->num_sets);
+
+    pos = (addr / cache->page_size) & (cache->num_sets - 1);
+
+    return &cache->page_cache[pos * cache->ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+/*
+ * Pick the slot for a page that is not cached: a free way if there is
+ * one, otherwise the least recently used page that is not fresh.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr,
+                                   uint64_t current_age)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    size_t i;
 
-    return &cache->page_cache[pos];
+    for (i = 0; i < cache->ways; i++) {
+        CacheItem *it = &set[i];
+
+        if (it->it_addr == CACHE_ADDR_INVALID) {
+            return it;
+        }
+        if (it->it_age + CACHED_PAGE_LIFETIME > current_age) {
+            /* the cache page is fresh, don't replace it */
+            continue;
+        }
+        if (!victim || it->it_lru < victim->it_lru) {
+            victim = it;
+        }
+    }
+    return victim;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    return it ? it->it_data : NULL;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
     CacheItem *it;
 
     it = cache_get_by_addr(cache, addr);
 
-    if (it->it_addr == addr) {
+    if (it) {
         /* update the it_age when the cache hit */
         it->it_age = current_age;
+        it->it_lru = ++cache->lru_clock;
         return true;
     }
     return false;
 }
 
+bool cache_set_is_full(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    size_t i;
+
+    for (i = 0; i < cache->ways; i++) {
+        if (set[i].it_addr == CACHE_ADDR_INVALID ||
+            set[i].it_addr == addr) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age)
 {
@@ -160,12 +227,13 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     /* actual update of entry */
     it = cache_get_by_addr(cache, addr);
-
-    if (it->it_data && it->it_addr != addr &&
-        it->it_age + CACHED_PAGE_LIFETIME > current_age) {
-        /* the cache page is fresh, don't replace it */
-        return -1;
+    if (!it) {
+        it = cache_get_victim(cache, addr, current_age);
+        if (!it) {
+            return -1;
+        }
     }
+
     /* allocate page */
     if (!it->it_data) {
         it->it_data = g_try_malloc(cache->page_size);
@@ -179,7 +247,18 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_lru = ++cache->lru_clock;
     it->it_addr = addr;
 
     return 0;
 }
+
+void cache_remove(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    /* keep the buffer around, the next insert into this set reuses it */
+    if (it) {
+        it->it_addr = CACHE_ADDR_INVALID;
+    }
+}
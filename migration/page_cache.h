@@ -44,8 +44,18 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
+
+/**
+ * cache_set_is_full: Checks whether caching a page would evict another one
+ *
+ * Returns %true if @addr is not cached and all the pages that share its
+ * hash bucket are in use
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ */
+bool cache_set_is_full(const PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -71,4 +81,12 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_remove: drop a page from the cache, if it is cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page address
+ */
+void cache_remove(PageCache *cache, uint64_t addr);
+
 #endif
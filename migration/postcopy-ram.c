@@ -28,6 +28,10 @@
 #include "sysemu/sysemu.h"
 #include "sysemu/balloon.h"
 #include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "io/channel-socket.h"
+#include "socket.h"
 #include "trace.h"
 
 /* Arbitrary limit on size of each discard command,
@@ -154,10 +158,143 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
     return list;
 }
 
+/*
+ * Request latency is kept as a log2 histogram in microseconds; bucket
+ * i counts latencies in [2^(i-1), 2^i), bucket 0 counts sub-microsecond
+ * ones and the last bucket everything above.
+ */
+#define POSTCOPY_LATENCY_BUCKETS 64
+
+typedef struct PostcopyLatencyContext {
+    QemuMutex lock;
+    /* host page address -> time (ns) the page was requested */
+    GHashTable *requested;
+    /* number of entries in @requested, read without the lock */
+    int pending;
+    uint64_t requests;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t histogram[POSTCOPY_LATENCY_BUCKETS];
+} PostcopyLatencyContext;
+
+static PostcopyLatencyContext *latency_context_new(void)
+{
+    PostcopyLatencyContext *ctx = g_new0(PostcopyLatencyContext, 1);
+
+    qemu_mutex_init(&ctx->lock);
+    ctx->requested = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                           NULL, g_free);
+    return ctx;
+}
+
+static void latency_context_reset(PostcopyLatencyContext *ctx)
+{
+    qemu_mutex_lock(&ctx->lock);
+    g_hash_table_remove_all(ctx->requested);
+    atomic_set(&ctx->pending, 0);
+    ctx->requests = 0;
+    ctx->total_us = 0;
+    ctx->max_us = 0;
+    memset(ctx->histogram, 0, sizeof(ctx->histogram));
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Called from the fault thread when a page is requested from the source.
+ * Faults that hit a page which is already in flight keep the time of the
+ * first request.
+ */
+static void mark_postcopy_latency_begin(void *host)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyLatencyContext *ctx = mis->latency_ctx;
+    int64_t *start;
+
+    if (!ctx) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->lock);
+    if (!g_hash_table_contains(ctx->requested, host)) {
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(ctx->requested, host, start);
+        atomic_inc(&ctx->pending);
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+/*
+ * Called once a page has been placed, from whichever thread loaded it.
+ * Most pages were never requested, so don't take the lock unless some
+ * request is outstanding.
+ */
+static void mark_postcopy_latency_end(void *host)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyLatencyContext *ctx = mis->latency_ctx;
+    int64_t *start;
+    uint64_t us;
+
+    if (!ctx || !atomic_read(&ctx->pending)) {
+        return;
+    }
+
+    qemu_mutex_lock(&ctx->lock);
+    start = g_hash_table_lookup(ctx->requested, host);
+    if (start) {
+        us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - *start) / SCALE_US;
+        g_hash_table_remove(ctx->requested, host);
+        atomic_dec(&ctx->pending);
+
+        ctx->requests++;
+        ctx->total_us += us;
+        ctx->max_us = MAX(ctx->max_us, us);
+        ctx->histogram[MIN(64 - clz64(us), POSTCOPY_LATENCY_BUCKETS - 1)]++;
+        trace_postcopy_page_req_latency(host, us);
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+/* Upper bound of the bucket holding the @pct percentile, capped to max */
+static uint64_t latency_percentile(PostcopyLatencyContext *ctx, int pct)
+{
+    uint64_t target = (ctx->requests * pct + 99) / 100;
+    uint64_t seen = 0;
+    int i;
+
+    for (i = 0; i < POSTCOPY_LATENCY_BUCKETS; i++) {
+        seen += ctx->histogram[i];
+        if (seen >= target) {
+            return MIN(1ULL << i, ctx->max_us);
+        }
+    }
+    return ctx->max_us;
+}
+
+static void fill_postcopy_latency_info(MigrationInfo *info,
+                                       PostcopyLatencyContext *ctx)
+{
+    PostcopyLatencyInfo *lat;
+
+    qemu_mutex_lock(&ctx->lock);
+    if (ctx->requests) {
+        lat = g_new0(PostcopyLatencyInfo, 1);
+        lat->requests = ctx->requests;
+        lat->average = ctx->total_us / ctx->requests;
+        lat->p50 = latency_percentile(ctx, 50);
+        lat->p99 = latency_percentile(ctx, 99);
+        lat->max = ctx->max_us;
+        info->has_postcopy_latency = true;
+        info->postcopy_latency = lat;
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
+
 /*
  * This function just populates MigrationInfo from postcopy's
- * blocktime context. It will not populate MigrationInfo,
- * unless postcopy-blocktime capability was set.
+ * request latency and blocktime contexts. Blocktime is only
+ * populated if the postcopy-blocktime capability was set.
  *
  * @info: pointer to MigrationInfo to populate
  */
@@ -166,6 +303,10 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    if (mis->latency_ctx) {
+        fill_postcopy_latency_info(info, mis->latency_ctx);
+    }
+
     if (!bc) {
         return;
     }
@@ -534,8 +675,23 @@ static void postcopy_balloon_inhibit(bool state)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    if (mis->have_preempt_thread) {
+        /*
+         * On success the source ends the preempt channel with RAM_SAVE_FLAG_EOS
+         * and the thread is already on its way out; on failure it may still be
+         * blocked reading from the socket.
+         */
+        if (mis->state == MIGRATION_STATUS_FAILED) {
+            qemu_file_shutdown(mis->postcopy_qemufile_dst);
+        }
+        qemu_thread_join(&mis->preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -574,9 +730,11 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
     postcopy_state_set(POSTCOPY_INCOMING_END);
 
-    if (mis->postcopy_tmp_page) {
-        munmap(mis->postcopy_tmp_page, mis->largest_page_size);
-        mis->postcopy_tmp_page = NULL;
+    for (i = 0; i < RAM_CHANNEL_MAX; i++) {
+        if (mis->postcopy_tmp_pages[i]) {
+            munmap(mis->postcopy_tmp_pages[i], mis->largest_page_size);
+            mis->postcopy_tmp_pages[i] = NULL;
+        }
     }
     if (mis->postcopy_tmp_zero_page) {
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
@@ -698,6 +856,7 @@ int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                         qemu_ram_get_idstr(rb), rb_offset);
         return postcopy_wake_shared(pcfd, client_addr, rb);
     }
+    mark_postcopy_latency_begin(qemu_ram_get_host_addr(rb) + aligned_rbo);
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
         migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
@@ -990,6 +1149,8 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            mark_postcopy_latency_begin(qemu_ram_get_host_addr(rb) +
+                                        rb_offset);
 
 retry:
             /*
@@ -1114,6 +1275,12 @@ int postcopy_ram_enable_notify(MigrationIncomingState *mis)
         return -1;
     }
 
+    if (!mis->latency_ctx) {
+        mis->latency_ctx = latency_context_new();
+    } else {
+        latency_context_reset(mis->latency_ctx);
+    }
+
     qemu_sem_init(&mis->fault_thread_sem, 0);
     qemu_thread_create(&mis->fault_thread, "postcopy/fault",
                        postcopy_ram_fault_thread, mis, QEMU_THREAD_JOINABLE);
@@ -1156,11 +1323,19 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         zero_struct.mode = 0;
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
+    if (ret && errno == EEXIST && migrate_postcopy_preempt()) {
+        /*
+         * A page that was requeued on the main stream after the
+         * postcopy-preempt channel broke may have made it through both
+         */
+        trace_postcopy_place_page_duplicate(host_addr);
+        ret = 0;
+    }
     if (!ret) {
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
-
+        mark_postcopy_latency_end(host_addr);
     }
     return ret;
 }
@@ -1234,19 +1409,21 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                                                                       host));
     } else {
         /* The kernel can't use UFFDIO_ZEROPAGE for hugepages */
-        if (!mis->postcopy_tmp_zero_page) {
-            mis->postcopy_tmp_zero_page = mmap(NULL, mis->largest_page_size,
-                                               PROT_READ | PROT_WRITE,
-                                               MAP_PRIVATE | MAP_ANONYMOUS,
-                                               -1, 0);
-            if (mis->postcopy_tmp_zero_page == MAP_FAILED) {
+        if (!atomic_read(&mis->postcopy_tmp_zero_page)) {
+            void *page = mmap(NULL, mis->largest_page_size,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED) {
                 int e = errno;
-                mis->postcopy_tmp_zero_page = NULL;
                 error_report("%s: %s mapping large zero page",
                              __func__, strerror(e));
                 return -e;
             }
-            memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
+            memset(page, '\0', mis->largest_page_size);
+            /* The preempt thread may be placing zero pages too */
+            if (atomic_cmpxchg(&mis->postcopy_tmp_zero_page, NULL, page)) {
+                munmap(page, mis->largest_page_size);
+            }
         }
         return postcopy_place_page(mis, host, mis->postcopy_tmp_zero_page,
                                    rb);
@@ -1257,24 +1434,25 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
  * Returns a target page of memory that can be mapped at a later point in time
  * using postcopy_place_page
  * The same address is used repeatedly, postcopy_place_page just takes the
- * backing page away.
+ * backing page away.  Each RAM channel has its own page, so that the main
+ * stream and the preempt channel can assemble host pages concurrently.
  * Returns: Pointer to allocated page
  *
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
-{
-    if (!mis->postcopy_tmp_page) {
-        mis->postcopy_tmp_page = mmap(NULL, mis->largest_page_size,
-                             PROT_READ | PROT_WRITE, MAP_PRIVATE |
-                             MAP_ANONYMOUS, -1, 0);
-        if (mis->postcopy_tmp_page == MAP_FAILED) {
-            mis->postcopy_tmp_page = NULL;
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
+{
+    if (!mis->postcopy_tmp_pages[channel]) {
+        void *page = mmap(NULL, mis->largest_page_size,
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE |
+                          MAP_ANONYMOUS, -1, 0);
+        if (page == MAP_FAILED) {
             error_report("%s: %s", __func__, strerror(errno));
             return NULL;
         }
+        mis->postcopy_tmp_pages[channel] = page;
     }
 
-    return mis->postcopy_tmp_page;
+    return mis->postcopy_tmp_pages[channel];
 }
 
 #else
@@ -1334,7 +1512,7 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
-void *postcopy_get_tmp_page(MigrationIncomingState *mis)
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel)
 {
     assert(0);
     return NULL;
@@ -1492,3 +1670,117 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/*
+ * Postcopy preemption: a second connection from the source carries only
+ * the pages that the destination asked for, so that they do not queue
+ * up behind background pages already buffered in the main stream.
+ */
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_free(local_err);
+    } else {
+        qio_channel_set_delay(ioc, false);
+        s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+        trace_postcopy_preempt_send_channel_connected();
+    }
+    /* The QEMUFile took its own reference */
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Start connecting the preempt channel; the connection completes
+ * asynchronously while precopy runs.
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+        error_setg(errp, "Postcopy preempt does not support TLS");
+        return -1;
+    }
+
+    /* A connection from an earlier, failed, migration may complete late */
+    if (s->postcopy_qemufile_src) {
+        qemu_fclose(s->postcopy_qemufile_src);
+        s->postcopy_qemufile_src = NULL;
+    }
+    qemu_sem_destroy(&s->postcopy_qemufile_src_sem);
+    qemu_sem_init(&s->postcopy_qemufile_src_sem, 0);
+
+    socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    return 0;
+}
+
+/*
+ * Wait for the preempt channel to be connected before switching to
+ * postcopy; returns -1 if the connection failed.
+ */
+int postcopy_preempt_wait_channel(MigrationState *s)
+{
+    if (!migrate_postcopy_preempt()) {
+        return 0;
+    }
+
+    /* Only the first switch to postcopy waits, recovery reuses the result */
+    if (!s->postcopy_qemufile_src) {
+        qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+        qemu_sem_post(&s->postcopy_qemufile_src_sem);
+    }
+
+    return s->postcopy_qemufile_src ? 0 : -1;
+}
+
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f)
+{
+    /* Loaded from its own thread, see postcopy_preempt_thread() */
+    qemu_file_set_blocking(f, true);
+    mis->postcopy_qemufile_dst = f;
+    trace_postcopy_preempt_new_channel();
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    int ret;
+
+    trace_postcopy_preempt_thread_entry();
+    rcu_register_thread();
+
+    rcu_read_lock();
+    ret = ram_load_postcopy(mis->postcopy_qemufile_dst, RAM_CHANNEL_POSTCOPY);
+    rcu_read_unlock();
+
+    if (ret < 0 && mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE) {
+        error_report("%s: loading the preempt channel failed: %d",
+                     __func__, ret);
+        /*
+         * Only drop the preempt channel: the source notices and sends the
+         * pages it requeues on the main stream, which carries on.  The
+         * QEMUFile itself is closed when the incoming state is cleaned up.
+         */
+        qemu_file_shutdown(mis->postcopy_qemufile_dst);
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_preempt_thread_exit();
+    return NULL;
+}
+
+void postcopy_preempt_thread_start(MigrationIncomingState *mis)
+{
+    mis->have_preempt_thread = true;
+    qemu_thread_create(&mis->preempt_thread, "postcopy/preempt",
+                       postcopy_preempt_thread, mis, QEMU_THREAD_JOINABLE);
+}
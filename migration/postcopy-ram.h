@@ -105,10 +105,10 @@ typedef enum {
 
 /*
  * Allocate a page of memory that can be mapped at a later point in time
- * using postcopy_place_page
+ * using postcopy_place_page; there is one such page per RAM channel
  * Returns: Pointer to allocated page
  */
-void *postcopy_get_tmp_page(MigrationIncomingState *mis);
+void *postcopy_get_tmp_page(MigrationIncomingState *mis, int channel);
 
 PostcopyState postcopy_state_get(void);
 /* Set the state and return the old state */
@@ -189,4 +189,11 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Postcopy preemption channel, source side */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+int postcopy_preempt_wait_channel(MigrationState *s);
+/* and destination side */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *f);
+void postcopy_preempt_thread_start(MigrationIncomingState *mis);
+
 #endif
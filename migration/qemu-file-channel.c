@@ -72,16 +72,17 @@ static ssize_t channel_writev_buffer(void *opaque,
 }
 
 
-static ssize_t channel_get_buffer(void *opaque,
-                                  uint8_t *buf,
-                                  int64_t pos,
-                                  size_t size)
+static ssize_t channel_read_buffer(QIOChannel *ioc,
+                                   uint8_t *buf,
+                                   size_t size,
+                                   int **fds,
+                                   size_t *nfds)
 {
-    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = buf, .iov_len = size };
     ssize_t ret;
 
     do {
-        ret = qio_channel_read(ioc, (char *)buf, size, NULL);
+        ret = qio_channel_readv_full(ioc, &iov, 1, fds, nfds, NULL);
         if (ret < 0) {
             if (ret == QIO_CHANNEL_ERR_BLOCK) {
                 if (qemu_in_coroutine()) {
@@ -100,6 +101,58 @@ static ssize_t channel_get_buffer(void *opaque,
 }
 
 
+static ssize_t channel_get_buffer(void *opaque,
+                                  uint8_t *buf,
+                                  int64_t pos,
+                                  size_t size)
+{
+    return channel_read_buffer(QIO_CHANNEL(opaque), buf, size, NULL, NULL);
+}
+
+
+static ssize_t channel_get_buffer_fds(void *opaque,
+                                      uint8_t *buf,
+                                      int64_t pos,
+                                      size_t size,
+                                      int **fds,
+                                      size_t *nfds)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        return channel_read_buffer(ioc, buf, size, NULL, NULL);
+    }
+    return channel_read_buffer(ioc, buf, size, fds, nfds);
+}
+
+
+static ssize_t channel_put_fd(void *opaque,
+                              uint8_t byte,
+                              int fd)
+{
+    QIOChannel *ioc = QIO_CHANNEL(opaque);
+    struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+    ssize_t len;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS)) {
+        return -ENOTSUP;
+    }
+
+    do {
+        len = qio_channel_writev_full(ioc, &iov, 1, &fd, 1, NULL);
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            if (qemu_in_coroutine()) {
+                qio_channel_yield(ioc, G_IO_OUT);
+            } else {
+                qio_channel_wait(ioc, G_IO_OUT);
+            }
+        }
+    } while (len == QIO_CHANNEL_ERR_BLOCK);
+
+    return len < 0 ? -EIO : len;
+}
+
+
 static int channel_close(void *opaque)
 {
     QIOChannel *ioc = QIO_CHANNEL(opaque);
@@ -161,6 +214,7 @@ static QEMUFile *channel_get_output_return_path(void *opaque)
 
 static const QEMUFileOps channel_input_ops = {
     .get_buffer = channel_get_buffer,
+    .get_buffer_fds = channel_get_buffer_fds,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
@@ -170,6 +224,7 @@ static const QEMUFileOps channel_input_ops = {
 
 static const QEMUFileOps channel_output_ops = {
     .writev_buffer = channel_writev_buffer,
+    .put_fd = channel_put_fd,
     .close = channel_close,
     .shut_down = channel_shutdown,
     .set_blocking = channel_set_blocking,
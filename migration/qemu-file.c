@@ -51,9 +51,15 @@ struct QEMUFile {
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
 
+    /* file descriptors received with the data, not yet taken */
+    GQueue *fds;
+
     int last_error;
 };
 
+/* Data byte that carries a file descriptor in the stream */
+#define QEMU_FILE_FD_MARKER 0x46
+
 /*
  * Stop a file from being read/written - not all backing files can do this
  * typically only sockets can.
@@ -294,8 +300,23 @@ static ssize_t qemu_fill_buffer(QEMUFile *f)
     f->buf_index = 0;
     f->buf_size = pending;
 
-    len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
-                        IO_BUF_SIZE - pending);
+    if (f->ops->get_buffer_fds) {
+        int *fds = NULL;
+        size_t nfds = 0, i;
+
+        len = f->ops->get_buffer_fds(f->opaque, f->buf + pending, f->pos,
+                                     IO_BUF_SIZE - pending, &fds, &nfds);
+        if (nfds && !f->fds) {
+            f->fds = g_queue_new();
+        }
+        for (i = 0; i < nfds; i++) {
+            g_queue_push_tail(f->fds, GINT_TO_POINTER(fds[i]));
+        }
+        g_free(fds);
+    } else {
+        len = f->ops->get_buffer(f->opaque, f->buf + pending, f->pos,
+                                 IO_BUF_SIZE - pending);
+    }
     if (len > 0) {
         f->buf_size += len;
         f->pos += len;
@@ -339,6 +360,12 @@ int qemu_fclose(QEMUFile *f)
     if (f->last_error) {
         ret = f->last_error;
     }
+    if (f->fds) {
+        while (!g_queue_is_empty(f->fds)) {
+            close(GPOINTER_TO_INT(g_queue_pop_head(f->fds)));
+        }
+        g_queue_free(f->fds);
+    }
     g_free(f);
     trace_qemu_file_fclose();
     return ret;
@@ -775,6 +802,59 @@ void qemu_put_counted_string(QEMUFile *f, const char *str)
     qemu_put_buffer(f, (const uint8_t *)str, len);
 }
 
+/*
+ * Send a file descriptor in the stream, to be picked up by
+ * qemu_file_get_fd() on the other side.  Only some transports,
+ * like UNIX sockets, can do this.
+ *
+ * Returns 0 on success, a negative errno value otherwise
+ */
+int qemu_file_put_fd(QEMUFile *f, int fd)
+{
+    ssize_t ret;
+
+    if (!f->ops->put_fd) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+
+    /* The descriptor goes with the next byte, so everything before it first */
+    qemu_fflush(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    ret = f->ops->put_fd(f->opaque, QEMU_FILE_FD_MARKER, fd);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+    f->pos += ret;
+    f->bytes_xfer += ret;
+    return 0;
+}
+
+/*
+ * Receive a file descriptor sent with qemu_file_put_fd().
+ *
+ * Returns the file descriptor, now owned by the caller, or -1 on error
+ */
+int qemu_file_get_fd(QEMUFile *f)
+{
+    if (qemu_get_byte(f) != QEMU_FILE_FD_MARKER) {
+        qemu_file_set_error(f, -EINVAL);
+        return -1;
+    }
+
+    /* The marker was read, so the descriptor that came with it was too */
+    if (!f->fds || g_queue_is_empty(f->fds)) {
+        qemu_file_set_error(f, -EINVAL);
+        return -1;
+    }
+    return GPOINTER_TO_INT(g_queue_pop_head(f->fds));
+}
+
 /*
  * Set the blocking state of the QEMUFile.
  * Note: On some transports the OS only keeps a single blocking state for
@@ -34,6 +34,14 @@
 typedef ssize_t (QEMUFileGetBufferFunc)(void *opaque, uint8_t *buf,
                                         int64_t pos, size_t size);
 
+/*
+ * Like QEMUFileGetBufferFunc, but also returns the file descriptors that
+ * were received with the data, in a newly allocated array of @nfds entries.
+ */
+typedef ssize_t (QEMUFileGetBufferFdsFunc)(void *opaque, uint8_t *buf,
+                                           int64_t pos, size_t size,
+                                           int **fds, size_t *nfds);
+
 /* Close a file
  *
  * Return negative error number on error, 0 or positive value on success.
@@ -58,6 +66,12 @@ typedef int (QEMUFileSetBlocking)(void *opaque, bool enabled);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Send the file descriptor @fd along with the single byte @byte.  Returns
+ * the number of bytes written or a negative errno value.
+ */
+typedef ssize_t (QEMUFilePutFdFunc)(void *opaque, uint8_t byte, int fd);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -101,9 +115,11 @@ typedef int (QEMUFileShutdownFunc)(void *opaque, bool rd, bool wr);
 
 typedef struct QEMUFileOps {
     QEMUFileGetBufferFunc *get_buffer;
+    QEMUFileGetBufferFdsFunc *get_buffer_fds;
     QEMUFileCloseFunc *close;
     QEMUFileSetBlocking *set_blocking;
     QEMUFileWritevBufferFunc *writev_buffer;
+    QEMUFilePutFdFunc *put_fd;
     QEMURetPathFunc *get_return_path;
     QEMUFileShutdownFunc *shut_down;
 } QEMUFileOps;
@@ -129,6 +145,8 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
                            bool may_free);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
+int qemu_file_put_fd(QEMUFile *f, int fd);
+int qemu_file_get_fd(QEMUFile *f);
 
 #include "migration/qemu-file-types.h"
 
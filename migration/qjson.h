@@ -17,6 +17,7 @@ QJSON *qjson_new(void);
 void qjson_destroy(QJSON *json);
 void json_prop_str(QJSON *json, const char *name, const char *str);
 void json_prop_int(QJSON *json, const char *name, int64_t val);
+void json_prop_json(QJSON *json, const char *name, QJSON *value);
 void json_end_array(QJSON *json);
 void json_start_array(QJSON *json, const char *name);
 void json_end_object(QJSON *json);
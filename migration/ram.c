@@ -29,6 +29,9 @@
 #include "qemu/osdep.h"
 #include "cpu.h"
 #include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "qemu/cutils.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
@@ -100,6 +103,26 @@ static struct {
     uint8_t *decoded_buf;
 } XBZRLE;
 
+/*
+ * XBZRLE is turned off for a region of a RAMBlock when the pages in it
+ * don't encode to less than 3/4 of a page on average.  It stays off for
+ * a number of bitmap syncs that doubles every time the region is found
+ * to encode poorly again.
+ */
+#define XBZRLE_REGION_BITS     9
+#define XBZRLE_SAMPLE_PAGES    32
+#define XBZRLE_MAX_BACKOFF     16
+
+typedef struct XBZRLERegion {
+    /* pages looked up in the cache and their encoded size in this sample */
+    uint32_t pages;
+    uint32_t bytes;
+    /* number of syncs to turn XBZRLE off for, 0 if it is doing well */
+    uint32_t backoff;
+    /* XBZRLE is off for the region until this bitmap sync */
+    uint64_t off_until;
+} XBZRLERegion;
+
 static void XBZRLE_cache_lock(void)
 {
     if (migrate_use_xbzrle())
@@ -310,6 +333,8 @@ struct RAMState {
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Last block sent on the postcopy-preempt channel */
+    RAMBlock *postcopy_last_sent_block;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
@@ -579,10 +604,23 @@ exit:
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
-#define MULTIFD_VERSION 1
+/*
+ * Version 2 packets may carry a zero page bitmap and compressed data, which
+ * version 1 receivers would take for page contents
+ */
+#define MULTIFD_VERSION 2
 
 #define MULTIFD_FLAG_SYNC (1 << 0)
 
+/* compression method of the packet payload, bits 1-2 */
+#define MULTIFD_FLAG_COMPRESSION_MASK (3 << 1)
+#define MULTIFD_FLAG_NOCOMP (0 << 1)
+#define MULTIFD_FLAG_ZLIB (1 << 1)
+#define MULTIFD_FLAG_ZSTD (2 << 1)
+
+/* a bitmap of the zero pages follows the packet, their data is not sent */
+#define MULTIFD_FLAG_ZERO_PAGES (1 << 3)
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -650,8 +688,21 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* bytes written since the migration thread last collected them */
+    uint64_t sent_bytes;
+    /* normal and zero pages sent since the last collection */
+    uint64_t sent_normal;
+    uint64_t sent_zero;
+    /* zero pages of the current packet, one bit per page */
+    uint8_t *zero_bitmap;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* compression stream of this channel */
+    void *compress_data;
+    /* compressed pages of the current packet */
+    uint8_t *zbuf;
+    uint32_t zbuf_len;
+    uint32_t zlen;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -683,8 +734,16 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages of the current packet, one bit per page */
+    uint8_t *zero_bitmap;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
+    /* compression stream of this channel */
+    void *compress_data;
+    /* compressed pages of the current packet */
+    uint8_t *zbuf;
+    uint32_t zbuf_len;
+    uint32_t zlen;
 } MultiFDRecvParams;
 
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
@@ -773,6 +832,338 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
     g_free(pages);
 }
 
+/* Multifd compression methods */
+
+/*
+ * Each channel owns one compression stream for the whole migration, so
+ * that later packets can refer back to the pages sent before them.
+ * Compressed packets are followed by the be32 size of the compressed
+ * data and the data itself instead of the raw pages.
+ */
+typedef struct {
+    /* MULTIFD_FLAG_* value that marks the packets of this method */
+    uint32_t flag;
+    /* set up the stream of a send channel */
+    int (*send_setup)(MultiFDSendParams *p, Error **errp);
+    /* free the stream of a send channel */
+    void (*send_cleanup)(MultiFDSendParams *p);
+    /* compress the pages of the current packet into p->zbuf */
+    int (*send_prepare)(MultiFDSendParams *p, uint32_t used, Error **errp);
+    /* set up the stream of a receive channel */
+    int (*recv_setup)(MultiFDRecvParams *p, Error **errp);
+    /* free the stream of a receive channel */
+    void (*recv_cleanup)(MultiFDRecvParams *p);
+    /* decompress p->zbuf into the pages of the current packet */
+    int (*recv_pages)(MultiFDRecvParams *p, uint32_t used, Error **errp);
+} MultiFDMethods;
+
+static int zlib_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (deflateInit(zs, migrate_compress_level()) != Z_OK) {
+        g_free(zs);
+        error_setg(errp, "multifd %d: deflate init failed", p->id);
+        return -1;
+    }
+    p->compress_data = zs;
+    return 0;
+}
+
+static void zlib_send_cleanup(MultiFDSendParams *p)
+{
+    z_stream *zs = p->compress_data;
+
+    if (zs) {
+        deflateEnd(zs);
+        g_free(zs);
+        p->compress_data = NULL;
+    }
+}
+
+static int zlib_send_prepare(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    z_stream *zs = p->compress_data;
+    uint32_t i;
+    int ret;
+
+    zs->next_out = p->zbuf;
+    zs->avail_out = p->zbuf_len;
+
+    for (i = 0; i < used; i++) {
+        int flush = i == used - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        zs->next_in = p->pages->iov[i].iov_base;
+        zs->avail_in = TARGET_PAGE_SIZE;
+        do {
+            ret = deflate(zs, flush);
+        } while (ret == Z_OK && zs->avail_in && zs->avail_out);
+
+        if (ret != Z_OK) {
+            error_setg(errp, "multifd %d: deflate returned %d", p->id, ret);
+            return -1;
+        }
+        if (!zs->avail_out) {
+            error_setg(errp, "multifd %d: deflate buffer too small", p->id);
+            return -1;
+        }
+    }
+    p->zlen = p->zbuf_len - zs->avail_out;
+    return 0;
+}
+
+static int zlib_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    z_stream *zs = g_new0(z_stream, 1);
+
+    if (inflateInit(zs) != Z_OK) {
+        g_free(zs);
+        error_setg(errp, "multifd %d: inflate init failed", p->id);
+        return -1;
+    }
+    p->compress_data = zs;
+    return 0;
+}
+
+static void zlib_recv_cleanup(MultiFDRecvParams *p)
+{
+    z_stream *zs = p->compress_data;
+
+    if (zs) {
+        inflateEnd(zs);
+        g_free(zs);
+        p->compress_data = NULL;
+    }
+}
+
+static int zlib_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    z_stream *zs = p->compress_data;
+    uint32_t i;
+    int ret;
+
+    zs->next_in = p->zbuf;
+    zs->avail_in = p->zlen;
+
+    for (i = 0; i < used; i++) {
+        zs->next_out = p->pages->iov[i].iov_base;
+        zs->avail_out = TARGET_PAGE_SIZE;
+        do {
+            ret = inflate(zs, Z_SYNC_FLUSH);
+        } while (ret == Z_OK && zs->avail_in && zs->avail_out);
+
+        if (ret != Z_OK) {
+            error_setg(errp, "multifd %d: inflate returned %d", p->id, ret);
+            return -1;
+        }
+        if (zs->avail_out) {
+            error_setg(errp, "multifd %d: packet %" PRIu64 " is truncated",
+                       p->id, p->packet_num);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef CONFIG_ZSTD
+static int zstd_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    ZSTD_CStream *zcs = ZSTD_createCStream();
+    size_t ret;
+
+    if (!zcs) {
+        error_setg(errp, "multifd %d: zstd stream allocation failed", p->id);
+        return -1;
+    }
+    ret = ZSTD_initCStream(zcs, migrate_compress_level());
+    if (ZSTD_isError(ret)) {
+        ZSTD_freeCStream(zcs);
+        error_setg(errp, "multifd %d: zstd init failed: %s", p->id,
+                   ZSTD_getErrorName(ret));
+        return -1;
+    }
+    p->compress_data = zcs;
+    return 0;
+}
+
+static void zstd_send_cleanup(MultiFDSendParams *p)
+{
+    ZSTD_freeCStream(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int zstd_send_prepare(MultiFDSendParams *p, uint32_t used,
+                             Error **errp)
+{
+    ZSTD_outBuffer out = { p->zbuf, p->zbuf_len, 0 };
+    uint32_t i;
+    size_t ret;
+
+    for (i = 0; i < used; i++) {
+        ZSTD_EndDirective end = i == used - 1 ? ZSTD_e_flush
+                                              : ZSTD_e_continue;
+        ZSTD_inBuffer in = { p->pages->iov[i].iov_base, TARGET_PAGE_SIZE, 0 };
+
+        /* with ZSTD_e_flush a positive return means data is still buffered */
+        do {
+            ret = ZSTD_compressStream2(p->compress_data, &out, &in, end);
+        } while (!ZSTD_isError(ret) && out.pos < out.size &&
+                 (in.pos < in.size || (end == ZSTD_e_flush && ret)));
+
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %d: zstd compression failed: %s",
+                       p->id, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        if (in.pos < in.size || (end == ZSTD_e_flush && ret)) {
+            error_setg(errp, "multifd %d: zstd buffer too small", p->id);
+            return -1;
+        }
+    }
+    p->zlen = out.pos;
+    return 0;
+}
+
+static int zstd_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    ZSTD_DStream *zds = ZSTD_createDStream();
+    size_t ret;
+
+    if (!zds) {
+        error_setg(errp, "multifd %d: zstd stream allocation failed", p->id);
+        return -1;
+    }
+    ret = ZSTD_initDStream(zds);
+    if (ZSTD_isError(ret)) {
+        ZSTD_freeDStream(zds);
+        error_setg(errp, "multifd %d: zstd init failed: %s", p->id,
+                   ZSTD_getErrorName(ret));
+        return -1;
+    }
+    p->compress_data = zds;
+    return 0;
+}
+
+static void zstd_recv_cleanup(MultiFDRecvParams *p)
+{
+    ZSTD_freeDStream(p->compress_data);
+    p->compress_data = NULL;
+}
+
+static int zstd_recv_pages(MultiFDRecvParams *p, uint32_t used, Error **errp)
+{
+    ZSTD_inBuffer in = { p->zbuf, p->zlen, 0 };
+    uint32_t i;
+    size_t ret;
+
+    for (i = 0; i < used; i++) {
+        ZSTD_outBuffer out = { p->pages->iov[i].iov_base, TARGET_PAGE_SIZE, 0 };
+
+        while (out.pos < out.size) {
+            size_t in_pos = in.pos, out_pos = out.pos;
+
+            ret = ZSTD_decompressStream(p->compress_data, &out, &in);
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "multifd %d: zstd decompression failed: %s",
+                           p->id, ZSTD_getErrorName(ret));
+                return -1;
+            }
+            if (in.pos == in_pos && out.pos == out_pos) {
+                error_setg(errp, "multifd %d: packet %" PRIu64
+                           " is truncated", p->id, p->packet_num);
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+static const MultiFDMethods multifd_methods[MULTIFD_COMPRESSION__MAX] = {
+    [MULTIFD_COMPRESSION_NONE] = {
+        .flag = MULTIFD_FLAG_NOCOMP,
+    },
+    [MULTIFD_COMPRESSION_ZLIB] = {
+        .flag = MULTIFD_FLAG_ZLIB,
+        .send_setup = zlib_send_setup,
+        .send_cleanup = zlib_send_cleanup,
+        .send_prepare = zlib_send_prepare,
+        .recv_setup = zlib_recv_setup,
+        .recv_cleanup = zlib_recv_cleanup,
+        .recv_pages = zlib_recv_pages,
+    },
+#ifdef CONFIG_ZSTD
+    [MULTIFD_COMPRESSION_ZSTD] = {
+        .flag = MULTIFD_FLAG_ZSTD,
+        .send_setup = zstd_send_setup,
+        .send_cleanup = zstd_send_cleanup,
+        .send_prepare = zstd_send_prepare,
+        .recv_setup = zstd_recv_setup,
+        .recv_cleanup = zstd_recv_cleanup,
+        .recv_pages = zstd_recv_pages,
+    },
+#endif
+};
+
+/*
+ * Compressed pages can in theory be larger than the raw ones; leave room
+ * for that and for the stream framing.
+ */
+static uint32_t multifd_zbuf_len(void)
+{
+    return migrate_multifd_page_count() * TARGET_PAGE_SIZE * 2;
+}
+
+static size_t multifd_zero_bitmap_len(uint32_t pages)
+{
+    return DIV_ROUND_UP(pages, 8);
+}
+
+/*
+ * Mark the zero pages of the packet in p->zero_bitmap and move the other
+ * ones to the front of p->pages->iov.  This runs in the channel threads
+ * so that page scanning scales with the number of channels.
+ *
+ * Returns the number of pages whose data has to be sent.
+ */
+static uint32_t multifd_send_zero_scan(MultiFDSendParams *p, uint32_t used)
+{
+    struct iovec *iov = p->pages->iov;
+    uint32_t i, normal = 0;
+
+    memset(p->zero_bitmap, 0, multifd_zero_bitmap_len(used));
+    for (i = 0; i < used; i++) {
+        if (is_zero_range(iov[i].iov_base, TARGET_PAGE_SIZE)) {
+            p->zero_bitmap[i / 8] |= 1 << (i % 8);
+        } else {
+            iov[normal++] = iov[i];
+        }
+    }
+    return normal;
+}
+
+/*
+ * Clear the pages marked in p->zero_bitmap and move the other ones to
+ * the front of p->pages->iov.
+ *
+ * Returns the number of pages whose data follows.
+ */
+static uint32_t multifd_recv_zero_fill(MultiFDRecvParams *p, uint32_t used)
+{
+    struct iovec *iov = p->pages->iov;
+    uint32_t i, normal = 0;
+
+    for (i = 0; i < used; i++) {
+        if (p->zero_bitmap[i / 8] & (1 << (i % 8))) {
+            ram_handle_compressed(iov[i].iov_base, 0, TARGET_PAGE_SIZE);
+        } else {
+            iov[normal++] = iov[i];
+        }
+    }
+    return normal;
+}
+
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
@@ -875,6 +1266,8 @@ struct {
     uint64_t packet_num;
     /* send channels ready */
     QemuSemaphore channels_ready;
+    /* compression method of the channels */
+    const MultiFDMethods *methods;
 } *multifd_send_state;
 
 /*
@@ -895,13 +1288,27 @@ struct {
  * false.
  */
 
+/*
+ * Account what the channel sent since the last call.  Called with
+ * p->mutex held.
+ */
+static void multifd_send_collect(MultiFDSendParams *p)
+{
+    ram_counters.multifd_bytes += p->sent_bytes;
+    ram_counters.transferred += p->sent_bytes;
+    ram_counters.normal += p->sent_normal;
+    ram_counters.duplicate += p->sent_zero;
+    p->sent_bytes = 0;
+    p->sent_normal = 0;
+    p->sent_zero = 0;
+}
+
 static void multifd_send_pages(void)
 {
     int i;
     static int next_channel;
     MultiFDSendParams *p = NULL; /* make happy gcc */
     MultiFDPages_t *pages = multifd_send_state->pages;
-    uint64_t transferred;
 
     qemu_sem_wait(&multifd_send_state->channels_ready);
     for (i = next_channel;; i = (i + 1) % migrate_multifd_channels()) {
@@ -921,9 +1328,8 @@ static void multifd_send_pages(void)
     p->pages->block = NULL;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * TARGET_PAGE_SIZE + p->packet_len;
-    ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    /* what the channel sent for its previous packets */
+    multifd_send_collect(p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 }
@@ -1006,6 +1412,13 @@ void multifd_save_cleanup(void)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        if (multifd_send_state->methods->send_cleanup) {
+            multifd_send_state->methods->send_cleanup(p);
+        }
+        g_free(p->zbuf);
+        p->zbuf = NULL;
+        g_free(p->zero_bitmap);
+        p->zero_bitmap = NULL;
     }
     qemu_sem_destroy(&multifd_send_state->channels_ready);
     qemu_sem_destroy(&multifd_send_state->sem_sync);
@@ -1046,18 +1459,34 @@ static void multifd_send_sync_main(void)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&multifd_send_state->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_collect(p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    const MultiFDMethods *methods = multifd_send_state->methods;
     Error *local_err = NULL;
     int ret;
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
+    if (methods->send_setup) {
+        p->zbuf_len = multifd_zbuf_len();
+        p->zbuf = g_malloc(p->zbuf_len);
+        if (methods->send_setup(p, &local_err) < 0) {
+            goto out;
+        }
+    }
+
     if (multifd_send_initial_packet(p, &local_err) < 0) {
         goto out;
     }
@@ -1071,8 +1500,16 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint32_t used = p->pages->used;
             uint64_t packet_num = p->packet_num;
-            uint32_t flags = p->flags;
-
+            uint32_t flags = p->flags | methods->flag | MULTIFD_FLAG_ZERO_PAGES;
+            struct iovec hdr[] = {
+                { .iov_base = p->packet, .iov_len = p->packet_len },
+                { .iov_base = p->zero_bitmap,
+                  .iov_len = multifd_zero_bitmap_len(used) },
+            };
+            uint64_t written = hdr[0].iov_len + hdr[1].iov_len;
+            uint32_t normal;
+
+            p->flags = flags;
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
@@ -1080,20 +1517,46 @@ static void *multifd_send_thread(void *opaque)
             p->pages->used = 0;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags);
+            normal = multifd_send_zero_scan(p, used);
+
+            trace_multifd_send(p->id, packet_num, used, used - normal, flags);
+
+            if (normal && methods->send_prepare) {
+                ret = methods->send_prepare(p, normal, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+            }
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
+            ret = qio_channel_writev_all(p->c, hdr, ARRAY_SIZE(hdr),
+                                         &local_err);
             if (ret != 0) {
                 break;
             }
 
-            ret = qio_channel_writev_all(p->c, p->pages->iov, used, &local_err);
+            if (normal && methods->send_prepare) {
+                uint32_t zlen = cpu_to_be32(p->zlen);
+                struct iovec iov[] = {
+                    { .iov_base = &zlen, .iov_len = sizeof(zlen) },
+                    { .iov_base = p->zbuf, .iov_len = p->zlen },
+                };
+
+                ret = qio_channel_writev_all(p->c, iov, ARRAY_SIZE(iov),
+                                             &local_err);
+                written += sizeof(zlen) + p->zlen;
+            } else {
+                ret = qio_channel_writev_all(p->c, p->pages->iov, normal,
+                                             &local_err);
+                written += (uint64_t)normal * TARGET_PAGE_SIZE;
+            }
             if (ret != 0) {
                 break;
             }
 
             qemu_mutex_lock(&p->mutex);
+            p->sent_bytes += written;
+            p->sent_normal += normal;
+            p->sent_zero += used - normal;
             p->pending_job--;
             qemu_mutex_unlock(&p->mutex);
 
@@ -1159,6 +1622,8 @@ int multifd_save_setup(void)
     multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
     atomic_set(&multifd_send_state->count, 0);
     multifd_send_state->pages = multifd_pages_init(page_count);
+    multifd_send_state->methods =
+        &multifd_methods[migrate_multifd_compression()];
     qemu_sem_init(&multifd_send_state->sem_sync, 0);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
 
@@ -1175,6 +1640,7 @@ int multifd_save_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        p->zero_bitmap = g_malloc0(multifd_zero_bitmap_len(page_count));
         p->name = g_strdup_printf("multifdsend_%d", i);
         socket_send_channel_create(multifd_new_send_channel_async, p);
     }
@@ -1189,6 +1655,8 @@ struct {
     QemuSemaphore sem_sync;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* compression method of the channels */
+    const MultiFDMethods *methods;
 } *multifd_recv_state;
 
 static void multifd_recv_terminate_threads(Error *err)
@@ -1244,6 +1712,13 @@ int multifd_load_cleanup(Error **errp)
         p->packet_len = 0;
         g_free(p->packet);
         p->packet = NULL;
+        if (multifd_recv_state->methods->recv_cleanup) {
+            multifd_recv_state->methods->recv_cleanup(p);
+        }
+        g_free(p->zbuf);
+        p->zbuf = NULL;
+        g_free(p->zero_bitmap);
+        p->zero_bitmap = NULL;
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
     g_free(multifd_recv_state->params);
@@ -1284,14 +1759,24 @@ static void multifd_recv_sync_main(void)
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
+    const MultiFDMethods *methods = multifd_recv_state->methods;
     Error *local_err = NULL;
     int ret;
 
     trace_multifd_recv_thread_start(p->id);
     rcu_register_thread();
 
+    if (methods->recv_setup) {
+        p->zbuf_len = multifd_zbuf_len();
+        p->zbuf = g_malloc(p->zbuf_len);
+        if (methods->recv_setup(p, &local_err) < 0) {
+            goto out;
+        }
+    }
+
     while (true) {
         uint32_t used;
+        uint32_t normal;
         uint32_t flags;
 
         ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
@@ -1317,7 +1802,49 @@ static void *multifd_recv_thread(void *opaque)
         p->num_pages += used;
         qemu_mutex_unlock(&p->mutex);
 
-        ret = qio_channel_readv_all(p->c, p->pages->iov, used, &local_err);
+        /* both sides have to be set up with the same compression method */
+        if ((flags & MULTIFD_FLAG_COMPRESSION_MASK) != methods->flag) {
+            error_setg(&local_err, "multifd %d: received packet flags 0x%x "
+                       "but expected compression method %s", p->id, flags,
+                       MultiFDCompression_str(methods - multifd_methods));
+            break;
+        }
+
+        normal = used;
+        if (used && (flags & MULTIFD_FLAG_ZERO_PAGES)) {
+            ret = qio_channel_read_all(p->c, (void *)p->zero_bitmap,
+                                       multifd_zero_bitmap_len(used),
+                                       &local_err);
+            if (ret != 0) {
+                break;
+            }
+            normal = multifd_recv_zero_fill(p, used);
+        }
+
+        if (normal && methods->recv_pages) {
+            uint32_t zlen;
+
+            ret = qio_channel_read_all(p->c, (void *)&zlen, sizeof(zlen),
+                                       &local_err);
+            if (ret != 0) {
+                break;
+            }
+            p->zlen = be32_to_cpu(zlen);
+            if (p->zlen > p->zbuf_len) {
+                error_setg(&local_err, "multifd %d: compressed packet size %u"
+                           " larger than %u", p->id, p->zlen, p->zbuf_len);
+                break;
+            }
+            ret = qio_channel_read_all(p->c, (void *)p->zbuf, p->zlen,
+                                       &local_err);
+            if (ret != 0) {
+                break;
+            }
+            ret = methods->recv_pages(p, normal, &local_err);
+        } else {
+            ret = qio_channel_readv_all(p->c, p->pages->iov, normal,
+                                        &local_err);
+        }
         if (ret != 0) {
             break;
         }
@@ -1328,6 +1855,7 @@ static void *multifd_recv_thread(void *opaque)
         }
     }
 
+out:
     if (local_err) {
         multifd_recv_terminate_threads(local_err);
     }
@@ -1354,6 +1882,8 @@ int multifd_load_setup(void)
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
     atomic_set(&multifd_recv_state->count, 0);
+    multifd_recv_state->methods =
+        &multifd_methods[migrate_multifd_compression()];
     qemu_sem_init(&multifd_recv_state->sem_sync, 0);
 
     for (i = 0; i < thread_count; i++) {
@@ -1366,6 +1896,7 @@ int multifd_load_setup(void)
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(ram_addr_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
+        p->zero_bitmap = g_malloc0(multifd_zero_bitmap_len(page_count));
         p->name = g_strdup_printf("multifdrecv_%d", i);
     }
     return 0;
@@ -1508,6 +2039,61 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
                  ram_counters.dirty_sync_count);
 }
 
+static XBZRLERegion *xbzrle_get_region(RAMBlock *block, ram_addr_t offset)
+{
+    return &block->xbzrle_regions[offset >> (TARGET_PAGE_BITS +
+                                             XBZRLE_REGION_BITS)];
+}
+
+/**
+ * xbzrle_region_enabled: check whether XBZRLE is worth trying for a page
+ *
+ * Returns false if the region of the page has been encoding poorly
+ *
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ */
+static bool xbzrle_region_enabled(RAMBlock *block, ram_addr_t offset)
+{
+    XBZRLERegion *region = xbzrle_get_region(block, offset);
+
+    return region->off_until <= ram_counters.dirty_sync_count;
+}
+
+/**
+ * xbzrle_region_account: account the encoded size of a cached page
+ *
+ * Turns XBZRLE off for the region of the page once a sample shows that
+ * delta encoding doesn't save enough bandwidth there.
+ *
+ * @block: block that contains the page
+ * @offset: offset inside the block for the page
+ * @encoded_len: size of the delta, TARGET_PAGE_SIZE on overflow
+ */
+static void xbzrle_region_account(RAMBlock *block, ram_addr_t offset,
+                                  int encoded_len)
+{
+    XBZRLERegion *region = xbzrle_get_region(block, offset);
+
+    region->pages++;
+    region->bytes += encoded_len;
+    if (region->pages < XBZRLE_SAMPLE_PAGES) {
+        return;
+    }
+
+    if ((uint64_t)region->bytes * 4 >
+        (uint64_t)region->pages * TARGET_PAGE_SIZE * 3) {
+        region->backoff = region->backoff ?
+                          MIN(region->backoff * 2, XBZRLE_MAX_BACKOFF) : 1;
+        region->off_until = ram_counters.dirty_sync_count + region->backoff;
+        trace_xbzrle_region_off(block->idstr, offset, region->off_until);
+    } else {
+        region->backoff = 0;
+    }
+    region->pages = 0;
+    region->bytes = 0;
+}
+
 #define ENCODING_FLAG_XBZRLE 0x1
 
 /**
@@ -1534,6 +2120,15 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
+        /*
+         * Only let pages that were dirtied before push others out of the
+         * cache, pages written once would just thrash it.
+         */
+        if (!test_and_set_bit(offset >> TARGET_PAGE_BITS,
+                              block->xbzrle_hotmap) &&
+            cache_set_is_full(XBZRLE.cache, current_addr)) {
+            return -1;
+        }
         if (!last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
                              ram_counters.dirty_sync_count) == -1) {
@@ -1556,6 +2151,8 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     encoded_len = xbzrle_encode_buffer(prev_cached_page, XBZRLE.current_buf,
                                        TARGET_PAGE_SIZE, XBZRLE.encoded_buf,
                                        TARGET_PAGE_SIZE);
+    xbzrle_region_account(block, offset,
+                          encoded_len == -1 ? TARGET_PAGE_SIZE : encoded_len);
     if (encoded_len == 0) {
         trace_save_xbzrle_page_skipping();
         return 0;
@@ -1720,10 +2317,11 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
 static void migration_bitmap_sync(RAMState *rs)
 {
     RAMBlock *block;
-    int64_t end_time;
+    int64_t start_ns, end_time;
     uint64_t bytes_xfer_now;
 
     ram_counters.dirty_sync_count++;
+    start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
     if (!rs->time_last_bitmap_sync) {
         rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -1743,6 +2341,8 @@ static void migration_bitmap_sync(RAMState *rs)
 
     trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
 
+    ram_counters.dirty_sync_time =
+        (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns) / SCALE_US;
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
     /* more than 1 second = 1000 millisecons */
@@ -1950,13 +2550,20 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
     XBZRLE_cache_lock();
     if (!rs->ram_bulk_stage && !migration_in_postcopy() &&
         migrate_use_xbzrle()) {
-        pages = save_xbzrle_page(rs, &p, current_addr, block,
-                                 offset, last_stage);
-        if (!last_stage) {
-            /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
-             */
-            send_async = false;
+        if (xbzrle_region_enabled(block, offset)) {
+            pages = save_xbzrle_page(rs, &p, current_addr, block,
+                                     offset, last_stage);
+            if (!last_stage) {
+                /*
+                 * Can't send this cached data async, since the cache page
+                 * might get updated before it gets to the wire
+                 */
+                send_async = false;
+            }
+        } else {
+            /* The cached copy goes stale once the page is sent in full */
+            cache_remove(XBZRLE.cache, current_addr);
+            xbzrle_counters.skipped++;
         }
     }
 
@@ -1973,8 +2580,8 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
+    /* the channel accounts the page as normal or zero once it is sent */
     multifd_queue_page(block, offset);
-    ram_counters.normal++;
 
     return 1;
 }
@@ -2427,6 +3034,15 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Multifd channels look for zero pages themselves.  Do not use
+     * multifd for compression as the first page in the new block should
+     * be posted out before sending the compressed page.
+     */
+    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2441,14 +3057,6 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * do not use multifd for compression as the first page in the new
-     * block should be posted out before sending the compressed page
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()) {
-        return ram_save_multifd_page(rs, block, offset);
-    }
-
     return ram_save_page(rs, pss, last_stage);
 }
 
@@ -2508,6 +3116,73 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     return pages;
 }
 
+/*
+ * Mark the pages [@start, @last] of @rb dirty again, so that a host page
+ * whose send on the postcopy-preempt channel failed goes out once more
+ */
+static void postcopy_preempt_requeue(RAMState *rs, RAMBlock *rb,
+                                     unsigned long start, unsigned long last)
+{
+    unsigned long page;
+
+    qemu_mutex_lock(&rs->bitmap_mutex);
+    for (page = start; page <= last; page++) {
+        if (!test_and_set_bit(page, rb->bmap)) {
+            rs->migration_dirty_pages++;
+        }
+    }
+    qemu_mutex_unlock(&rs->bitmap_mutex);
+}
+
+/**
+ * postcopy_preempt_save_host_page: send a page the destination faulted on
+ *
+ * The page goes out on the postcopy-preempt channel, so that it doesn't
+ * queue behind the background pages, and is flushed right away.  The
+ * destination reads the two channels independently, so each one has its
+ * own last sent RAMBlock.  If the channel broke, the page is marked dirty
+ * again and sent on the main stream.
+ *
+ * Returns the number of pages written, as ram_save_host_page()
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ * @last_stage: if we are at the completion stage
+ */
+static int postcopy_preempt_save_host_page(RAMState *rs,
+                                           PageSearchStatus *pss,
+                                           bool last_stage)
+{
+    QEMUFile *f = migrate_get_current()->postcopy_qemufile_src;
+    QEMUFile *main_f = rs->f;
+    RAMBlock *main_block = rs->last_sent_block;
+    unsigned long start_page = pss->page;
+    int pages;
+
+    if (!f || qemu_file_get_error(f)) {
+        return ram_save_host_page(rs, pss, last_stage);
+    }
+
+    rs->f = f;
+    rs->last_sent_block = rs->postcopy_last_sent_block;
+    pages = ram_save_host_page(rs, pss, last_stage);
+    qemu_fflush(f);
+    rs->postcopy_last_sent_block = rs->last_sent_block;
+    rs->f = main_f;
+    rs->last_sent_block = main_block;
+
+    trace_postcopy_preempt_save_host_page(pss->block->idstr,
+                                          (uint64_t)pss->page, pages);
+    if (qemu_file_get_error(f)) {
+        warn_report("postcopy-preempt channel failed (%d), using the main "
+                    "stream", qemu_file_get_error(f));
+        postcopy_preempt_requeue(rs, pss->block, start_page, pss->page);
+        pss->page = start_page;
+        return ram_save_host_page(rs, pss, last_stage);
+    }
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2522,12 +3197,11 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
  * On systems where host-page-size > target-page-size it will send all the
  * pages in a host page that are dirty.
  */
-
 static int ram_find_and_save_block(RAMState *rs, bool last_stage)
 {
     PageSearchStatus pss;
     int pages = 0;
-    bool again, found;
+    bool again, found, urgent;
 
     /* No dirty page as there is zero RAM */
     if (!ram_bytes_total()) {
@@ -2545,13 +3219,17 @@ static int ram_find_and_save_block(RAMState *rs, bool last_stage)
     do {
         again = true;
         found = get_queued_page(rs, &pss);
+        urgent = found && migrate_postcopy_preempt() &&
+                 migration_in_postcopy();
 
         if (!found) {
             /* priority queue empty, so just search for something dirty */
             found = find_dirty_block(rs, &pss, &again);
         }
 
-        if (found) {
+        if (urgent) {
+            pages = postcopy_preempt_save_host_page(rs, &pss, last_stage);
+        } else if (found) {
             pages = ram_save_host_page(rs, &pss, last_stage);
         }
     } while (!pages && again);
@@ -2645,13 +3323,17 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against this migration_bitmap
      */
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
         g_free(block->unsentmap);
         block->unsentmap = NULL;
+        g_free(block->xbzrle_hotmap);
+        block->xbzrle_hotmap = NULL;
+        g_free(block->xbzrle_regions);
+        block->xbzrle_regions = NULL;
     }
 
     xbzrle_cleanup();
@@ -2663,6 +3345,7 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    rs->postcopy_last_sent_block = NULL;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->ram_bulk_stage = true;
@@ -3171,6 +3854,12 @@ static void ram_list_init_bitmaps(void)
                 block->unsentmap = bitmap_new(pages);
                 bitmap_set(block->unsentmap, 0, pages);
             }
+            if (migrate_use_xbzrle()) {
+                block->xbzrle_hotmap = bitmap_new(pages);
+                block->xbzrle_regions =
+                    g_new0(XBZRLERegion,
+                           DIV_ROUND_UP(pages, 1UL << XBZRLE_REGION_BITS));
+            }
         }
     }
 }
@@ -3183,7 +3872,7 @@ static void ram_init_bitmaps(RAMState *rs)
     rcu_read_lock();
 
     ram_list_init_bitmaps();
-    memory_global_dirty_log_start();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     migration_bitmap_sync_precopy(rs);
 
     rcu_read_unlock();
@@ -3289,6 +3978,38 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/**
+ * ram_save_shared_fd: hand the memory of an ignored block to the destination
+ *
+ * With x-ignore-shared-fds the destination maps the file behind each
+ * shared RAMBlock instead of its own, so the block needs an fd.
+ *
+ * Returns 0 on success, negative errno value otherwise
+ *
+ * @f: QEMUFile where to send the fd, must be a UNIX socket
+ * @block: the ignored RAMBlock
+ */
+static int ram_save_shared_fd(QEMUFile *f, RAMBlock *block)
+{
+    int ret;
+
+    if (block->fd < 0) {
+        error_report("RAM block %s is shared but not backed by a file, "
+                     "it can't be passed with x-ignore-shared-fds",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    ret = qemu_file_put_fd(f, block->fd);
+    if (ret) {
+        error_report("Failed to pass the file of RAM block %s: %s",
+                     block->idstr, strerror(-ret));
+        return ret;
+    }
+    trace_ram_save_shared_fd(block->idstr, block->fd);
+    return 0;
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -3308,6 +4029,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    int ret;
 
     if (compress_threads_save_setup()) {
         return -1;
@@ -3336,6 +4058,13 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         if (migrate_ignore_shared()) {
             qemu_put_be64(f, block->mr->addr);
             qemu_put_byte(f, ramblock_is_ignored(block) ? 1 : 0);
+            if (migrate_ignore_shared_fds() && ramblock_is_ignored(block)) {
+                ret = ram_save_shared_fd(f, block);
+                if (ret) {
+                    rcu_read_unlock();
+                    return ret;
+                }
+            }
         }
     }
 
@@ -3492,6 +4221,16 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     rcu_read_unlock();
 
     multifd_send_sync_main();
+
+    if (migrate_postcopy_preempt() && migration_in_postcopy() &&
+        migrate_get_current()->postcopy_qemufile_src) {
+        /* Let the destination's preempt thread quit */
+        QEMUFile *pf = migrate_get_current()->postcopy_qemufile_src;
+
+        qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+        qemu_fflush(pf);
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
     qemu_fflush(f);
 
@@ -3571,9 +4310,11 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3600,6 +4341,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    mis->last_recv_block[channel] = block;
     return block;
 }
 
@@ -3880,7 +4622,7 @@ int colo_init_ram_cache(void)
     }
     ram_state = g_new0(RAMState, 1);
     ram_state->migration_dirty_pages = 0;
-    memory_global_dirty_log_start();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
 
     return 0;
 
@@ -3902,7 +4644,7 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
-    memory_global_dirty_log_stop();
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
@@ -3984,19 +4726,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy-preempt
+ * thread for the pages the destination faulted on.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_* that @f carries
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = postcopy_get_tmp_page(mis);
+    void *postcopy_host_page = postcopy_get_tmp_page(mis, channel);
     void *last_host = NULL;
     bool all_zero = false;
 
@@ -4025,7 +4769,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         place_needed = false;
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
 
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
@@ -4099,7 +4843,9 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: %#x"
@@ -4182,8 +4928,28 @@ static void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/*
+ * Take over the memory of an ignored block from the source, see
+ * ram_save_shared_fd().  Consumes @fd.
+ */
+static int ram_load_shared_fd(RAMBlock *block, int fd)
+{
+    Error *local_err = NULL;
+    int ret;
+
+    ret = qemu_ram_remap_fd(block, fd, &local_err);
+    if (ret) {
+        error_report_err(local_err);
+        close(fd);
+        return ret;
+    }
+    trace_ram_load_shared_fd(block->idstr, fd);
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     int flags = 0, ret = 0, invalid_flags = 0;
     static uint64_t seq_iter;
     int len = 0;
@@ -4212,7 +4978,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     rcu_read_lock();
 
     if (postcopy_running) {
-        ret = ram_load_postcopy(f);
+        ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
     }
 
     while (!postcopy_running && !ret && !(flags & RAM_SAVE_FLAG_EOS)) {
@@ -4235,7 +5001,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             /*
              * After going into COLO, we should load the Page into colo_cache.
@@ -4314,6 +5081,19 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                                          (uint64_t)block->mr->addr);
                             ret = -EINVAL;
                         }
+                        if (migrate_ignore_shared_fds() && ignored) {
+                            int fd = qemu_file_get_fd(f);
+
+                            if (fd < 0) {
+                                error_report("No file received for RAM "
+                                             "block %s", id);
+                                ret = -EINVAL;
+                            } else if (ret) {
+                                close(fd);
+                            } else {
+                                ret = ram_load_shared_fd(block, fd);
+                            }
+                        }
                     }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
@@ -52,6 +52,7 @@
 #include "qemu/iov.h"
 #include "block/snapshot.h"
 #include "qemu/cutils.h"
+#include "qemu/rcu.h"
 #include "io/channel-buffer.h"
 #include "io/channel-file.h"
 #include "sysemu/replay.h"
@@ -81,6 +82,7 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_BATCH,      /* Device sections loadable in parallel */
     MIG_CMD_MAX
 };
 
@@ -100,6 +102,7 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_BATCH]     = { .len =  4, .name = "DEVICE_BATCH" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -265,6 +268,8 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_X_IGNORE_SHARED_FDS:
+    case MIGRATION_CAPABILITY_X_PARALLEL_DEVICE_STATE:
         return true;
     default:
         return false;
@@ -892,6 +897,85 @@ static void save_section_footer(QEMUFile *f, SaveStateEntry *se)
     }
 }
 
+/*
+ * With x-parallel-device-state, a run of sections that set vmsd->parallel
+ * and share the same priority forms a batch.  The source saves each of
+ * them into its own buffer on a pool of threads, and sends the buffers
+ * in one MIG_CMD_DEVICE_BATCH command:
+ *
+ *   be32 number of sections
+ *   for each section: be32 length, then a complete QEMU_VM_SECTION_FULL
+ *
+ * The destination reads the whole batch and loads the sections on its own
+ * pool.  Sections outside the batch, and batches of another priority, are
+ * never reordered around it, so the priorities still express the
+ * dependencies between devices.
+ */
+typedef struct DeviceStateJob {
+    SaveStateEntry *se;
+    QIOChannelBuffer *bioc;
+    QEMUFile *file;
+    QJSON *vmdesc;
+    int ret;
+} DeviceStateJob;
+
+typedef struct DeviceStateBatch {
+    DeviceStateJob *jobs;
+    int count;
+    /* Index of the next job to hand out, updated atomically */
+    int next;
+    void (*run)(DeviceStateJob *job);
+} DeviceStateBatch;
+
+static void device_state_work(DeviceStateBatch *b)
+{
+    int i;
+
+    while ((i = atomic_fetch_inc(&b->next)) < b->count) {
+        b->run(&b->jobs[i]);
+    }
+}
+
+static void *device_state_thread(void *opaque)
+{
+    DeviceStateBatch *b = opaque;
+
+    rcu_register_thread();
+    device_state_work(b);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * Run all the jobs of @b on up to x-device-state-threads threads,
+ * the calling thread included, and return the first error.
+ */
+static int device_state_run_batch(DeviceStateBatch *b)
+{
+    int nthreads = MIN(migrate_device_state_threads(), b->count) - 1;
+    QemuThread *threads = g_new(QemuThread, nthreads);
+    int i;
+
+    trace_device_state_run_batch(b->count, nthreads + 1);
+    b->next = 0;
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "devstate", device_state_thread, b,
+                           QEMU_THREAD_JOINABLE);
+    }
+    device_state_work(b);
+    for (i = 0; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+
+    for (i = 0; i < b->count; i++) {
+        if (b->jobs[i].ret < 0) {
+            return b->jobs[i].ret;
+        }
+    }
+    return 0;
+}
+
 /**
  * qemu_savevm_command_send: Send a 'QEMU_VM_COMMAND' type element with the
  *                           command and associated data.
@@ -1248,12 +1332,109 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
+/*
+ * Write the QEMU_VM_SECTION_FULL for @se, and its properties as a member of
+ * the "devices" array of the vmdesc.
+ */
+static int savevm_section_full(QEMUFile *f, SaveStateEntry *se,
+                               QJSON *vmdesc)
+{
+    int ret;
+
+    trace_savevm_section_start(se->idstr, se->section_id);
+
+    json_prop_str(vmdesc, "name", se->idstr);
+    json_prop_int(vmdesc, "instance_id", se->instance_id);
+
+    save_section_header(f, se, QEMU_VM_SECTION_FULL);
+    ret = vmstate_save(f, se, vmdesc);
+    if (ret) {
+        return ret;
+    }
+    trace_savevm_section_end(se->idstr, se->section_id, 0);
+    save_section_footer(f, se);
+    return 0;
+}
+
+static void savevm_device_state_job(DeviceStateJob *job)
+{
+    job->vmdesc = qjson_new();
+    job->ret = savevm_section_full(job->file, job->se, job->vmdesc);
+    qjson_finish(job->vmdesc);
+    qemu_fflush(job->file);
+    if (!job->ret) {
+        job->ret = qemu_file_get_error(job->file);
+    }
+}
+
+/*
+ * Save the sections in @batch, emptying it.  A single section goes
+ * straight into @f; more are serialized in parallel and sent as a
+ * MIG_CMD_DEVICE_BATCH.
+ */
+static int qemu_savevm_device_batch(QEMUFile *f, GPtrArray *batch,
+                                    QJSON *vmdesc)
+{
+    DeviceStateBatch b = {
+        .count = batch->len,
+        .run = savevm_device_state_job,
+    };
+    uint32_t tmp;
+    int i, ret;
+
+    if (batch->len == 0) {
+        return 0;
+    }
+    if (batch->len == 1) {
+        json_start_object(vmdesc, NULL);
+        ret = savevm_section_full(f, g_ptr_array_index(batch, 0), vmdesc);
+        json_end_object(vmdesc);
+        g_ptr_array_set_size(batch, 0);
+        return ret;
+    }
+
+    b.jobs = g_new0(DeviceStateJob, b.count);
+    for (i = 0; i < b.count; i++) {
+        b.jobs[i].se = g_ptr_array_index(batch, i);
+        b.jobs[i].bioc = qio_channel_buffer_new(4096);
+        qio_channel_set_name(QIO_CHANNEL(b.jobs[i].bioc),
+                             "migration-device-state-buffer");
+        b.jobs[i].file = qemu_fopen_channel_output(QIO_CHANNEL(b.jobs[i].bioc));
+    }
+
+    ret = device_state_run_batch(&b);
+    if (!ret) {
+        tmp = cpu_to_be32(b.count);
+        qemu_savevm_command_send(f, MIG_CMD_DEVICE_BATCH, 4, (uint8_t *)&tmp);
+        for (i = 0; i < b.count; i++) {
+            QIOChannelBuffer *bioc = b.jobs[i].bioc;
+
+            qemu_put_be32(f, bioc->usage);
+            qemu_put_buffer(f, bioc->data, bioc->usage);
+            json_prop_json(vmdesc, NULL, b.jobs[i].vmdesc);
+        }
+        migrate_get_current()->device_state_batches++;
+    }
+
+    for (i = 0; i < b.count; i++) {
+        qemu_fclose(b.jobs[i].file);
+        object_unref(OBJECT(b.jobs[i].bioc));
+        qjson_destroy(b.jobs[i].vmdesc);
+    }
+    g_free(b.jobs);
+    g_ptr_array_set_size(batch, 0);
+    return ret;
+}
+
 int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
                                        bool inactivate_disks)
 {
     QJSON *vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
+    GPtrArray *batch;
+    bool parallel = migrate_parallel_device_state();
+    bool in_batch;
     int ret;
     bool in_postcopy = migration_in_postcopy();
     Error *local_err = NULL;
@@ -1300,6 +1481,7 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     vmdesc = qjson_new();
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
+    batch = g_ptr_array_new();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
@@ -1310,22 +1492,34 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
             continue;
         }
 
-        trace_savevm_section_start(se->idstr, se->section_id);
+        in_batch = parallel && se->vmsd && se->vmsd->parallel;
+        if (batch->len &&
+            (!in_batch || save_state_priority(se) !=
+             save_state_priority(g_ptr_array_index(batch, 0)))) {
+            ret = qemu_savevm_device_batch(f, batch, vmdesc);
+            if (ret) {
+                goto out_batch;
+            }
+        }
+        if (in_batch) {
+            g_ptr_array_add(batch, se);
+            continue;
+        }
 
         json_start_object(vmdesc, NULL);
-        json_prop_str(vmdesc, "name", se->idstr);
-        json_prop_int(vmdesc, "instance_id", se->instance_id);
-
-        save_section_header(f, se, QEMU_VM_SECTION_FULL);
-        ret = vmstate_save(f, se, vmdesc);
+        ret = savevm_section_full(f, se, vmdesc);
+        json_end_object(vmdesc);
         if (ret) {
-            qemu_file_set_error(f, ret);
-            return ret;
+            goto out_batch;
         }
-        trace_savevm_section_end(se->idstr, se->section_id, 0);
-        save_section_footer(f, se);
-
-        json_end_object(vmdesc);
+    }
+    ret = qemu_savevm_device_batch(f, batch, vmdesc);
+out_batch:
+    g_ptr_array_free(batch, true);
+    if (ret) {
+        qemu_file_set_error(f, ret);
+        qjson_destroy(vmdesc);
+        return ret;
     }
 
     if (inactivate_disks) {
@@ -1838,6 +2032,11 @@ static int loadvm_postcopy_handle_listen(MigrationIncomingState *mis)
     qemu_sem_wait(&mis->listen_thread_sem);
     qemu_sem_destroy(&mis->listen_thread_sem);
 
+    /* Urgent pages may now arrive on the preempt channel as well */
+    if (mis->postcopy_qemufile_dst) {
+        postcopy_preempt_thread_start(mis);
+    }
+
     return 0;
 }
 
@@ -2033,6 +2232,92 @@ static int loadvm_process_enable_colo(MigrationIncomingState *mis)
     return colo_init_ram_cache();
 }
 
+static int
+qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis);
+
+static void loadvm_device_state_job(DeviceStateJob *job)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint8_t section_type;
+
+    section_type = qemu_get_byte(job->file);
+    if (section_type != QEMU_VM_SECTION_FULL) {
+        error_report("Unexpected section type %d in device batch",
+                     section_type);
+        job->ret = -EINVAL;
+        return;
+    }
+    job->ret = qemu_loadvm_section_start_full(job->file, mis);
+}
+
+/*
+ * Read the sections of a MIG_CMD_DEVICE_BATCH into buffers and load them
+ * on the device state threads.
+ */
+static int loadvm_handle_device_batch(QEMUFile *f)
+{
+    DeviceStateBatch b = {
+        .run = loadvm_device_state_job,
+    };
+    uint32_t count, length;
+    size_t total = 0;
+    int i, ret;
+
+    count = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    trace_loadvm_handle_device_batch(count);
+
+    /* There can't be more sections than registered handlers */
+    if (count == 0 || count > savevm_state.global_section_id) {
+        error_report("CMD_DEVICE_BATCH: bad number of sections: %u", count);
+        return -EINVAL;
+    }
+
+    b.jobs = g_new0(DeviceStateJob, count);
+    for (b.count = 0; b.count < count; b.count++) {
+        DeviceStateJob *job = &b.jobs[b.count];
+
+        length = qemu_get_be32(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            goto out;
+        }
+        /* The whole batch is bounded like a single packaged command */
+        if (length > MAX_VM_CMD_PACKAGED_SIZE - total) {
+            error_report("Unreasonably large device state batch: %zu + %u",
+                         total, length);
+            ret = -EINVAL;
+            goto out;
+        }
+        total += length;
+        job->bioc = qio_channel_buffer_new(length);
+        qio_channel_set_name(QIO_CHANNEL(job->bioc),
+                             "migration-device-state-buffer");
+        if (qemu_get_buffer(f, job->bioc->data, length) != length) {
+            error_report("CMD_DEVICE_BATCH: Buffer receive fail length=%u",
+                         length);
+            ret = qemu_file_get_error(f) ?: -EINVAL;
+            object_unref(OBJECT(job->bioc));
+            goto out;
+        }
+        job->bioc->usage = length;
+        job->file = qemu_fopen_channel_input(QIO_CHANNEL(job->bioc));
+    }
+
+    ret = device_state_run_batch(&b);
+
+out:
+    for (i = 0; i < b.count; i++) {
+        qemu_fclose(b.jobs[i].file);
+        object_unref(OBJECT(b.jobs[i].bioc));
+    }
+    g_free(b.jobs);
+    return ret;
+}
+
 /*
  * Process an incoming 'QEMU_VM_COMMAND'
  * 0           just a normal return
@@ -2113,6 +2398,9 @@ static int loadvm_process_command(QEMUFile *f)
     case MIG_CMD_RECV_BITMAP:
         return loadvm_handle_recv_bitmap(mis, len);
 
+    case MIG_CMD_DEVICE_BATCH:
+        return loadvm_handle_device_batch(f);
+
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
     }
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,367 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/*
+ * The vectorized encoders only differ in how they find the end of a run.
+ * Given the start of a run, find_diff returns the offset of the first
+ * byte that changed and find_same the offset of the first byte that did
+ * not, or slen if there is none.  Both produce exactly the same stream
+ * as xbzrle_encode_buffer_int.
+ */
+typedef int (*XBZRLEScanFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen);
+
+static inline int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen,
+                                     XBZRLEScanFn find_diff,
+                                     XBZRLEScanFn find_same)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, j;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find_diff(old_buf, new_buf, i, slen);
+        zrun_len = j - i;
+        i = j;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        j = find_same(old_buf, new_buf, i, slen);
+        nzrun_len = j - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = j;
+    }
+
+    return d;
+}
+
+static inline int xbzrle_scan_tail(const uint8_t *old_buf,
+                                   const uint8_t *new_buf,
+                                   int i, int slen, bool same)
+{
+    while (i < slen && (old_buf[i] == new_buf[i]) == same) {
+        i++;
+    }
+    return i;
+}
+
+/*
+ * Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/* Compare 32 bytes at a time, returns a bitmask of the equal bytes */
+static inline uint32_t xbzrle_cmpeq_sse2(const uint8_t *old_buf,
+                                         const uint8_t *new_buf)
+{
+    __m128i o0 = _mm_loadu_si128((const __m128i *)old_buf);
+    __m128i o1 = _mm_loadu_si128((const __m128i *)(old_buf + 16));
+    __m128i n0 = _mm_loadu_si128((const __m128i *)new_buf);
+    __m128i n1 = _mm_loadu_si128((const __m128i *)(new_buf + 16));
+
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(o0, n0)) |
+           ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(o1, n1)) << 16);
+}
+
+static int find_diff_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = xbzrle_cmpeq_sse2(old_buf + i, new_buf + i);
+        if (eq != UINT32_MAX) {
+            return i + cto32(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, true);
+}
+
+static int find_same_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        uint32_t eq = xbzrle_cmpeq_sse2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, false);
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_sse2, find_same_sse2);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/*
+ * As in util/bufferiszero.c, the regions have to be ordered with
+ * increasing ISA.
+ */
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* Compare 64 bytes at a time, returns a bitmask of the equal bytes */
+static inline uint64_t xbzrle_cmpeq_avx2(const uint8_t *old_buf,
+                                         const uint8_t *new_buf)
+{
+    __m256i o0 = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i o1 = _mm256_loadu_si256((const __m256i *)(old_buf + 32));
+    __m256i n0 = _mm256_loadu_si256((const __m256i *)new_buf);
+    __m256i n1 = _mm256_loadu_si256((const __m256i *)(new_buf + 32));
+    uint32_t m0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0));
+    uint32_t m1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o1, n1));
+
+    return m0 | ((uint64_t)m1 << 32);
+}
+
+static int find_diff_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t eq = xbzrle_cmpeq_avx2(old_buf + i, new_buf + i);
+        if (eq != UINT64_MAX) {
+            return i + cto64(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, true);
+}
+
+static int find_same_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        uint64_t eq = xbzrle_cmpeq_avx2(old_buf + i, new_buf + i);
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, false);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_avx2, find_same_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512BW_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static int find_diff_avx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+        if (eq != UINT64_MAX) {
+            return i + cto64(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, true);
+}
+
+static int find_same_avx512bw(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i o = _mm512_loadu_si512(old_buf + i);
+        __m512i n = _mm512_loadu_si512(new_buf + i);
+        uint64_t eq = _mm512_cmpeq_epi8_mask(o, n);
+        if (eq) {
+            return i + ctz64(eq);
+        }
+    }
+    return xbzrle_scan_tail(old_buf, new_buf, i, slen, false);
+}
+
+static int xbzrle_encode_buffer_avx512bw(uint8_t *old_buf, uint8_t *new_buf,
+                                         int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              find_diff_avx512bw, find_same_avx512bw);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512BW_OPT */
+
+/*
+ * Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW  1
+#define CACHE_AVX2      2
+#define CACHE_SSE2      4
+
+/*
+ * Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL xbzrle_encode_buffer_int
+# define INIT_NAME  "int"
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL xbzrle_encode_buffer_sse2
+# define INIT_NAME  "sse2"
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static unsigned cpuid_cache_all = INIT_CACHE;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    INIT_ACCEL;
+static const char *encode_accel_name = INIT_NAME;
+
+static void init_accel(unsigned cache)
+{
+    int (*fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+        xbzrle_encode_buffer_int;
+    const char *name = "int";
+
+    if (cache & CACHE_SSE2) {
+        fn = xbzrle_encode_buffer_sse2;
+        name = "sse2";
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = xbzrle_encode_buffer_avx2;
+        name = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
+    if (cache & CACHE_AVX512BW) {
+        fn = xbzrle_encode_buffer_avx512bw;
+        name = "avx512bw";
+    }
+#endif
+    encode_accel = fn;
+    encode_accel_name = name;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    int max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            cache |= CACHE_SSE2;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+#ifdef CONFIG_AVX512BW_OPT
+            /* AVX-512 also needs the opmask and upper ZMM state enabled */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+#endif
+        }
+    }
+    cpuid_cache = cpuid_cache_all = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* Once the plain C encoder has been used, start over */
+    if (cpuid_cache == 0) {
+        cpuid_cache = cpuid_cache_all;
+        init_accel(cpuid_cache);
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return encode_accel_name;
+}
+
+#else
+#define encode_accel  xbzrle_encode_buffer_int
+bool test_xbzrle_encode_next_accel(void)
+{
+    return false;
+}
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return "int";
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -18,4 +18,12 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+/*
+ * Switch to the next slower encoder the host supports, for testing.
+ * Returns false, and goes back to the fastest encoder, once the plain C
+ * encoder has been used.
+ */
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
 #endif
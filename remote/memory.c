@@ -42,10 +42,11 @@ static void remote_ram_destructor(MemoryRegion *mr)
     qemu_ram_free(mr->ram_block);
 }
 
-static void remote_ram_init_from_fd(MemoryRegion *mr, int fd, uint64_t size,
-                                    ram_addr_t offset, Error **errp)
+static void remote_ram_init_from_fd(MemoryRegion *mr, int fd, hwaddr gpa,
+                                    uint64_t size, ram_addr_t offset,
+                                    Error **errp)
 {
-    char *name = g_strdup_printf("%d", fd);
+    char *name = g_strdup_printf("remote-mem-%" PRIx64, gpa);
 
     memory_region_init(mr, NULL, name, size);
     mr->ram = true;
@@ -58,38 +59,102 @@ static void remote_ram_init_from_fd(MemoryRegion *mr, int fd, uint64_t size,
     g_free(name);
 }
 
-void remote_sysmem_reconfig(ProcMsg *msg, Error **errp)
+/*
+ * RAM regions shared by QEMU, indexed by guest physical address. They
+ * are added and removed one by one, so that regions which did not change
+ * stay mapped across updates of the memory layout.
+ */
+static GHashTable *remote_ram_regions;
+
+static void remote_ram_region_free(gpointer data)
+{
+    MemoryRegion *subregion = data;
+
+    memory_region_del_subregion(get_system_memory(), subregion);
+    object_unparent(OBJECT(subregion));
+}
+
+static void remote_ram_regions_init(void)
+{
+    if (!remote_ram_regions) {
+        remote_ram_regions = g_hash_table_new_full(g_int64_hash,
+                                                   g_int64_equal, g_free,
+                                                   remote_ram_region_free);
+    }
+}
+
+void remote_sysmem_add(ProcMsg *msg, Error **errp)
 {
     sync_sysmem_msg_t *sysmem_info = &msg->data1.sync_sysmem;
-    MemoryRegion *sysmem, *subregion, *next;
+    MemoryRegion *sysmem, *subregion;
     Error *local_err = NULL;
+    hwaddr *key;
     int region;
 
     sysmem = get_system_memory();
 
+    if (sysmem_info->nregions != msg->num_fds) {
+        error_setg(errp, "Mismatch of regions and fds in SYNC_SYSMEM");
+        return;
+    }
+
     qemu_mutex_lock_iothread();
 
-    memory_region_transaction_begin();
+    remote_ram_regions_init();
 
-    QTAILQ_FOREACH_SAFE(subregion, &sysmem->subregions, subregions_link, next) {
-        if (subregion->ram) {
-            memory_region_del_subregion(sysmem, subregion);
-            /* TODO: should subregion be finalized separately? */
-        }
-    }
+    memory_region_transaction_begin();
 
     for (region = 0; region < msg->num_fds; region++) {
+        key = g_new(hwaddr, 1);
+        *key = sysmem_info->gpas[region];
+
+        /* A region at the same address is replaced */
+        g_hash_table_remove(remote_ram_regions, key);
+
         subregion = g_new(MemoryRegion, 1);
         remote_ram_init_from_fd(subregion, msg->fds[region],
+                                sysmem_info->gpas[region],
                                 sysmem_info->sizes[region],
                                 sysmem_info->offsets[region], &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
+            g_free(key);
             break;
         }
 
         memory_region_add_subregion(sysmem, sysmem_info->gpas[region],
                                     subregion);
+        g_hash_table_insert(remote_ram_regions, key, subregion);
+    }
+
+    memory_region_transaction_commit();
+
+    qemu_mutex_unlock_iothread();
+}
+
+void remote_sysmem_del(ProcMsg *msg, Error **errp)
+{
+    sync_sysmem_msg_t *sysmem_info = &msg->data1.sync_sysmem;
+    int region;
+
+    if (sysmem_info->nregions > REMOTE_MAX_FDS) {
+        error_setg(errp, "Too many regions in SYSMEM_DEL");
+        return;
+    }
+
+    qemu_mutex_lock_iothread();
+
+    remote_ram_regions_init();
+
+    memory_region_transaction_begin();
+
+    for (region = 0; region < sysmem_info->nregions; region++) {
+        if (!g_hash_table_remove(remote_ram_regions,
+                                 &sysmem_info->gpas[region])) {
+            error_setg(errp, "No RAM region at 0x%" HWADDR_PRIx,
+                       sysmem_info->gpas[region]);
+            break;
+        }
     }
 
     memory_region_transaction_commit();
@@ -65,11 +65,31 @@
 #include "qemu/log.h"
 #include "qemu/cutils.h"
 #include "qapi/qapi-commands-block-core.h"
+#include "qemu/event_notifier.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+#include "sysemu/block-backend.h"
+#include "io/channel-file.h"
+#include "migration/vmstate.h"
+#include "migration/qemu-file-types.h"
+#include "migration/qemu-file.h"
+#include "migration/qemu-file-channel.h"
 
 static ProxyLinkState *proxy_link;
+static IOThread *remote_iothread;
 PCIDevice *remote_pci_dev;
 bool create_done;
 
+/*
+ * BAR accesses are emulated in the AioContext of the IOThread given to the
+ * device, if any, so that they do not contend with the main loop.
+ */
+static AioContext *remote_get_aio_context(void)
+{
+    return remote_iothread ? iothread_get_aio_context(remote_iothread) :
+                             qemu_get_aio_context();
+}
+
 static void process_config_write(ProcMsg *msg)
 {
     struct conf_data_msg *conf = (struct conf_data_msg *)msg->data2;
@@ -79,63 +99,93 @@ static void process_config_write(ProcMsg *msg)
     qemu_mutex_unlock_iothread();
 }
 
-static void process_config_read(ProcMsg *msg)
+static uint32_t config_read(uint32_t addr, int l)
 {
-    struct conf_data_msg *conf = (struct conf_data_msg *)msg->data2;
     uint32_t val;
-    int wait;
-
-    wait = msg->fds[0];
 
     qemu_mutex_lock_iothread();
-    val = pci_default_read_config(remote_pci_dev, conf->addr, conf->l);
+    val = pci_default_read_config(remote_pci_dev, addr, l);
     qemu_mutex_unlock_iothread();
 
-    notify_proxy(wait, val);
+    return val;
+}
 
-    PUT_REMOTE_WAIT(wait);
+static void process_config_read(ProcMsg *msg)
+{
+    struct conf_data_msg *conf = (struct conf_data_msg *)msg->data2;
+    uint32_t val;
+
+    val = config_read(conf->addr, conf->l);
+
+    proxy_link_reply(proxy_link, msg, val);
 }
 
 /* TODO: confirm memtx attrs. */
-static void process_bar_write(ProcMsg *msg, Error **errp)
+static void bar_write(hwaddr addr, uint64_t val, unsigned size, bool memory,
+                      Error **errp)
 {
-    bar_access_msg_t *bar_access = &msg->data1.bar_access;
-    AddressSpace *as =
-        bar_access->memory ? &address_space_memory : &address_space_io;
+    AddressSpace *as = memory ? &address_space_memory : &address_space_io;
+    AioContext *ctx = remote_get_aio_context();
     MemTxResult res;
 
-    res = address_space_rw(as, bar_access->addr, MEMTXATTRS_UNSPECIFIED,
-                           (uint8_t *)&bar_access->val, bar_access->size, true);
+    aio_context_acquire(ctx);
+    res = address_space_rw(as, addr, MEMTXATTRS_UNSPECIFIED,
+                           (uint8_t *)&val, size, true);
+    aio_context_release(ctx);
 
     if (res != MEMTX_OK) {
         error_setg(errp, "Could not perform address space write operation,"
-                   " inaccessible address: %lx.", bar_access->addr);
+                   " inaccessible address: %lx.", addr);
     }
 }
 
-static void process_bar_read(ProcMsg *msg, Error **errp)
+static void process_bar_write(ProcMsg *msg, Error **errp)
 {
     bar_access_msg_t *bar_access = &msg->data1.bar_access;
-    AddressSpace *as;
-    int wait = msg->fds[0];
+
+    bar_write(bar_access->addr, bar_access->val, bar_access->size,
+              bar_access->memory, errp);
+}
+
+static void process_bar_write_batch(ProcMsg *msg)
+{
+    bar_access_msg_t *bar_access = (bar_access_msg_t *)msg->data2;
+    int n = msg->size / sizeof(bar_access_msg_t);
+    Error *local_err = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        bar_write(bar_access[i].addr, bar_access[i].val, bar_access[i].size,
+                  bar_access[i].memory, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            local_err = NULL;
+        }
+    }
+}
+
+static uint64_t bar_read(hwaddr addr, unsigned size, bool memory,
+                         Error **errp)
+{
+    AddressSpace *as = memory ? &address_space_memory : &address_space_io;
+    AioContext *ctx = remote_get_aio_context();
     MemTxResult res;
     uint64_t val = 0;
 
-    as = bar_access->memory ? &address_space_memory : &address_space_io;
+    assert(size <= sizeof(uint64_t));
 
-    assert(bar_access->size <= sizeof(uint64_t));
-
-    res = address_space_rw(as, bar_access->addr, MEMTXATTRS_UNSPECIFIED,
-                           (uint8_t *)&val, bar_access->size, false);
+    aio_context_acquire(ctx);
+    res = address_space_rw(as, addr, MEMTXATTRS_UNSPECIFIED,
+                           (uint8_t *)&val, size, false);
+    aio_context_release(ctx);
 
     if (res != MEMTX_OK) {
         error_setg(errp, "Could not perform address space read operation,"
-                   " inaccessible address: %lx.", bar_access->addr);
-        val = (uint64_t)-1;
-        goto fail;
+                   " inaccessible address: %lx.", addr);
+        return (uint64_t)-1;
     }
 
-    switch (bar_access->size) {
+    switch (size) {
     case 4:
         val = *((uint32_t *)&val);
         break;
@@ -147,13 +197,180 @@ static void process_bar_read(ProcMsg *msg, Error **errp)
         break;
     default:
         error_setg(errp, "Invalid PCI BAR read size");
+        break;
+    }
+
+    return val;
+}
+
+static void process_bar_read(ProcMsg *msg, Error **errp)
+{
+    bar_access_msg_t *bar_access = &msg->data1.bar_access;
+    uint64_t val;
+
+    val = bar_read(bar_access->addr, bar_access->size, bar_access->memory,
+                   errp);
+
+    proxy_link_reply(proxy_link, msg, val);
+}
+
+static uint64_t process_ring_desc(ProxyRingDesc *desc)
+{
+    Error *err = NULL;
+    uint64_t val = 0;
+
+    /*
+     * QEMU sends SET_IRQFD before RING_SETUP, so this only happens if it
+     * misbehaves. Say so rather than dropping the access silently.
+     */
+    if (!create_done) {
+        error_report("Ring %s at 0x%" PRIx64 " before the device is ready",
+                     proxy_cmd_name(desc->cmd), desc->addr);
+        return (uint64_t)-1;
+    }
+
+    switch (desc->cmd) {
+    case CONF_WRITE:
+        qemu_mutex_lock_iothread();
+        pci_default_write_config(remote_pci_dev, desc->addr, desc->val,
+                                 desc->size);
+        qemu_mutex_unlock_iothread();
+        break;
+    case CONF_READ:
+        val = config_read(desc->addr, desc->size);
+        break;
+    case BAR_WRITE:
+        bar_write(desc->addr, desc->val, desc->size, desc->memory, &err);
+        break;
+    case BAR_READ:
+        val = bar_read(desc->addr, desc->size, desc->memory, &err);
+        break;
+    default:
+        error_setg(&err, "Unknown ring command %u", desc->cmd);
+        val = (uint64_t)-1;
+    }
+
+    if (err) {
+        error_report_err(err);
+    }
+
+    return val;
+}
+
+typedef struct RemoteIOEventFD {
+    EventNotifier notifier;
+    GSource *src;
+    bool deleted;
+    set_ioeventfd_msg_t args;
+    QLIST_ENTRY(RemoteIOEventFD) next;
+} RemoteIOEventFD;
+
+static QLIST_HEAD(, RemoteIOEventFD) remote_ioeventfds =
+    QLIST_HEAD_INITIALIZER(remote_ioeventfds);
+
+/*
+ * The guest wrote to a doorbell. It issued the accesses on the ring and
+ * on the socket before that, so they are handled first: the ring thread
+ * is waited for, and the messages already on the socket are processed
+ * here, in the thread that polls the link.
+ */
+static void remote_ioeventfd_handler(EventNotifier *e)
+{
+    RemoteIOEventFD *ioeventfd = container_of(e, RemoteIOEventFD, notifier);
+    set_ioeventfd_msg_t *args = &ioeventfd->args;
+    AioContext *ctx = remote_get_aio_context();
+    MemoryRegion *mr;
+
+    if (!event_notifier_test_and_clear(e) || !create_done) {
         return;
     }
 
-fail:
-    notify_proxy(wait, val);
+    if (proxy_link->ring) {
+        proxy_ring_drain(proxy_link);
+    }
+    proxy_link_dispatch_pending(proxy_link);
+    if (ioeventfd->deleted) {
+        return;
+    }
 
-    PUT_REMOTE_WAIT(wait);
+    mr = remote_pci_dev->io_regions[args->bar].memory;
+    if (!mr) {
+        return;
+    }
+
+    aio_context_acquire(ctx);
+    (void)memory_region_dispatch_write(mr, args->offset, args->data,
+                                       args->size, MEMTXATTRS_UNSPECIFIED);
+    aio_context_release(ctx);
+}
+
+/*
+ * The write that KVM signals on the eventfd is replayed directly on the
+ * BAR region of the device, without a message on the proxy link. The
+ * eventfd is polled next to the link, see remote_ioeventfd_handler().
+ */
+static void process_set_ioeventfd_msg(ProcMsg *msg, Error **errp)
+{
+    RemoteIOEventFD *ioeventfd;
+
+    if (msg->num_fds != 1 || msg->data1.set_ioeventfd.bar < 0 ||
+        msg->data1.set_ioeventfd.bar >= PCI_NUM_REGIONS) {
+        error_setg(errp, "Invalid SET_IOEVENTFD message");
+        return;
+    }
+
+    ioeventfd = g_new0(RemoteIOEventFD, 1);
+    ioeventfd->args = msg->data1.set_ioeventfd;
+    event_notifier_init_fd(&ioeventfd->notifier, msg->fds[0]);
+
+    QLIST_INSERT_HEAD(&remote_ioeventfds, ioeventfd, next);
+    ioeventfd->src = proxy_link_add_notifier(proxy_link, &ioeventfd->notifier,
+                                             remote_ioeventfd_handler);
+}
+
+/* Called once remote_ioeventfd_handler() can no longer run */
+static void remote_ioeventfd_free(void *opaque)
+{
+    RemoteIOEventFD *ioeventfd = container_of(opaque, RemoteIOEventFD,
+                                              notifier);
+
+    event_notifier_cleanup(&ioeventfd->notifier);
+    g_free(ioeventfd);
+}
+
+static void process_del_ioeventfd_msg(ProcMsg *msg)
+{
+    set_ioeventfd_msg_t *args = &msg->data1.set_ioeventfd;
+    RemoteIOEventFD *ioeventfd, *next_ioeventfd;
+
+    QLIST_FOREACH_SAFE(ioeventfd, &remote_ioeventfds, next, next_ioeventfd) {
+        if (ioeventfd->args.bar != args->bar ||
+            ioeventfd->args.offset != args->offset ||
+            ioeventfd->args.size != args->size ||
+            ioeventfd->args.match_data != args->match_data ||
+            ioeventfd->args.data != args->data) {
+            continue;
+        }
+
+        QLIST_REMOVE(ioeventfd, next);
+        ioeventfd->deleted = true;
+        proxy_link_del_notifier(proxy_link, &ioeventfd->notifier,
+                                ioeventfd->src, remote_ioeventfd_free);
+    }
+}
+
+static void process_ring_setup_msg(ProcMsg *msg, Error **errp)
+{
+    if (proxy_link->ring) {
+        error_setg(errp, "Proxy ring is already set up");
+        return;
+    }
+
+    if (proxy_link_ring_attach(proxy_link, msg, errp)) {
+        return;
+    }
+
+    proxy_link_ring_start(proxy_link, process_ring_desc);
 }
 
 static void process_device_add_msg(ProcMsg *msg)
@@ -360,6 +577,103 @@ static int setup_drive(ProcMsg *msg, Error **errp)
     return 0;
 }
 
+/*
+ * There is one proxy link, hence one IOThread per remote process. Devices
+ * may repeat its id, but naming another IOThread is an error rather than
+ * running them in one they were not configured for.
+ */
+static int check_iothread(const char *id, Error **errp)
+{
+    char *cur_id;
+    int ret = 0;
+
+    if (!remote_iothread) {
+        return 0;
+    }
+
+    cur_id = object_get_canonical_path_component(OBJECT(remote_iothread));
+    if (strcmp(cur_id, id)) {
+        error_setg(errp, "The remote process already runs its devices in "
+                   "IOThread '%s', cannot use '%s'", cur_id, id);
+        ret = -EINVAL;
+    }
+    g_free(cur_id);
+
+    return ret;
+}
+
+/*
+ * Gives the PCI device of the remote process its own IOThread. The proxy
+ * link is then polled from the AioContext of that IOThread, so BAR and
+ * config. space accesses no longer wait behind the main loop.
+ */
+static int setup_iothread(const char *id, Error **errp)
+{
+    Object *obj;
+
+    if (remote_iothread) {
+        return 0;
+    }
+
+    obj = object_new_with_props(TYPE_IOTHREAD, object_get_objects_root(),
+                                id, errp, NULL);
+    if (!obj) {
+        return -EINVAL;
+    }
+
+    remote_iothread = IOTHREAD(obj);
+
+    proxy_link_set_aio_context(proxy_link, remote_get_aio_context());
+
+    return 0;
+}
+
+typedef struct SetAioContextData {
+    BlockBackend *blk;
+    QemuEvent done;
+} SetAioContextData;
+
+/* Runs in the main loop, which is the home of the old AioContext */
+static void set_blk_aio_context_bh(void *opaque)
+{
+    SetAioContextData *data = opaque;
+    AioContext *ctx = remote_get_aio_context();
+
+    aio_context_acquire(ctx);
+    blk_set_aio_context(data->blk, ctx);
+    aio_context_release(ctx);
+
+    qemu_event_set(&data->done);
+}
+
+/*
+ * Moves the drive of a SCSI device to the IOThread of the PCI device, so
+ * that requests submitted from BAR accesses complete in the same thread.
+ */
+static void set_device_aio_context(DeviceState *dev)
+{
+    SetAioContextData data;
+    SCSIDevice *sd;
+
+    if (!remote_iothread ||
+        !object_dynamic_cast(OBJECT(dev), TYPE_SCSI_DEVICE)) {
+        return;
+    }
+
+    sd = SCSI_DEVICE(dev);
+    if (!sd->conf.blk) {
+        return;
+    }
+
+    data.blk = sd->conf.blk;
+    qemu_event_init(&data.done, false);
+
+    aio_bh_schedule_oneshot(qemu_get_aio_context(), set_blk_aio_context_bh,
+                            &data);
+    qemu_event_wait(&data.done);
+    qemu_event_destroy(&data.done);
+}
+
 static int setup_device(ProcMsg *msg, Error **errp)
 {
     QObject *obj;
@@ -367,6 +681,7 @@ static int setup_device(ProcMsg *msg, Error **errp)
     QString *qstr;
     QemuOpts *opts;
     DeviceState *dev = NULL;
+    char *iothread = NULL;
     int rc = -EINVAL;
 
     if (!msg->data2) {
@@ -391,21 +706,156 @@ static int setup_device(ProcMsg *msg, Error **errp)
     qdict_del(qdict, "command");
     qdict_del(qdict, "rid");
 
+    iothread = g_strdup(qdict_get_try_str(qdict, "iothread"));
+    qdict_del(qdict, "iothread");
+    if (iothread && check_iothread(iothread, errp)) {
+        g_free(iothread);
+        return rc;
+    }
+
     opts = qemu_opts_from_qdict(&qemu_device_opts, qdict, errp);
 
     dev = qdev_device_add(opts, errp);
     if (!dev) {
         error_setg(errp, "Could not add device %s.", qstring_get_str(qstr));
+        g_free(iothread);
         return rc;
     }
     if (object_dynamic_cast(OBJECT(dev), TYPE_PCI_DEVICE)) {
         remote_pci_dev = PCI_DEVICE(dev);
+        if (iothread && setup_iothread(iothread, errp)) {
+            g_free(iothread);
+            return rc;
+        }
     }
+    set_device_aio_context(dev);
     qemu_opts_del(opts);
+    g_free(iothread);
+
+    return 0;
+}
+
+/*
+ * The state of the devices is a list of their VMState, in the order of a
+ * walk of the device tree starting at the PCI device, terminated by a zero
+ * byte. Both ends are created from the same options, so the order matches.
+ */
+#define REMOTE_DEVICE_STATE 1
+
+static int remote_save_device(DeviceState *dev, void *opaque)
+{
+    DeviceClass *dc = DEVICE_GET_CLASS(dev);
+    QEMUFile *f = opaque;
+
+    if (!dc->vmsd) {
+        return 0;
+    }
+
+    qemu_put_byte(f, REMOTE_DEVICE_STATE);
+    qemu_put_counted_string(f, dc->vmsd->name);
+    qemu_put_be32(f, dc->vmsd->version_id);
+
+    return vmstate_save_state(f, dc->vmsd, dev, NULL);
+}
+
+static int remote_load_device(DeviceState *dev, void *opaque)
+{
+    DeviceClass *dc = DEVICE_GET_CLASS(dev);
+    QEMUFile *f = opaque;
+    char name[256];
+    int version_id;
+
+    if (!dc->vmsd) {
+        return 0;
+    }
+
+    if (qemu_get_byte(f) != REMOTE_DEVICE_STATE ||
+        !qemu_get_counted_string(f, name) || strcmp(name, dc->vmsd->name)) {
+        error_report("Unexpected state for device %s", dc->vmsd->name);
+        return -EINVAL;
+    }
+
+    version_id = qemu_get_be32(f);
+
+    return vmstate_load_state(f, dc->vmsd, dev, version_id);
+}
+
+/*
+ * Waits for the requests of the drives of the device. Only these are
+ * drained, as bdrv_drain_all() must not be called from an IOThread; they
+ * live in the AioContext of the device, see set_device_aio_context().
+ */
+static int remote_drain_device(DeviceState *dev, void *opaque)
+{
+    SCSIDevice *sd;
+
+    if (!object_dynamic_cast(OBJECT(dev), TYPE_SCSI_DEVICE)) {
+        return 0;
+    }
+
+    sd = SCSI_DEVICE(dev);
+    if (sd->conf.blk) {
+        blk_drain(sd->conf.blk);
+    }
 
     return 0;
 }
 
+static void process_device_state_msg(ProcMsg *msg)
+{
+    AioContext *ctx = remote_get_aio_context();
+    QIOChannel *ioc;
+    QEMUFile *f;
+    int wait = msg->fds[1];
+    int ret = -EINVAL;
+
+    ioc = QIO_CHANNEL(qio_channel_file_new_fd(msg->fds[0]));
+    if (msg->cmd == DEVICE_SAVE) {
+        f = qemu_fopen_channel_output(ioc);
+    } else {
+        f = qemu_fopen_channel_input(ioc);
+    }
+
+    qemu_mutex_lock_iothread();
+    aio_context_acquire(ctx);
+
+    if (!remote_pci_dev) {
+        error_report("No remote device to migrate");
+        goto out;
+    }
+
+    qdev_walk_children(DEVICE(remote_pci_dev), remote_drain_device,
+                       NULL, NULL, NULL, NULL);
+
+    if (msg->cmd == DEVICE_SAVE) {
+        ret = qdev_walk_children(DEVICE(remote_pci_dev), remote_save_device,
+                                 NULL, NULL, NULL, f);
+        qemu_put_byte(f, 0);
+        qemu_fflush(f);
+    } else {
+        ret = qdev_walk_children(DEVICE(remote_pci_dev), remote_load_device,
+                                 NULL, NULL, NULL, f);
+        if (!ret && qemu_get_byte(f)) {
+            ret = -EINVAL;
+        }
+    }
+
+out:
+    aio_context_release(ctx);
+    qemu_mutex_unlock_iothread();
+
+    if (!ret) {
+        ret = qemu_file_get_error(f);
+    }
+
+    qemu_fclose(f);
+    object_unref(OBJECT(ioc));
+
+    notify_proxy(wait, ret ? 1 : 0);
+
+    PUT_REMOTE_WAIT(wait);
+}
+
 static void process_msg(GIOCondition cond)
 {
     ProcMsg *msg = NULL;
@@ -455,14 +905,25 @@ static void process_msg(GIOCondition cond)
             }
         }
         break;
+    case BAR_WRITE_BATCH:
+        if (create_done) {
+            process_bar_write_batch(msg);
+        }
+        free(msg->data2);
+        break;
     case SYNC_SYSMEM:
         /*
          * TODO: ensure no active DMA is happening when
          * sysmem is being updated
          */
-        remote_sysmem_reconfig(msg, &err);
+        remote_sysmem_add(msg, &err);
+        if (err) {
+            goto finalize_loop;
+        }
+        break;
+    case SYSMEM_DEL:
+        remote_sysmem_del(msg, &err);
         if (err) {
-            error_report_err(err);
             goto finalize_loop;
         }
         break;
@@ -504,6 +965,36 @@ static void process_msg(GIOCondition cond)
     case BLOCK_RESIZE:
         process_block_resize_msg(msg);
         break;
+    case RING_SETUP:
+        process_ring_setup_msg(msg, &err);
+        if (err) {
+            error_report_err(err);
+            err = NULL;
+        }
+        break;
+    case DEVICE_SAVE:
+    case DEVICE_LOAD:
+        process_device_state_msg(msg);
+        break;
+    case SET_IOEVENTFD:
+        process_set_ioeventfd_msg(msg, &err);
+        if (err) {
+            error_report_err(err);
+            err = NULL;
+        }
+        break;
+    case DEL_IOEVENTFD:
+        process_del_ioeventfd_msg(msg);
+        break;
+    case COMPLETION_SETUP:
+        if (proxy_link->comp) {
+            error_report("Completion slots are already set up");
+            close(msg->fds[0]);
+        } else if (proxy_link_completion_attach(proxy_link, msg, &err)) {
+            error_report_err(err);
+            err = NULL;
+        }
+        break;
     default:
         error_setg(&err, "Unknown command");
         goto finalize_loop;
@@ -0,0 +1,128 @@
+/*
+ * XBZRLE encoder and decoder speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NR_PAGES  256
+
+typedef struct {
+    const char *name;
+    /* number of changed runs per page and their length */
+    int runs;
+    int run_len;
+} XBZRLEBench;
+
+static const XBZRLEBench benches[] = {
+    { "unchanged", 0, 0 },
+    { "sparse", 8, 8 },
+    { "scattered", 64, 4 },
+    { "clustered", 1, 1024 },
+    { "dense", 512, 4 },
+};
+
+static void bench_fill(const XBZRLEBench *b, uint8_t *old_buf,
+                       uint8_t *new_buf)
+{
+    int i, j, off;
+
+    for (i = 0; i < NR_PAGES * PAGE_SIZE; i++) {
+        old_buf[i] = g_test_rand_int();
+    }
+    memcpy(new_buf, old_buf, NR_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < NR_PAGES; i++) {
+        for (j = 0; j < b->runs; j++) {
+            off = g_test_rand_int_range(0, PAGE_SIZE - b->run_len);
+            memset(new_buf + i * PAGE_SIZE + off, ~old_buf[i * PAGE_SIZE + off],
+                   b->run_len);
+        }
+    }
+}
+
+static void test_xbzrle_speed(const void *opaque)
+{
+    const XBZRLEBench *b = opaque;
+    uint8_t *old_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *dst = g_malloc(NR_PAGES * PAGE_SIZE);
+    uint8_t *page = g_malloc(PAGE_SIZE);
+    int *len = g_new(int, NR_PAGES);
+    double total, encoded;
+    int i;
+
+    bench_fill(b, old_buf, new_buf);
+
+    do {
+        total = encoded = 0;
+        g_test_timer_start();
+        do {
+            for (i = 0; i < NR_PAGES; i++) {
+                len[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                              new_buf + i * PAGE_SIZE,
+                                              PAGE_SIZE, dst + i * PAGE_SIZE,
+                                              PAGE_SIZE);
+                encoded += len[i] == -1 ? PAGE_SIZE : len[i];
+            }
+            total += NR_PAGES * PAGE_SIZE;
+        } while (g_test_timer_elapsed() < 1.0);
+
+        g_print("%s: encode %-8s %.2f GB/s, %.1f%% of the input\n", b->name,
+                test_xbzrle_encode_accel_name(),
+                total / GiB / g_test_timer_last(), 100 * encoded / total);
+    } while (test_xbzrle_encode_next_accel());
+
+    /* check the encoding once, the pages that overflowed are sent raw */
+    for (i = 0; i < NR_PAGES; i++) {
+        if (len[i] > 0) {
+            memcpy(page, old_buf + i * PAGE_SIZE, PAGE_SIZE);
+            g_assert(xbzrle_decode_buffer(dst + i * PAGE_SIZE, len[i], page,
+                                          PAGE_SIZE) >= 0);
+            g_assert(memcmp(page, new_buf + i * PAGE_SIZE, PAGE_SIZE) == 0);
+        }
+    }
+
+    total = 0;
+    g_test_timer_start();
+    do {
+        for (i = 0; i < NR_PAGES; i++) {
+            if (len[i] > 0) {
+                xbzrle_decode_buffer(dst + i * PAGE_SIZE, len[i], page,
+                                     PAGE_SIZE);
+                total += PAGE_SIZE;
+            }
+        }
+    } while (total && g_test_timer_elapsed() < 1.0);
+
+    if (total) {
+        g_print("%s: decode %.2f GB/s\n", b->name,
+                total / GiB / g_test_timer_last());
+    }
+
+    g_free(len);
+    g_free(page);
+    g_free(dst);
+    g_free(new_buf);
+    g_free(old_buf);
+}
+
+int main(int argc, char **argv)
+{
+    char *name;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(benches); i++) {
+        name = g_strdup_printf("/xbzrle/speed/%s", benches[i].name);
+        g_test_add_data_func(name, &benches[i], test_xbzrle_speed);
+        g_free(name);
+    }
+
+    return g_test_run();
+}
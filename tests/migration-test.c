@@ -853,6 +853,40 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
+static void test_dirty_rate(void)
+{
+    QTestState *from, *to;
+    QDict *rsp_return;
+    const char *status;
+    bool measured;
+
+    if (test_migrate_start(&from, &to, "tcp:0:0", false, false)) {
+        return;
+    }
+
+    /* The guest is dirtying its memory once it prints */
+    wait_for_serial("src_serial");
+
+    rsp_return = wait_command(from, "{ 'execute': 'calc-dirty-rate',"
+                              "  'arguments': { 'calc-time': 1 } }");
+    qobject_unref(rsp_return);
+
+    do {
+        g_usleep(100 * 1000);
+        rsp_return = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(rsp_return, "status");
+        g_assert(!strcmp(status, "measuring") || !strcmp(status, "measured"));
+        measured = !strcmp(status, "measured");
+        if (measured) {
+            g_assert(qdict_haskey(rsp_return, "ramblocks"));
+            g_assert_cmpint(qdict_get_int(rsp_return, "dirty-rate"), >, 0);
+        }
+        qobject_unref(rsp_return);
+    } while (!measured);
+
+    test_migrate_end(from, to, false);
+}
+
 static void test_precopy_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -983,6 +1017,60 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+static void test_parallel_device_state(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    const char *arch = qtest_get_arch();
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, uri, false, false)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "x-parallel-device-state", true);
+    migrate_set_capability(to, "x-parallel-device-state", true);
+    migrate_set_parameter(from, "x-device-state-threads", 2);
+    migrate_set_parameter(to, "x-device-state-threads", 2);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /*
+     * On PC machines, pcspk and the two i8257 controllers are consecutive
+     * parallel sections, so at least one batch must have been sent.
+     */
+    if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
+        rsp = migrate_query(from);
+        g_assert_cmpint(qdict_get_try_int(rsp, "x-device-state-batches", 0),
+                        >, 0);
+        qobject_unref(rsp);
+    }
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
 static void test_precopy_tcp(void)
 {
     char *uri;
@@ -1076,10 +1164,13 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/parallel_device_state",
+                   test_parallel_device_state);
 
     ret = g_test_run();
 
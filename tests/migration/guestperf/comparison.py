@@ -24,6 +24,33 @@ class Comparison(object):
         self._name = name
         self._scenarios = scenarios
 
+
+# Capability combinations compared against each other, each one
+# run against the same set of guest dirty rates (MiB/s, 0 = unlimited)
+CAPABILITIES = [
+    ("precopy", {}),
+    ("multifd", { "multifd": True, "multifd_channels": 4 }),
+    ("multifd-zstd", { "multifd": True, "multifd_channels": 4,
+                       "multifd_compression": "zstd" }),
+    ("compress", { "compression_mt": True, "compression_mt_threads": 4 }),
+    ("xbzrle", { "compression_xbzrle": True,
+                 "compression_xbzrle_cache": 10 }),
+    ("postcopy", { "post_copy": True, "post_copy_iters": 1 }),
+]
+
+DIRTY_RATES = [100, 1000, 0]
+
+def capability_scenarios(working_set):
+    scenarios = []
+    for name, args in CAPABILITIES:
+        for rate in DIRTY_RATES:
+            scenarios.append(
+                Scenario("%s-dirty-%s-ws-%d" % (name,
+                                                "%dmbs" % rate if rate else "max",
+                                                working_set),
+                         dirty_rate=rate, working_set=working_set, **args))
+    return scenarios
+
 COMPARISONS = [
     # Looking at effect of pausing guest during migration
     # at various stages of iteration over RAM
@@ -121,4 +148,10 @@ COMPARISONS = [
         Scenario("compr-xbzrle-cache-50",
                  compression_xbzrle=True, compression_xbzrle_cache=50),
     ]),
+
+
+    # Looking at each capability against guests dirtying memory at
+    # various rates, over all of their RAM or only a small hot set
+    Comparison("capabilities", scenarios =
+               capability_scenarios(100) + capability_scenarios(10)),
 ]
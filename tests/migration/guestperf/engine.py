@@ -95,7 +95,8 @@ class Engine(object):
                 info["ram"].get("normal-bytes", 0),
                 info["ram"].get("dirty-pages-rate", 0),
                 info["ram"].get("mbps", 0),
-                info["ram"].get("dirty-sync-count", 0)
+                info["ram"].get("dirty-sync-count", 0),
+                info["ram"].get("dirty-sync-time", 0)
             ),
             time.time(),
             info.get("total-time", 0),
@@ -149,6 +150,17 @@ class Engine(object):
                                      "state": True }
                                ])
 
+        if scenario._multifd:
+            for vm in (src, dst):
+                resp = vm.command("migrate-set-capabilities",
+                                  capabilities = [
+                                      { "capability": "x-multifd",
+                                        "state": True }
+                                  ])
+                resp = vm.command("migrate-set-parameters",
+                                  x_multifd_channels=scenario._multifd_channels,
+                                  x_multifd_compression=scenario._multifd_compression)
+
         resp = src.command("migrate_set_speed",
                            value=scenario._bandwidth * 1024 * 1024)
 
@@ -264,7 +276,7 @@ class Engine(object):
                 resp = src.command("stop")
                 paused = True
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -280,6 +292,8 @@ class Engine(object):
             args.append("quiet")
 
         args.append("ramsize=%s" % hardware._mem)
+        args.append("workingset=%d" % scenario._working_set)
+        args.append("dirtyrate=%d" % scenario._dirty_rate)
 
         cmdline = " ".join(args)
         if tunnelled:
@@ -310,14 +324,14 @@ class Engine(object):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
 
-    def _get_dst_args(self, hardware, uri):
+    def _get_dst_args(self, hardware, scenario, uri):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
         return argv + ["-incoming", uri]
 
     @staticmethod
@@ -386,13 +400,13 @@ class Engine(object):
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
         src = qemu.QEMUMachine(self._binary,
-                               args=self._get_src_args(hardware),
+                               args=self._get_src_args(hardware, scenario),
                                wrapper=self._get_src_wrapper(hardware),
                                name="qemu-src-%d" % os.getpid(),
                                monitor_address=srcmonaddr)
 
         dst = qemu.QEMUMachine(self._binary,
-                               args=self._get_dst_args(hardware, uri),
+                               args=self._get_dst_args(hardware, scenario, uri),
                                wrapper=self._get_dst_wrapper(hardware),
                                name="qemu-dst-%d" % os.getpid(),
                                monitor_address=dstmonaddr)
@@ -401,6 +415,12 @@ class Engine(object):
             src.launch()
             dst.launch()
 
+            version = src.command("query-version")
+            qemu_version = "%d.%d.%d%s" % (version["qemu"]["major"],
+                                           version["qemu"]["minor"],
+                                           version["qemu"]["micro"],
+                                           version["package"])
+
             ret = self._migrate(hardware, scenario, src, dst, uri)
             progress_history = ret[0]
             qemu_timings = ret[1]
@@ -418,7 +438,8 @@ class Engine(object):
                           Timings(qemu_timings),
                           Timings(vcpu_timings),
                           self._binary, self._dst_host, self._kernel,
-                          self._initrd, self._transport, self._sleep)
+                          self._initrd, self._transport, self._sleep,
+                          qemu_version)
         except Exception as e:
             if self._debug:
                 print("Failed: %s" % str(e))
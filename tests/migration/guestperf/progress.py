@@ -30,7 +30,8 @@ class ProgressStats(object):
                  normal_bytes,
                  dirty_rate_pps,
                  transfer_rate_mbs,
-                 iterations):
+                 iterations,
+                 dirty_sync_time_us=0):
         self._transferred_bytes = transferred_bytes
         self._remaining_bytes = remaining_bytes
         self._total_bytes = total_bytes
@@ -41,6 +42,7 @@ class ProgressStats(object):
         self._dirty_rate_pps = dirty_rate_pps
         self._transfer_rate_mbs = transfer_rate_mbs
         self._iterations = iterations
+        self._dirty_sync_time_us = dirty_sync_time_us
 
     def serialize(self):
         return {
@@ -54,6 +56,7 @@ class ProgressStats(object):
             "dirty_rate_pps": self._dirty_rate_pps,
             "transfer_rate_mbs": self._transfer_rate_mbs,
             "iterations": self._iterations,
+            "dirty_sync_time_us": self._dirty_sync_time_us,
         }
 
     @classmethod
@@ -68,7 +71,8 @@ class ProgressStats(object):
             data["normal_bytes"],
             data["dirty_rate_pps"],
             data["transfer_rate_mbs"],
-            data["iterations"])
+            data["iterations"],
+            data.get("dirty_sync_time_us", 0))
 
 
 class Progress(object):
@@ -21,6 +21,7 @@ from __future__ import print_function
 
 import argparse
 import fnmatch
+import json
 import os
 import os.path
 import platform
@@ -33,6 +34,7 @@ from guestperf.scenario import Scenario
 from guestperf.comparison import COMPARISONS
 from guestperf.plot import Plot
 from guestperf.report import Report
+from guestperf.summary import Summary
 
 
 class BaseShell(object):
@@ -101,6 +103,7 @@ class Shell(BaseShell):
         parser = self._parser
 
         parser.add_argument("--output", dest="output", default=None)
+        parser.add_argument("--summary", dest="summary", default=False, action="store_true")
 
         # Scenario args
         parser.add_argument("--max-iters", dest="max_iters", default=30, type=int)
@@ -123,6 +126,14 @@ class Shell(BaseShell):
         parser.add_argument("--compression-xbzrle", dest="compression_xbzrle", default=False, action="store_true")
         parser.add_argument("--compression-xbzrle-cache", dest="compression_xbzrle_cache", default=10, type=int)
 
+        parser.add_argument("--multifd", dest="multifd", default=False, action="store_true")
+        parser.add_argument("--multifd-channels", dest="multifd_channels", default=2, type=int)
+        parser.add_argument("--multifd-compression", dest="multifd_compression", default="none")
+
+        # Guest workload args
+        parser.add_argument("--dirty-rate", dest="dirty_rate", default=0, type=int)
+        parser.add_argument("--working-set", dest="working_set", default=100, type=int)
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -143,7 +154,14 @@ class Shell(BaseShell):
                         compression_mt_threads=args.compression_mt_threads,
 
                         compression_xbzrle=args.compression_xbzrle,
-                        compression_xbzrle_cache=args.compression_xbzrle_cache)
+                        compression_xbzrle_cache=args.compression_xbzrle_cache,
+
+                        multifd=args.multifd,
+                        multifd_channels=args.multifd_channels,
+                        multifd_compression=args.multifd_compression,
+
+                        dirty_rate=args.dirty_rate,
+                        working_set=args.working_set)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -158,11 +176,15 @@ class Shell(BaseShell):
 
         try:
             report = engine.run(hardware, scenario)
+            if args.summary:
+                data = Summary.from_report(report).to_json()
+            else:
+                data = report.to_json()
             if args.output is None:
-                print(report.to_json())
+                print(data)
             else:
                 with open(args.output, "w") as fh:
-                    print(report.to_json(), file=fh)
+                    print(data, file=fh)
             return 0
         except Exception as e:
             print("Error: %s" % str(e), file=sys.stderr)
@@ -180,6 +202,7 @@ class BatchShell(BaseShell):
 
         parser.add_argument("--filter", dest="filter", default="*")
         parser.add_argument("--output", dest="output", default=os.getcwd())
+        parser.add_argument("--summary", dest="summary", default=None)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -190,6 +213,7 @@ class BatchShell(BaseShell):
 
         engine = self.get_engine(args)
         hardware = self.get_hardware(args)
+        summaries = []
 
         try:
             for comparison in COMPARISONS:
@@ -211,11 +235,20 @@ class BatchShell(BaseShell):
                     report = engine.run(hardware, scenario)
                     with open(filename, "w") as fh:
                         print(report.to_json(), file=fh)
+                    summaries.append(Summary.from_report(report, name))
         except Exception as e:
             print("Error: %s" % str(e), file=sys.stderr)
             if args.debug:
                 raise
 
+        # One file with every run that completed, for tracking over time
+        if args.summary is not None:
+            with open(args.summary, "w") as fh:
+                print(json.dumps({
+                    "hardware": hardware.serialize(),
+                    "results": [s.serialize() for s in summaries],
+                }, indent=4), file=fh)
+
 
 class PlotShell(object):
 
@@ -0,0 +1,137 @@
+#
+# Migration test result summary
+#
+# This work is licensed under the terms of the GNU GPL, version 2 or later.
+# See the COPYING file in the top-level directory.
+#
+
+import json
+
+
+class Summary(object):
+    """Headline numbers of one migration run
+
+    Flattened out of a full Report so that results can be compared
+    across scenarios and QEMU releases without replaying the progress
+    history.
+    """
+
+    def __init__(self,
+                 name,
+                 qemu_version,
+                 status,
+                 total_time_ms,
+                 downtime_ms,
+                 setup_time_ms,
+                 transferred_bytes,
+                 throughput_mbs,
+                 iterations,
+                 dirty_sync_time_us,
+                 cpu_ms_per_gb):
+
+        self._name = name
+        self._qemu_version = qemu_version
+        self._status = status
+        self._total_time_ms = total_time_ms
+        self._downtime_ms = downtime_ms
+        self._setup_time_ms = setup_time_ms
+        self._transferred_bytes = transferred_bytes
+        self._throughput_mbs = throughput_mbs # MiB per second
+        self._iterations = iterations
+        self._dirty_sync_time_us = dirty_sync_time_us # list, one per iteration
+        self._cpu_ms_per_gb = cpu_ms_per_gb # source QEMU, excluding vCPUs
+
+    @staticmethod
+    def _cpu_between(records, start, end):
+        # Records hold the cumulative CPU time of a thread, sampled
+        # about once a second; take the samples enclosing the interval
+        before = [r for r in records if r._timestamp <= start]
+        after = [r for r in records if r._timestamp >= end]
+        if not before or not after:
+            return None
+        return after[0]._value - before[-1]._value
+
+    @classmethod
+    def _source_cpu_ms(cls, report, start, end):
+        qemu = cls._cpu_between(report._qemu_timings._records, start, end)
+        if qemu is None:
+            return None
+
+        # The guest keeps dirtying memory, so don't count vCPU threads
+        tids = set([r._tid for r in report._vcpu_timings._records])
+        for tid in tids:
+            records = [r for r in report._vcpu_timings._records
+                       if r._tid == tid]
+            vcpu = cls._cpu_between(records, start, end)
+            if vcpu is not None:
+                qemu -= vcpu
+        return max(qemu, 0)
+
+    @classmethod
+    def from_report(cls, report, name=None):
+        history = report._progress_history
+        last = history[-1]
+
+        # Each record is the first sample taken in a new iteration, so
+        # it shows the time of the sync that started that iteration
+        sync_times = [progress._ram._dirty_sync_time_us
+                      for progress in history
+                      if progress._ram._iterations > 0]
+
+        end = last._now
+        start = end - last._duration / 1000.0
+        transferred = last._ram._transferred_bytes
+        throughput = 0
+        if last._duration:
+            throughput = (transferred / (1024.0 * 1024.0) /
+                          (last._duration / 1000.0))
+
+        cpu_ms_per_gb = None
+        cpu_ms = cls._source_cpu_ms(report, start, end)
+        if cpu_ms is not None and transferred:
+            cpu_ms_per_gb = cpu_ms / (transferred / (1024.0 ** 3))
+
+        return cls(name or report._scenario._name,
+                   report._qemu_version,
+                   last._status,
+                   last._duration,
+                   last._downtime,
+                   last._setup_time,
+                   transferred,
+                   throughput,
+                   last._ram._iterations,
+                   sync_times,
+                   cpu_ms_per_gb)
+
+    def serialize(self):
+        return {
+            "name": self._name,
+            "qemu_version": self._qemu_version,
+            "status": self._status,
+            "total_time_ms": self._total_time_ms,
+            "downtime_ms": self._downtime_ms,
+            "setup_time_ms": self._setup_time_ms,
+            "transferred_bytes": self._transferred_bytes,
+            "throughput_mbs": self._throughput_mbs,
+            "iterations": self._iterations,
+            "dirty_sync_time_us": self._dirty_sync_time_us,
+            "cpu_ms_per_gb": self._cpu_ms_per_gb,
+        }
+
+    @classmethod
+    def deserialize(cls, data):
+        return cls(
+            data["name"],
+            data["qemu_version"],
+            data["status"],
+            data["total_time_ms"],
+            data["downtime_ms"],
+            data["setup_time_ms"],
+            data["transferred_bytes"],
+            data["throughput_mbs"],
+            data["iterations"],
+            data["dirty_sync_time_us"],
+            data["cpu_ms_per_gb"])
+
+    def to_json(self):
+        return json.dumps(self.serialize(), indent=4)
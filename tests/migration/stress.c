@@ -167,8 +167,17 @@ static unsigned long long now(void)
     return (tv.tv_sec * 1000ull) + (tv.tv_usec / 1000ull);
 }
 
-static int stressone(unsigned long long ramsizeMB)
+typedef struct {
+    unsigned long long ramsizeMB;
+    /* MB of RAM rewritten on each pass, at the start of the region */
+    unsigned long long wssizeMB;
+    /* MB per second to dirty, or 0 to go as fast as possible */
+    unsigned long long rateMB;
+} StressArgs;
+
+static int stressone(const StressArgs *args)
 {
+    unsigned long long ramsizeMB = args->ramsizeMB;
     size_t pagesPerMB = 1024 * 1024 / PAGE_SIZE;
     char *ram = malloc(ramsizeMB * 1024 * 1024);
     char *ramptr;
@@ -177,6 +186,7 @@ static int stressone(unsigned long long ramsizeMB)
     char *dataptr;
     size_t nMB = 0;
     unsigned long long before, after;
+    unsigned long long start, elapsed, dirtiedMB = 0;
 
     if (!ram) {
         fprintf(stderr, "%s (%05d): ERROR: cannot allocate %llu MB of RAM: %s\n",
@@ -203,12 +213,12 @@ static int stressone(unsigned long long ramsizeMB)
         return -1;
     }
 
-    before = now();
+    before = start = now();
 
     while (1) {
 
         ramptr = ram;
-        for (i = 0; i < ramsizeMB; i++, nMB++) {
+        for (i = 0; i < args->wssizeMB; i++, nMB++) {
             for (j = 0; j < pagesPerMB; j++) {
                 dataptr = data;
                 for (k = 0; k < PAGE_SIZE; k += sizeof(long long)) {
@@ -218,6 +228,14 @@ static int stressone(unsigned long long ramsizeMB)
                 }
             }
 
+            /* Sleep off whatever we are ahead of the requested rate */
+            dirtiedMB++;
+            if (args->rateMB) {
+                elapsed = now() - start;
+                if (dirtiedMB * 1000 / args->rateMB > elapsed)
+                    usleep((dirtiedMB * 1000 / args->rateMB - elapsed) * 1000);
+            }
+
             if (nMB == 1024) {
                 after = now();
                 fprintf(stderr, "%s (%05d): INFO: %06llums copied 1 GB in %05llums\n",
@@ -235,26 +253,39 @@ static int stressone(unsigned long long ramsizeMB)
 
 static void *stressthread(void *arg)
 {
-    unsigned long long ramsizeMB = *(unsigned long long *)arg;
+    StressArgs *args = arg;
 
-    stressone(ramsizeMB);
+    stressone(args);
 
     return NULL;
 }
 
-static int stress(unsigned long long ramsizeGB, int ncpus)
+/*
+ * The working set (a percentage of RAM) and the dirty rate (MB/s) are
+ * split evenly across the CPUs.
+ */
+static int stress(unsigned long long ramsizeGB, int ncpus,
+                  unsigned long long workingset, unsigned long long dirtyrate)
 {
     size_t i;
-    unsigned long long ramsizeMB = ramsizeGB * 1024 / ncpus;
+    StressArgs args;
+
+    args.ramsizeMB = ramsizeGB * 1024 / ncpus;
+    args.wssizeMB = args.ramsizeMB * workingset / 100;
+    if (args.wssizeMB == 0)
+        args.wssizeMB = 1;
+    args.rateMB = dirtyrate / ncpus;
+    if (dirtyrate && args.rateMB == 0)
+        args.rateMB = 1;
     ncpus--;
 
     for (i = 0; i < ncpus; i++) {
         pthread_t thr;
         pthread_create(&thr, NULL,
-                       stressthread,   &ramsizeMB);
+                       stressthread,   &args);
     }
 
-    stressone(ramsizeMB);
+    stressone(&args);
 
     return 0;
 }
@@ -293,14 +324,18 @@ static int mount_all(void)
 int main(int argc, char **argv)
 {
     unsigned long long ramsizeGB = 1;
+    unsigned long long workingset = 100;
+    unsigned long long dirtyrate = 0;
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:w:d:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "working-set", required_argument, NULL, 'w' },
+        { "dirty-rate", required_argument, NULL, 'd' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
@@ -330,9 +365,30 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'w':
+            errno = 0;
+            workingset = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse working set %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
+        case 'd':
+            errno = 0;
+            dirtyrate = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse dirty rate %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--working-set PERCENT][--dirty-rate MB/s]\n", argv0);
             exit_failure();
         }
     }
@@ -344,15 +400,28 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+        ret = get_command_arg_ull("workingset", &workingset);
+        if (ret < 0)
+            exit_failure();
+        ret = get_command_arg_ull("dirtyrate", &dirtyrate);
+        if (ret < 0)
+            exit_failure();
     }
 
     if (ncpus == 0)
         ncpus = sysconf(_SC_NPROCESSORS_ONLN);
 
-    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs\n",
-            argv0, gettid(), ramsizeGB, ncpus);
+    if (workingset == 0 || workingset > 100) {
+        fprintf(stderr, "%s (%05d): ERROR: working set must be 1-100%%\n",
+                argv0, gettid());
+        exit_failure();
+    }
+
+    fprintf(stdout, "%s (%05d): INFO: RAM %llu GiB across %d CPUs, "
+            "working set %llu%%, dirty rate %llu MB/s\n",
+            argv0, gettid(), ramsizeGB, ncpus, workingset, dirtyrate);
 
-    if (stress(ramsizeGB, ncpus) < 0)
+    if (stress(ramsizeGB, ncpus, workingset, dirtyrate) < 0)
         exit_failure();
 
     exit_success();
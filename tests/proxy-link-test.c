@@ -0,0 +1,330 @@
+/*
+ * QTest testcase and benchmark for the multi-process QEMU proxy link
+ *
+ * Copyright (c) 2026 QEMU contributors
+ *
+ * Authors:
+ *  QEMU multi-process contributors <qemu-devel@nongnu.org>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/timer.h"
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+/*
+ * The LSI53C895A is the only device that can run in a remote process. Its
+ * SCRATCHA register and its SCRIPTS RAM have no side effects, which makes
+ * them a good target for BAR accesses.
+ */
+#define LSI_VENDOR_ID       0x1000
+#define LSI_DEVICE_ID       0x0012
+#define LSI_SCRATCHA        0x34
+#define LSI_RAM_SIZE        0x2000
+
+#define REMOTE_PROG         "qemu-scsi-dev"
+
+#define MAX_DEVICES         4
+#define BENCH_ITERATIONS    20000
+
+typedef struct {
+    QTestState *qts;
+    QPCIBus *bus;
+    int ndevs;
+    QPCIDevice *dev[MAX_DEVICES];
+    QPCIBar io_bar[MAX_DEVICES];
+    QPCIBar ram_bar[MAX_DEVICES];
+} ProxyTestState;
+
+typedef void (*ProxyTestOp)(ProxyTestState *s, int idx, unsigned size,
+                            uint32_t i);
+
+/*
+ * Fast paths of the proxy link, each enabled on its own so that their
+ * effect shows up separately in the benchmark results.
+ */
+typedef struct {
+    const char *name;
+    const char *opts;
+} ProxyTransport;
+
+static const ProxyTransport transports[] = {
+    { "socket", "" },
+    { "shm-ring", " -global proxy-lsi53c895a.shm-ring=on" },
+    { "posted-writes", " -global proxy-lsi53c895a.posted-writes=on" },
+    { "completion", " -global proxy-lsi53c895a.completion=on" },
+};
+
+typedef struct {
+    const char *name;
+    ProxyTestOp op;
+    unsigned size;
+    int ndevs;
+    const ProxyTransport *transport;
+} ProxyBench;
+
+static void save_fn(QPCIDevice *dev, int devfn, void *data)
+{
+    ProxyTestState *s = data;
+
+    g_assert_cmpint(s->ndevs, <, MAX_DEVICES);
+    s->dev[s->ndevs++] = dev;
+}
+
+static void proxy_test_start(ProxyTestState *s, int ndevs,
+                             const ProxyTransport *transport)
+{
+    GString *cmd = g_string_new("-m 128M -object memory-backend-file,id=mem,"
+                                "size=128M,mem-path=/dev/shm,share=on "
+                                "-numa node,memdev=mem");
+    uint64_t barsize;
+    int i;
+
+    for (i = 0; i < ndevs; i++) {
+        g_string_append_printf(cmd, " -rdevice lsi53c895a,rid=%d,id=scsi%d",
+                               i, i);
+    }
+    g_string_append(cmd, transport->opts);
+
+    memset(s, 0, sizeof(*s));
+    s->qts = qtest_init(cmd->str);
+    g_string_free(cmd, true);
+
+    s->bus = qpci_init_pc(s->qts, NULL);
+    qpci_device_foreach(s->bus, LSI_VENDOR_ID, LSI_DEVICE_ID, save_fn, s);
+    g_assert_cmpint(s->ndevs, ==, ndevs);
+
+    for (i = 0; i < ndevs; i++) {
+        qpci_device_enable(s->dev[i]);
+        s->io_bar[i] = qpci_iomap(s->dev[i], 0, &barsize);
+        s->ram_bar[i] = qpci_iomap(s->dev[i], 2, &barsize);
+        g_assert_cmpuint(barsize, ==, LSI_RAM_SIZE);
+    }
+}
+
+static void proxy_test_end(ProxyTestState *s)
+{
+    int i;
+
+    for (i = 0; i < s->ndevs; i++) {
+        g_free(s->dev[i]);
+    }
+    qpci_free_pc(s->bus);
+    qtest_quit(s->qts);
+}
+
+static uint32_t ram_offset(unsigned size, uint32_t i)
+{
+    return (i * size) % LSI_RAM_SIZE;
+}
+
+static void op_config_read(ProxyTestState *s, int idx, unsigned size,
+                           uint32_t i)
+{
+    switch (size) {
+    case 1:
+        g_assert_cmphex(qpci_config_readb(s->dev[idx], PCI_VENDOR_ID), ==,
+                        LSI_VENDOR_ID & 0xff);
+        break;
+    case 2:
+        g_assert_cmphex(qpci_config_readw(s->dev[idx], PCI_VENDOR_ID), ==,
+                        LSI_VENDOR_ID);
+        break;
+    default:
+        g_assert_cmphex(qpci_config_readl(s->dev[idx], PCI_VENDOR_ID), ==,
+                        LSI_VENDOR_ID | (LSI_DEVICE_ID << 16));
+        break;
+    }
+}
+
+static void op_bar_write(ProxyTestState *s, int idx, unsigned size,
+                         uint32_t i)
+{
+    uint32_t off = ram_offset(size, i);
+
+    switch (size) {
+    case 1:
+        qpci_io_writeb(s->dev[idx], s->ram_bar[idx], off, i);
+        break;
+    case 2:
+        qpci_io_writew(s->dev[idx], s->ram_bar[idx], off, i);
+        break;
+    default:
+        qpci_io_writel(s->dev[idx], s->ram_bar[idx], off, i);
+        break;
+    }
+}
+
+static void op_bar_read(ProxyTestState *s, int idx, unsigned size,
+                        uint32_t i)
+{
+    uint32_t off = ram_offset(size, i);
+
+    switch (size) {
+    case 1:
+        qpci_io_readb(s->dev[idx], s->ram_bar[idx], off);
+        break;
+    case 2:
+        qpci_io_readw(s->dev[idx], s->ram_bar[idx], off);
+        break;
+    default:
+        qpci_io_readl(s->dev[idx], s->ram_bar[idx], off);
+        break;
+    }
+}
+
+static void test_config_read(void)
+{
+    ProxyTestState s;
+
+    proxy_test_start(&s, 1, &transports[0]);
+
+    g_assert_cmphex(qpci_config_readw(s.dev[0], PCI_VENDOR_ID), ==,
+                    LSI_VENDOR_ID);
+    g_assert_cmphex(qpci_config_readw(s.dev[0], PCI_DEVICE_ID), ==,
+                    LSI_DEVICE_ID);
+
+    proxy_test_end(&s);
+}
+
+static void test_bar_rw(const void *opaque)
+{
+    ProxyTestState s;
+    uint32_t i;
+
+    proxy_test_start(&s, 2, opaque);
+
+    /* The io BAR is accessed one byte at a time */
+    qpci_io_writel(s.dev[0], s.io_bar[0], LSI_SCRATCHA, 0x12345678);
+    qpci_io_writel(s.dev[1], s.io_bar[1], LSI_SCRATCHA, 0x9abcdef0);
+    g_assert_cmphex(qpci_io_readl(s.dev[0], s.io_bar[0], LSI_SCRATCHA), ==,
+                    0x12345678);
+    g_assert_cmphex(qpci_io_readl(s.dev[1], s.io_bar[1], LSI_SCRATCHA), ==,
+                    0x9abcdef0);
+
+    for (i = 0; i < 64; i++) {
+        qpci_io_writel(s.dev[i % 2], s.ram_bar[i % 2], i * 4, i);
+    }
+    for (i = 0; i < 64; i++) {
+        g_assert_cmphex(qpci_io_readl(s.dev[i % 2], s.ram_bar[i % 2], i * 4),
+                        ==, i);
+    }
+
+    proxy_test_end(&s);
+}
+
+static int cmp_int64(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Latencies include the round trip over the qtest socket, which is the
+ * same for every transport of the proxy link; compare results across
+ * builds rather than reading them as absolute numbers. Devices live in
+ * separate remote processes and are accessed round-robin.
+ */
+static void test_bench(const void *opaque)
+{
+    const ProxyBench *b = opaque;
+    ProxyTestState s;
+    int64_t *lat, start, elapsed;
+    uint32_t i;
+
+    proxy_test_start(&s, b->ndevs, b->transport);
+
+    lat = g_new(int64_t, BENCH_ITERATIONS);
+
+    start = get_clock();
+    for (i = 0; i < BENCH_ITERATIONS; i++) {
+        lat[i] = get_clock();
+        b->op(&s, i % b->ndevs, b->size, i);
+        lat[i] = get_clock() - lat[i];
+    }
+    elapsed = get_clock() - start;
+
+    qsort(lat, BENCH_ITERATIONS, sizeof(*lat), cmp_int64);
+
+    g_print("%s/%s: size %u devices %d: %.0f ops/s p50 %" PRId64 " ns"
+            " p99 %" PRId64 " ns\n", b->transport->name, b->name, b->size,
+            b->ndevs,
+            BENCH_ITERATIONS * (double)NANOSECONDS_PER_SECOND / elapsed,
+            lat[BENCH_ITERATIONS / 2], lat[BENCH_ITERATIONS * 99 / 100]);
+
+    g_free(lat);
+    proxy_test_end(&s);
+}
+
+static void add_bench(const char *name, ProxyTestOp op)
+{
+    static const unsigned sizes[] = { 1, 2, 4 };
+    static const int ndevs[] = { 1, 2, 4 };
+    ProxyBench *b;
+    char *path;
+    int i, j, k;
+
+    for (k = 0; k < ARRAY_SIZE(transports); k++) {
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+            for (j = 0; j < ARRAY_SIZE(ndevs); j++) {
+                b = g_new0(ProxyBench, 1);
+                b->name = name;
+                b->op = op;
+                b->size = sizes[i];
+                b->ndevs = ndevs[j];
+                b->transport = &transports[k];
+
+                path = g_strdup_printf("/proxy-link/bench/%s/%s/size-%u/"
+                                       "devices-%d", transports[k].name,
+                                       name, sizes[i], ndevs[j]);
+                qtest_add_data_func(path, b, test_bench);
+                g_free(path);
+            }
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *qemu = getenv("QTEST_QEMU_BINARY");
+    char *dir, *prog, *path;
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    /* QEMU looks for the remote program in PATH, next to its own binary */
+    dir = g_path_get_dirname(qemu ? qemu : ".");
+    prog = g_build_filename(dir, REMOTE_PROG, NULL);
+    if (!g_file_test(prog, G_FILE_TEST_IS_EXECUTABLE)) {
+        g_test_message("Skipping proxy link tests, %s not found", prog);
+        g_free(prog);
+        g_free(dir);
+        return 0;
+    }
+    path = g_strdup_printf("%s:%s", dir, g_getenv("PATH") ?: "");
+    g_setenv("PATH", path, true);
+    g_free(path);
+    g_free(prog);
+    g_free(dir);
+
+    qtest_add_func("/proxy-link/config-read", test_config_read);
+    for (i = 0; i < ARRAY_SIZE(transports); i++) {
+        path = g_strdup_printf("/proxy-link/%s/bar-rw", transports[i].name);
+        qtest_add_data_func(path, &transports[i], test_bar_rw);
+        g_free(path);
+    }
+
+    if (g_test_perf()) {
+        add_bench("config-read", op_config_read);
+        add_bench("bar-write", op_bar_write);
+        add_bench("bar-read", op_bar_read);
+    }
+
+    return g_test_run();
+}
@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,53 @@ static void test_encode_decode(void)
     }
 }
 
+/* Run the encoder tests with every encoder the host supports */
+static void test_encode_decode_accel(void)
+{
+    do {
+        test_encode_decode_zero();
+        test_encode_decode_unchanged();
+        test_encode_decode_1_byte();
+        test_encode_decode_overflow();
+        test_encode_decode();
+    } while (test_xbzrle_encode_next_accel());
+}
+
+static void test_page_cache_lru(void)
+{
+    /* two sets of four pages, even page numbers share the first set */
+    PageCache *cache = cache_init(8 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    uint64_t i;
+
+    for (i = 0; i < 4; i++) {
+        g_assert(!cache_set_is_full(cache, 2 * i * PAGE_SIZE));
+        page[0] = i;
+        g_assert(cache_insert(cache, 2 * i * PAGE_SIZE, page, 0) == 0);
+    }
+    g_assert(cache_set_is_full(cache, 8 * PAGE_SIZE));
+    g_assert(!cache_set_is_full(cache, PAGE_SIZE));
+
+    /* all pages are fresh, nothing can be evicted */
+    g_assert(cache_insert(cache, 8 * PAGE_SIZE, page, 1) == -1);
+
+    /* page 0 is the most recently used, page 2 is the oldest */
+    g_assert(cache_is_cached(cache, 0, 10));
+    g_assert(cache_insert(cache, 8 * PAGE_SIZE, page, 10) == 0);
+    g_assert(cache_is_cached(cache, 0, 10));
+    g_assert(!cache_is_cached(cache, 2 * PAGE_SIZE, 10));
+    g_assert(get_cached_data(cache, 2 * PAGE_SIZE) == NULL);
+    g_assert(get_cached_data(cache, 4 * PAGE_SIZE)[0] == 2);
+
+    cache_remove(cache, 4 * PAGE_SIZE);
+    g_assert(!cache_is_cached(cache, 4 * PAGE_SIZE, 10));
+    g_assert(!cache_set_is_full(cache, 2 * PAGE_SIZE));
+    g_assert(cache_insert(cache, 2 * PAGE_SIZE, page, 10) == 0);
+
+    cache_fini(cache);
+    g_free(page);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +235,8 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_decode_accel", test_encode_decode_accel);
+    g_test_add_func("/xbzrle/page_cache_lru", test_page_cache_lru);
 
     return g_test_run();
 }
@@ -67,22 +67,30 @@ static char *drive_create(void)
     return tmp_path;
 }
 
-static QOSState *pci_test_start(void)
+/*
+ * @extra_args is added to the command line, @dev_opts to the options of the
+ * virtio-blk-pci device
+ */
+static QOSState *pci_test_start_opts(const char *extra_args,
+                                     const char *dev_opts)
 {
     QOSState *qs;
     const char *arch = qtest_get_arch();
     char *tmp_path;
-    const char *cmd = "-drive if=none,id=drive0,file=%s,format=raw "
+    const char *cmd = "%s "
+                      "-drive if=none,id=drive0,file=%s,format=raw "
                       "-drive if=none,id=drive1,file=null-co://,format=raw "
                       "-device virtio-blk-pci,id=drv0,drive=drive0,"
-                      "addr=%x.%x";
+                      "addr=%x.%x%s";
 
     tmp_path = drive_create();
 
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
-        qs = qtest_pc_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_pc_boot(cmd, extra_args, tmp_path, PCI_SLOT, PCI_FN,
+                           dev_opts);
     } else if (strcmp(arch, "ppc64") == 0) {
-        qs = qtest_spapr_boot(cmd, tmp_path, PCI_SLOT, PCI_FN);
+        qs = qtest_spapr_boot(cmd, extra_args, tmp_path, PCI_SLOT, PCI_FN,
+                              dev_opts);
     } else {
         g_printerr("virtio-blk tests are only available on x86 or ppc64\n");
         exit(EXIT_FAILURE);
@@ -93,6 +101,11 @@ static QOSState *pci_test_start(void)
     return qs;
 }
 
+static QOSState *pci_test_start(void)
+{
+    return pci_test_start_opts("", "");
+}
+
 static void arm_test_start(void)
 {
     char *tmp_path;
@@ -795,6 +808,102 @@ static void pci_hotplug(void)
     qtest_shutdown(qs);
 }
 
+/*
+ * Read or write sector @sector through @vq and check the request status.
+ * @data is the string to write, or a 512 byte buffer for the data read.
+ */
+static void rw_sector(QVirtioDevice *dev, QGuestAllocator *alloc,
+                      QVirtQueue *vq, uint32_t type, uint64_t sector,
+                      char *data)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t status;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    if (type == VIRTIO_BLK_T_OUT) {
+        strcpy(req.data, data);
+    }
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, NULL, QVIRTIO_BLK_TIMEOUT_US);
+    status = readb(req_addr + 528);
+    g_assert_cmpint(status, ==, 0);
+
+    if (type == VIRTIO_BLK_T_IN) {
+        memread(req_addr + 16, data, 512);
+    }
+
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * Spread two virtqueues over two IOThreads and check that data written
+ * through one of them can be read back through the other.
+ */
+static void pci_iothreads(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *vqpci[2];
+    uint32_t features;
+    char data[512];
+    int i;
+
+    qs = pci_test_start_opts("-object iothread,id=io0 "
+                             "-object iothread,id=io1",
+                             ",num-queues=2,len-iothreads=2,"
+                             "iothreads[0]=io0,iothreads[1]=io1");
+    dev = virtio_blk_pci_init(qs->pcibus, PCI_SLOT);
+
+    features = qvirtio_get_features(&dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&dev->vdev, features);
+
+    for (i = 0; i < 2; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, i);
+    }
+
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    for (i = 0; i < 2; i++) {
+        rw_sector(&dev->vdev, qs->alloc, &vqpci[i]->vq, VIRTIO_BLK_T_OUT, i,
+                  i ? "TEST1" : "TEST0");
+    }
+    for (i = 0; i < 2; i++) {
+        rw_sector(&dev->vdev, qs->alloc, &vqpci[!i]->vq, VIRTIO_BLK_T_IN, i,
+                  data);
+        g_assert_cmpstr(data, ==, i ? "TEST1" : "TEST0");
+    }
+
+    /* Reset stops dataplane, which must wait for both IOThreads */
+    qvirtio_reset(&dev->vdev);
+
+    /* End test */
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_cleanup(dev->vdev.bus, &vqpci[i]->vq, qs->alloc);
+    }
+    qvirtio_pci_device_disable(dev);
+    qvirtio_pci_device_free(dev);
+    qtest_shutdown(qs);
+}
+
 /*
  * Check that setting the vring addr on a non-existent virtqueue does
  * not crash.
@@ -875,6 +984,7 @@ int main(int argc, char **argv)
             qtest_add_func("/virtio/blk/pci/idx", pci_idx);
         }
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
+        qtest_add_func("/virtio/blk/pci/iothreads", pci_iothreads);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
     }